@@ -0,0 +1,140 @@
+#define _GNU_SOURCE
+
+#include "archive.h"
+
+#include "client_protocol.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ARCHIVE_MAGIC       0x52415243   // "RARC"
+#define ARCHIVE_HEADER_LEN  0x1000
+
+int archive_open(struct archive *archive, const char *path, size_t data_len) {
+  memset(archive, 0, sizeof(*archive));
+  archive->map_len = ARCHIVE_HEADER_LEN + SHM_RING_HEADER_LEN + data_len +
+                     ARCHIVE_INDEX_ENTRIES * sizeof(struct archive_entry);
+  archive->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (archive->fd < 0) return -1;
+
+  struct stat st;
+  if (fstat(archive->fd, &st) < 0) goto handle_errors;
+  bool fresh = (size_t) st.st_size != archive->map_len;
+  // allocated up front, so that writing into the mapping can't hit ENOSPC (SIGBUS)
+  if (fresh && (ftruncate(archive->fd, 0) < 0 ||
+                (errno = posix_fallocate(archive->fd, 0, archive->map_len)) != 0))
+    goto handle_errors;
+
+  archive->map = mmap(NULL, archive->map_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      archive->fd, 0);
+  if (archive->map == MAP_FAILED) {
+    archive->map = NULL;
+    goto handle_errors;
+  }
+  archive->header = archive->map;
+  archive->index = (struct archive_entry *) ((char *) archive->map + ARCHIVE_HEADER_LEN +
+                                             SHM_RING_HEADER_LEN + data_len);
+  if (archive->header->magic != ARCHIVE_MAGIC || archive->header->data_len != data_len ||
+      archive->header->index_entries != ARCHIVE_INDEX_ENTRIES) {
+    archive->header->magic = 0;
+    archive->header->index_entries = ARCHIVE_INDEX_ENTRIES;
+    archive->header->data_len = data_len;
+    atomic_store(&archive->header->index_count, 0);
+    archive->header->magic = ARCHIVE_MAGIC;
+  }
+  if (shm_ring_init(&archive->ring, (char *) archive->map + ARCHIVE_HEADER_LEN, data_len) < 0)
+    goto handle_errors;
+  if (shm_ring_head(&archive->ring) == 0) // (re)initialized ring, old entries point nowhere
+    atomic_store(&archive->header->index_count, 0);
+
+  archive->metadata_pos = NO_METADATA;
+  archive->written_back = archive->ring.pos;
+  // written sequentially, read back (for replays) mostly near the end
+  madvise(archive->map, archive->map_len, MADV_SEQUENTIAL);
+  return 0;
+
+  handle_errors:;
+  int saved_errno = errno;
+  if (archive->map) munmap(archive->map, archive->map_len);
+  close(archive->fd);
+  errno = saved_errno;
+  return -1;
+}
+
+void archive_close(struct archive *archive) {
+  if (!archive->map) return;
+  munmap(archive->map, archive->map_len);
+  close(archive->fd);
+  archive->map = NULL;
+}
+
+int archive_append(struct archive *archive, uint16_t type, const void *data, size_t len) {
+  uint64_t now = realtime_us();
+  struct archive_header *header = archive->header;
+  if (now - archive->last_index_us >= ARCHIVE_INDEX_US) {
+    uint64_t count = atomic_load_explicit(&header->index_count, memory_order_relaxed);
+    struct archive_entry *entry = &archive->index[count % ARCHIVE_INDEX_ENTRIES];
+    entry->time_us = now;
+    entry->pos = archive->ring.pos;
+    entry->metadata_pos = archive->metadata_pos;
+    atomic_store_explicit(&header->index_count, count + 1, memory_order_release);
+    archive->last_index_us = now;
+  }
+  if (type == METADATA && len > 0) archive->metadata_pos = archive->ring.pos;
+  return shm_ring_write(&archive->ring, type, data, len);
+}
+
+static void write_back(struct archive *archive, uint64_t from, uint64_t to) {
+  size_t ring_offset = ARCHIVE_HEADER_LEN + SHM_RING_HEADER_LEN;
+  size_t data_len = archive->ring.data_len;
+  while (from < to) {
+    size_t offset = from & (data_len - 1);
+    size_t len = to - from < data_len - offset ? to - from : data_len - offset;
+    sync_file_range(archive->fd, ring_offset + offset, len, SYNC_FILE_RANGE_WRITE);
+    from += len;
+  }
+}
+
+void archive_publish(struct archive *archive) {
+  shm_ring_publish(&archive->ring);
+  // starts writeback early: the page cache holds a steady trickle of dirty
+  // pages instead of flushing the whole archive in bursts
+  if (archive->ring.pos - archive->written_back >= ARCHIVE_WRITEBACK) {
+    write_back(archive, archive->written_back, archive->ring.pos);
+    archive->written_back = archive->ring.pos;
+  }
+}
+
+int archive_seek(const struct archive *archive, uint64_t time_us, struct archive_entry *entry) {
+  const struct archive_header *header = archive->header;
+  uint64_t count = atomic_load_explicit(&header->index_count, memory_order_acquire);
+  uint64_t head = shm_ring_head(&archive->ring);
+  // the writer may be filling slot count % entries right now
+  uint64_t first = count >= ARCHIVE_INDEX_ENTRIES ? count - ARCHIVE_INDEX_ENTRIES + 1 : 0;
+  if (first >= count) return -1;
+
+  // entries are ordered by both pos and time; skip those whose data is gone
+  uint64_t low = first, high = count - 1;
+  uint64_t oldest = head > archive->ring.data_len ? head - archive->ring.data_len : 0;
+  while (low < high) {
+    uint64_t mid = low + (high - low) / 2;
+    if (archive->index[mid % ARCHIVE_INDEX_ENTRIES].pos < oldest) low = mid + 1;
+    else high = mid;
+  }
+  // then the last one written at or before time_us
+  high = count - 1;
+  while (low < high) {
+    uint64_t mid = low + (high - low + 1) / 2;
+    if (archive->index[mid % ARCHIVE_INDEX_ENTRIES].time_us <= time_us) low = mid;
+    else high = mid - 1;
+  }
+  *entry = archive->index[low % ARCHIVE_INDEX_ENTRIES];
+  return 0;
+}
@@ -0,0 +1,63 @@
+#ifndef _RADIO_ARCHIVE_H_
+#define _RADIO_ARCHIVE_H_
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "shm_ring.h"
+
+#define ARCHIVE_INDEX_US       250000    // time index granularity
+#define ARCHIVE_INDEX_ENTRIES  65536     // ~4.5 h of index
+#define ARCHIVE_WRITEBACK      0x100000  // dirty data started to disk in such chunks
+#define ARCHIVE_DEFAULT_MB     64
+
+#define NO_METADATA  UINT64_MAX
+
+/* Time-shift archive: a file mapped into memory holding the demuxed stream
+ * as a ring of records (the same format as the local delivery ring, so
+ * audio and metadata stay in order) plus a sparse time index. The file
+ * survives restarts and is continued by the next process.
+
+ * File layout: struct archive_header (one page), the ring (its header and
+ * data_len bytes), ARCHIVE_INDEX_ENTRIES entries of the index.         */
+struct archive_entry {
+  uint64_t time_us;        // CLOCK_REALTIME when the record at pos was written
+  uint64_t pos;            // record boundary in the ring
+  uint64_t metadata_pos;   // last METADATA record before pos, NO_METADATA if none
+};
+
+struct archive_header {
+  uint32_t magic;
+  uint32_t index_entries;
+  uint64_t data_len;
+  _Atomic uint64_t index_count;   // entries ever written, entry i is in slot i % index_entries
+};
+
+struct archive {
+  int fd;
+  void *map;
+  size_t map_len;
+  struct archive_header *header;
+  struct shm_ring ring;
+  struct archive_entry *index;
+  uint64_t last_index_us;
+  uint64_t metadata_pos;
+  uint64_t written_back;   // ring position up to which writeback was started
+};
+
+/* data_len has to be a power of two */
+int archive_open(struct archive *archive, const char *path, size_t data_len);
+
+void archive_close(struct archive *archive);
+
+/* called from the ingest thread only */
+int archive_append(struct archive *archive, uint16_t type, const void *data, size_t len);
+
+void archive_publish(struct archive *archive);
+
+/* the last index entry written at or before time_us (or the oldest one
+ * still in the ring), -1 if the archive is empty                       */
+int archive_seek(const struct archive *archive, uint64_t time_us, struct archive_entry *entry);
+
+#endif  // _RADIO_ARCHIVE_H_
@@ -0,0 +1,175 @@
+#define _GNU_SOURCE
+
+#include "audio_output.h"
+
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+int audio_output_init(struct audio_output *out, int mode, int fd, size_t slot_len) {
+  memset(out, 0, sizeof(*out));
+  out->fd = fd;
+  out->mode = mode;
+  out->slot_len = slot_len;
+
+  if (mode == OUTPUT_SPLICE) {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISFIFO(st.st_mode)) {
+      out->mode = OUTPUT_WRITEV;
+    } else {
+      // may fail above /proc/sys/fs/pipe-max-size, the current size is fine then
+      fcntl(fd, F_SETPIPE_SZ, OUTPUT_PIPE_SIZE);
+      int size = fcntl(fd, F_GETPIPE_SZ);
+      if (size < 0) return -1;
+      out->pipe_size = size;
+    }
+  }
+
+  out->ring = aligned_alloc(sysconf(_SC_PAGESIZE), RECV_SLOTS * slot_len);
+  out->spliced_end = calloc(RECV_SLOTS, sizeof(uint64_t));
+  if (!out->ring || !out->spliced_end) {
+    audio_output_destroy(out);
+    return -1;
+  }
+  return 0;
+}
+
+void audio_output_destroy(struct audio_output *out) {
+  free(out->ring);
+  free(out->spliced_end);
+  out->ring = NULL;
+  out->spliced_end = NULL;
+}
+
+/* whether the pipe reader has consumed everything up to the given point */
+static int consumed(struct audio_output *out, uint64_t end, bool *result) {
+  if (out->bytes_spliced - end >= out->pipe_size) {
+    // the pipe never holds more than pipe_size bytes
+    *result = true;
+    return 0;
+  }
+  int in_pipe;
+  if (ioctl(out->fd, FIONREAD, &in_pipe) < 0) return -1;
+  *result = out->bytes_spliced - (uint64_t) in_pipe >= end;
+  return 0;
+}
+
+int audio_output_prepare_batch(struct audio_output *out) {
+  if (out->head + RECV_BATCH > RECV_SLOTS) out->head = 0;
+  if (out->mode != OUTPUT_SPLICE) return 0;
+
+  uint64_t last_end = 0;
+  for (size_t i = out->head; i < out->head + RECV_BATCH; ++i)
+    last_end = MAX(last_end, out->spliced_end[i]);
+
+  if (last_end > 0) {
+    bool ok;
+    long wait_us = OUTPUT_WAIT_MIN_US;
+    for (;;) {
+      if (consumed(out, last_end, &ok) < 0) return -1;
+      if (ok) break;
+      // reader is slower than the stream - as if a write blocked
+      struct pollfd pfd = {.fd = out->fd, .events = POLLOUT};
+      int ready = poll(&pfd, 1, 0);
+      if (ready < 0 && errno != EINTR) return -1;
+      if (ready == 0) { // a full pipe says when the reader has taken some
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) return -1;
+        continue;
+      }
+      // slots without audio took no room in the pipe, so it has some anyway
+      struct timespec wait = {0, wait_us * 1000};
+      nanosleep(&wait, NULL);
+      wait_us = MIN(wait_us * 2, OUTPUT_WAIT_MAX_US);
+    }
+    memset(&out->spliced_end[out->head], 0, RECV_BATCH * sizeof(uint64_t));
+  }
+  return 0;
+}
+
+char *audio_output_slot(struct audio_output *out, size_t i) {
+  return out->ring + (out->head + i) * out->slot_len;
+}
+
+static int flush_pending(struct audio_output *out) {
+  struct iovec *iov = out->pending;
+  size_t count = out->pending_count;
+  out->pending_count = 0;
+
+  if (out->mode == OUTPUT_SPLICE) {
+    for (size_t k = 0; k < count; ++k) {
+      out->bytes_spliced += iov[k].iov_len;
+      out->spliced_end[out->pending_slot[k]] = out->bytes_spliced;
+    }
+  }
+
+  while (count > 0) {
+    ssize_t ret;
+    if (out->mode == OUTPUT_SPLICE)
+      ret = vmsplice(out->fd, iov, count, 0);
+    else
+      ret = writev(out->fd, iov, count);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    while (count > 0 && (size_t) ret >= iov->iov_len) {
+      ret -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *) iov->iov_base + ret;
+      iov->iov_len -= ret;
+    }
+  }
+  return 0;
+}
+
+int audio_output_write(struct audio_output *out, size_t i, const char *data, size_t len) {
+  if (len == 0) return 0;
+  if (out->mode == OUTPUT_STDIO)
+    return fwrite(data, 1, len, stdout) == len ? 0 : -1;
+  if (i == OUTPUT_NO_SLOT) {
+    // copied into the pipe, it still counts for what the reader has consumed
+    if (out->pending_count > 0 && flush_pending(out) < 0) return -1;
+    if (out->mode == OUTPUT_SPLICE) out->bytes_spliced += len;
+    while (len > 0) {
+      ssize_t ret = write(out->fd, data, len);
+      if (ret < 0) {
+        if (errno == EINTR) continue;
+        return -1;
+      }
+      data += ret;
+      len -= ret;
+    }
+    return 0;
+  }
+
+  if (out->pending_count == SIZE(out->pending) && flush_pending(out) < 0)
+    return -1;
+  struct iovec *iov = &out->pending[out->pending_count];
+  iov->iov_base = (void *) data;
+  iov->iov_len = len;
+  out->pending_slot[out->pending_count++] = out->head + i;
+  return 0;
+}
+
+int audio_output_flush(struct audio_output *out) {
+  if (out->mode == OUTPUT_STDIO) return fflush(stdout) == 0 ? 0 : -1;
+  return out->pending_count > 0 ? flush_pending(out) : 0;
+}
+
+int audio_output_finish_batch(struct audio_output *out, size_t used) {
+  int ret = out->pending_count > 0 ? flush_pending(out) : 0;
+  out->head += used;
+  return ret;
+}
@@ -0,0 +1,64 @@
+#ifndef _RADIO_AUDIO_OUTPUT_H_
+#define _RADIO_AUDIO_OUTPUT_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "client_protocol.h"
+
+#define OUTPUT_STDIO   0   // fwrite per datagram
+#define OUTPUT_WRITEV  1   // one writev per received batch, straight from the slots
+#define OUTPUT_SPLICE  2   // vmsplice of the slots into the stdout pipe
+
+#define RECV_BATCH     32
+#define RECV_SLOT_LEN  V2_MAX_DGRAM_LEN  // what proxies send to v2 clients, longer ones spill
+#define RECV_SLOTS     (32 * RECV_BATCH)
+#define OUTPUT_NO_SLOT ((size_t) -1)     // data lying outside the slots, written out at once
+
+#define OUTPUT_WAIT_MIN_US  50    // for the pipe reader, doubled up to the max
+#define OUTPUT_WAIT_MAX_US  2000
+
+#define OUTPUT_PIPE_SIZE  0x100000     // requested with F_SETPIPE_SZ
+
+/* Receive slots double as the output buffers: datagrams are received into
+ * a ring of slots and their audio payload is written out from there. In
+ * splice mode the pipe keeps referencing the slot pages until the reader
+ * consumes them, so a slot is reused only after that.                 */
+struct audio_output {
+  int mode;
+  int fd;
+  size_t slot_len;
+  char *ring;
+  uint64_t *spliced_end;   // per slot: bytes_spliced right after its data, 0 if none
+  uint64_t bytes_spliced;
+  size_t pipe_size;
+  size_t head;             // first slot of the current batch
+  struct iovec pending[RECV_BATCH];
+  size_t pending_slot[RECV_BATCH];
+  size_t pending_count;
+};
+
+/* OUTPUT_SPLICE falls back to OUTPUT_WRITEV when fd is not a pipe;
+ * slot_len is the longest record expected, a multiple of 64        */
+int audio_output_init(struct audio_output *out, int mode, int fd, size_t slot_len);
+
+void audio_output_destroy(struct audio_output *out);
+
+/* waits until the slots of the next batch may be overwritten */
+int audio_output_prepare_batch(struct audio_output *out);
+
+char *audio_output_slot(struct audio_output *out, size_t i);
+
+/* queues len bytes lying inside slot i of the current batch, or writes
+ * them out right away (after what is queued) for i == OUTPUT_NO_SLOT */
+int audio_output_write(struct audio_output *out, size_t i, const char *data, size_t len);
+
+/* writes out what is queued so far (stdio buffers too), the batch goes on */
+int audio_output_flush(struct audio_output *out);
+
+/* writes out everything queued and moves past the used slots */
+int audio_output_finish_batch(struct audio_output *out, size_t used);
+
+#endif  // _RADIO_AUDIO_OUTPUT_H_
@@ -1,13 +1,22 @@
 #include "client_protocol.h"
 
+#include "utils.h"
+
+#include <arpa/inet.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 
 client_list_t client_list = NULL;
 
+_Atomic size_t client_count = 0;
+_Atomic size_t v2_clients = 0;
+
 void add_client(client_list_t *client_list, struct client *client) {
   client->next = *client_list;
   *client_list = client;
+  client_count++;
+  if (client->version >= PROTOCOL_V2) v2_clients++;
 }
 
 void erase_nonvalid_elements(client_list_t *client_list) {
@@ -19,6 +28,10 @@ void erase_nonvalid_elements(client_list_t *client_list) {
       if (previous) previous->next = current->next;
       current = current->next;
       if (*client_list == tmp) *client_list = tmp->next;
+      client_count--;
+      if (tmp->version >= PROTOCOL_V2) v2_clients--;
+      free(tmp->latency);
+      free(tmp->xdp_peer);
       free(tmp);
     } else {
       previous = current;
@@ -37,6 +50,42 @@ void clear_list(client_list_t *client_list) {
   while (*client_list) {
     struct client *client = *client_list;
     *client_list = client->next;
+    client_count--;
+    if (client->version >= PROTOCOL_V2) v2_clients--;
+    free(client->latency);
+    free(client->xdp_peer);
     free(client);
   }
 }
+
+void record_iter_init(struct record_iter *iter, const void *dgram, size_t len) {
+  iter->pos = dgram;
+  iter->left = len;
+}
+
+const struct client_protocol_dgram *record_next(struct record_iter *iter) {
+  if (iter->left < CLIENT_PROTO_DGRAM_HEADER_LEN) return NULL;
+  const struct client_protocol_dgram *record = (const struct client_protocol_dgram *) iter->pos;
+  size_t length = ntohs(record->length);
+  if (length > iter->left - CLIENT_PROTO_DGRAM_HEADER_LEN) {
+    iter->left = 0; // truncated record - nothing after it can be trusted
+    return NULL;
+  }
+  size_t step = CLIENT_PROTO_DGRAM_HEADER_LEN + length;
+  step = MIN(step + (step & 1), iter->left);
+  iter->pos += step;
+  iter->left -= step;
+  return record;
+}
+
+bool record_find(const void *dgram, size_t dgram_len, uint16_t type, void *data, size_t len) {
+  struct record_iter iter;
+  record_iter_init(&iter, dgram, dgram_len);
+  const struct client_protocol_dgram *record;
+  while ((record = record_next(&iter)) != NULL) {
+    if (ntohs(record->type) != type || ntohs(record->length) < len) continue;
+    memcpy(data, record->data, len);
+    return true;
+  }
+  return false;
+}
@@ -3,7 +3,9 @@
 
 #include <netinet/in.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <time.h>
 
@@ -16,28 +18,122 @@
 #define KEEPALIVE   3
 #define AUDIO       4
 #define METADATA    6
+#define LOAD        7   // v2 only, follows IAM in the same datagram
+#define PATH        8   // v2 only, follows IAM: 64-bit node ids, origin first
+#define REPLAY      9   // client -> proxy: uint32 seconds back (network order), 0 - live
+#define STAMP       10  // v2 only, the first record of a stream datagram: struct stamp_info
+#define CLOCK       11  // v2 only, after DISCOVER/KEEPALIVE and in answers: struct clock_info
+#define PLAYOUT     12  // v2 client -> proxy, after KEEPALIVE: struct playout_report
+#define LEASE       13  // v2 only, follows IAM and CLOCK answers: uint32 ms between KEEPALIVEs
+#define COOKIE      14  // v2 only, follows IAM and is echoed after KEEPALIVE: uint64
+
+#define KEEPALIVE_INTERVAL_MS  3500   // without a LEASE
+#define LEASE_JITTER_PCT       20     // renewals come up to that much early, spread
 
 #define UDP_BUFFER_LEN  0x10000
 
 #define CLIENT_PROTO_DGRAM_HEADER_LEN (2 * sizeof(uint16_t))
 
+/* Protocol v1: one record (header + data) per datagram.
+ * Protocol v2: a datagram holds several records, each padded to an even
+ * length so that the next header stays aligned. A v1 datagram is also a
+ * valid v2 one. A client asks for v2 by sending the version as a single
+ * byte of DISCOVER data (v1 proxies ignore it).                        */
+#define PROTOCOL_V1  1
+#define PROTOCOL_V2  2
+
+#define V2_MAX_DGRAM_LEN  1472   // Ethernet MTU - IPv4 and UDP headers
+
 struct client_protocol_dgram {
   uint16_t type;
   uint16_t length;
   char data[];
 };
 
+/* data of a LOAD record, network order */
+struct load_info {
+  uint32_t clients;
+  uint32_t max_clients;    // 0 - no limit
+};
+
+/* data of a STAMP record, network order: datagram number (per proxy and
+ * stream) and CLOCK_REALTIME of the upstream read of its oldest data,
+ * at the origin proxy                                                 */
+struct stamp_info {
+  uint32_t seq;
+  uint32_t ingest_us_hi;
+  uint32_t ingest_us_lo;
+};
+
+/* KEEPALIVE data of clients reading stamps: delivery since the previous
+ * KEEPALIVE, from the upstream read to the write on the client, network
+ * order (proxies not stamping get no data)                             */
+struct delivery_report {
+  uint32_t samples;        // stamped datagrams written
+  uint32_t lost;           // datagrams missing in the sequence
+  uint32_t min_us;
+  uint32_t p50_us;
+  uint32_t p99_us;
+};
+
+/* CLOCK data, network order, CLOCK_REALTIME in us split in halves: a
+ * client sends its time in transmit, the proxy echoes it in origin and
+ * adds when it got the probe and when the answer went out (as in NTP) */
+struct clock_info {
+  uint32_t origin_hi;
+  uint32_t origin_lo;
+  uint32_t receive_hi;
+  uint32_t receive_lo;
+  uint32_t transmit_hi;
+  uint32_t transmit_lo;
+};
+
+/* PLAYOUT data of clients writing audio at STAMP time + a fixed latency:
+ * how late it got written (in the proxy's clock) since the previous
+ * report, network order                                               */
+struct playout_report {
+  uint32_t samples;
+  uint32_t late;           // written more than PLAYOUT_LATE_US late
+  uint32_t p50_us;
+  uint32_t p99_us;
+  uint32_t clock_delay_us; // round trip of the clock sample in use, the offset is within half
+};
+
+/* bounds-checked iteration over records of a received datagram */
+struct record_iter {
+  const char *pos;
+  size_t left;
+};
+
+void record_iter_init(struct record_iter *iter, const void *dgram, size_t len);
+
+/* NULL when there are no more (complete) records */
+const struct client_protocol_dgram *record_next(struct record_iter *iter);
+
+/* copies data of the first record of type with at least len bytes of it */
+bool record_find(const void *dgram, size_t dgram_len, uint16_t type, void *data, size_t len);
+
 struct client_routine_data {
   struct client_protocol_dgram *iam_packet;
   uint16_t iam_packet_len;
+  const char *iam_extra;   // records v2 clients get after IAM (even length)
+  size_t iam_extra_len;
   int sock;
 };
 
+struct client_latency;
+struct xdp_peer;
+
 struct client {
   time_t last_keepalive;
   struct sockaddr_in client_address;
   struct client *next;
   bool valid;
+  bool replaying;          // served by the replay thread, not the live fan-out
+  uint8_t version;
+  uint32_t lease_ms;       // granted by the last LEASE, 0 - none (v1 and old v2 clients)
+  struct client_latency *latency; // from its delivery reports, NULL before the first
+  struct xdp_peer *xdp_peer;       // frame headers of the AF_XDP fan-out, NULL before the first
 };
 
 typedef struct client * client_list_t;
@@ -47,6 +143,10 @@ extern pthread_mutex_t mutex;
 
 extern client_list_t client_list;
 
+// number of listed clients (and of those speaking v2), updated with the list
+extern _Atomic size_t client_count;
+extern _Atomic size_t v2_clients;
+
 #define FOR_LIST(c, list) \
   for (struct client *c = list; c != NULL; c = c->next)
 
@@ -0,0 +1,491 @@
+/* Benchmark of radio-client against a synthetic proxy: it answers
+ * DISCOVER with IAM and, once the client confirms with KEEPALIVE, sends
+ * AUDIO (and METADATA) datagrams at a fixed rate, losing and reordering
+ * some of them on purpose. Audio starts with a sequence number and the
+ * send time, so reading the client's stdout tells what got through and
+ * how late. Without -r the rate is doubled from RAMP_START_KBPS until
+ * more than LOSS_LIMIT of what was sent goes missing.                 */
+
+#define _GNU_SOURCE
+
+#include "client_protocol.h"
+#include "latency.h"
+#include "utils.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define STAMP_LEN         (2 * sizeof(uint64_t))  // seq and send time at the start of audio
+#define MAX_DGRAM_LEN     V2_MAX_DGRAM_LEN
+#define SEND_BATCH        64       // datagrams sent before the output is read again
+#define TICK_US           1000
+#define CONFIRM_TIMEOUT_S 5
+#define DRAIN_US          300000   // after a step, for what is still on its way
+#define RAMP_START_KBPS   64
+#define RAMP_MAX_KBPS     (1 << 20)
+#define LOSS_LIMIT        0.01
+#define OUTPUT_LEN        0x10000
+#define SEQ_RING          (1 << 20)  // datagrams remembered as lost on purpose or not
+
+unsigned rate_kbps = 0;         // 0 - ramp up
+size_t dgram_len = 1024;        // audio bytes per datagram
+double loss = 0;                // fraction of datagrams not sent
+double reorder = 0;             // fraction sent after the next one
+unsigned metadata_every = 0;    // datagrams between METADATA, 0 - none
+unsigned seconds = 3;           // per rate
+
+struct bench {
+  int sock;                     // of the synthetic proxy
+  struct sockaddr_in client;
+  bool confirmed;
+  pid_t pid;
+  int output;                   // the client's stdout
+  unsigned seed;
+  uint64_t seq;                 // of the next audio datagram
+  char held[CLIENT_PROTO_DGRAM_HEADER_LEN + MAX_DGRAM_LEN] __attribute__((aligned(4)));
+  bool holding;                 // a datagram waiting to be sent after the next one
+  uint8_t *lost;                // by seq % SEQ_RING
+  uint64_t first_seq;           // of the current step
+  uint64_t last_out;            // the highest seq seen on stdout
+  bool any_out;
+  // stdout parsing: position within the current datagram's audio
+  size_t offset;
+  char stamp[STAMP_LEN];
+};
+
+struct step {
+  uint64_t sent;                // datagrams, including those lost on purpose
+  uint64_t lost;
+  uint64_t reordered;
+  uint64_t metadata;
+  uint64_t delivered;           // datagrams of this step seen on stdout
+  uint64_t queued;              // not lost, sent after the last one seen (e.g. in stdio buffers)
+  uint64_t bytes;               // written to stdout
+  uint64_t kernel_drops;        // of the client's socket
+  uint64_t cpu_ticks;           // of the client
+  uint64_t ns;
+  struct latency_histogram latency;  // send to stdout read, us
+};
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void print_usage(char *prog_name) {
+  fprintf(stderr, "Usage: %s [-r kB/s] [-s datagram_bytes] [-l loss_%%] [-o reorder_%%]", prog_name);
+  fprintf(stderr, " [-m metadata_every] [-d seconds] radio-client [its options]\n");
+}
+
+static void parse_parameters(int argc, char *argv[]) {
+  int opt;
+
+  // the client's options are not ours
+  while ((opt = getopt(argc, argv, "+r:s:l:o:m:d:")) != -1) {
+    switch (opt) {
+      case 'r':
+        rate_kbps = atoi(optarg);
+        break;
+      case 's':
+        dgram_len = atoi(optarg);
+        break;
+      case 'l':
+        loss = atof(optarg) / 100;
+        break;
+      case 'o':
+        reorder = atof(optarg) / 100;
+        break;
+      case 'm':
+        metadata_every = atoi(optarg);
+        break;
+      case 'd':
+        seconds = atoi(optarg);
+        break;
+      default: /* '?' */
+        print_usage(argv[0]);
+        exit(1);
+    }
+  }
+  if (optind == argc || dgram_len < STAMP_LEN || dgram_len > MAX_DGRAM_LEN ||
+      seconds == 0) {
+    print_usage(argv[0]);
+    exit(1);
+  }
+}
+
+static int free_tcp_port(void) {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in address = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  socklen_t len = sizeof(address);
+  if (sock < 0 || bind(sock, (struct sockaddr *) &address, len) < 0 ||
+      getsockname(sock, (struct sockaddr *) &address, &len) < 0) {
+    perror("free_tcp_port");
+    exit(1);
+  }
+  close(sock);
+  return ntohs(address.sin_port);
+}
+
+/* radio-client with our address and its own options, stdout to a pipe */
+static void start_client(struct bench *bench, char *argv[], int argc) {
+  struct sockaddr_in address;
+  socklen_t len = sizeof(address);
+  if (getsockname(bench->sock, (struct sockaddr *) &address, &len) < 0) {
+    perror("getsockname");
+    exit(1);
+  }
+  char proxy_port[8], telnet_port[8];
+  snprintf(proxy_port, sizeof(proxy_port), "%u", ntohs(address.sin_port));
+  snprintf(telnet_port, sizeof(telnet_port), "%d", free_tcp_port());
+  char **args = malloc((argc + 9) * sizeof(char *));
+  int pipe_fds[2];
+  if (!args || pipe(pipe_fds) < 0) {
+    perror("start_client");
+    exit(1);
+  }
+  size_t n = 0;
+  args[n++] = argv[0];
+  args[n++] = "-H";
+  args[n++] = "127.0.0.1";
+  args[n++] = "-P";
+  args[n++] = proxy_port;
+  args[n++] = "-p";
+  args[n++] = telnet_port;
+  args[n++] = "-a";
+  for (int i = 1; i < argc; ++i) args[n++] = argv[i];
+  args[n] = NULL;
+
+  bench->pid = fork();
+  if (bench->pid < 0) {
+    perror("fork");
+    exit(1);
+  }
+  if (bench->pid == 0) {
+    if (dup2(pipe_fds[1], STDOUT_FILENO) < 0) exit(1);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    execv(args[0], args);
+    perror("execv");
+    _exit(1);
+  }
+  free(args);
+  close(pipe_fds[1]);
+  bench->output = pipe_fds[0];
+  if (fcntl(bench->output, F_SETFL, O_NONBLOCK) < 0) {
+    perror("fcntl");
+    exit(1);
+  }
+}
+
+static uint64_t client_cpu_ticks(pid_t pid) {
+  char path[64], stat[1024];
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+  FILE *file = fopen(path, "r");
+  if (!file) return 0;
+  size_t len = fread(stat, 1, sizeof(stat) - 1, file);
+  fclose(file);
+  stat[len] = '\0';
+  // utime and stime are the 14th and 15th fields, the name may hold spaces
+  char *pos = strrchr(stat, ')');
+  unsigned long utime, stime;
+  if (!pos || sscanf(pos + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                     &utime, &stime) != 2)
+    return 0;
+  return utime + stime;
+}
+
+/* receive queue overflows of the client's socket, from /proc/net/udp */
+static uint64_t kernel_drops(const struct sockaddr_in *client) {
+  FILE *file = fopen("/proc/net/udp", "r");
+  if (!file) return 0;
+  char line[512];
+  uint64_t drops = 0;
+  while (fgets(line, sizeof(line), file)) {
+    unsigned local_port;
+    unsigned long long socket_drops;
+    if (sscanf(line, " %*u: %*x:%x %*x:%*x %*x %*x:%*x %*x:%*x %*x %*u %*u %*u %*u %*x %llu",
+               &local_port, &socket_drops) == 2 && local_port == ntohs(client->sin_port))
+      drops += socket_drops;
+  }
+  fclose(file);
+  return drops;
+}
+
+static int send_dgram(struct bench *bench, const void *dgram, size_t len) {
+  ssize_t ret = sendto(bench->sock, dgram, len, 0, (struct sockaddr *) &bench->client,
+                       (socklen_t) sizeof(bench->client));
+  if (ret < 0 && errno != EAGAIN && errno != ENOBUFS && errno != ECONNREFUSED) {
+    perror("sendto");
+    return -1;
+  }
+  return 0;
+}
+
+/* DISCOVER is answered with IAM, the first KEEPALIVE starts the stream */
+static int handle_control(struct bench *bench) {
+  char buffer[UDP_BUFFER_LEN] __attribute__((aligned(4)));
+  struct sockaddr_in address;
+  for (;;) {
+    socklen_t len = sizeof(address);
+    ssize_t ret = recvfrom(bench->sock, buffer, sizeof(buffer), MSG_DONTWAIT,
+                           (struct sockaddr *) &address, &len);
+    if (ret < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    if (ret < (ssize_t) CLIENT_PROTO_DGRAM_HEADER_LEN) continue;
+    const struct client_protocol_dgram *dgram = (const struct client_protocol_dgram *) buffer;
+    if (ntohs(dgram->type) == DISCOVER) {
+      char iam[CLIENT_PROTO_DGRAM_HEADER_LEN + 16] __attribute__((aligned(4)));
+      struct client_protocol_dgram *reply = (struct client_protocol_dgram *) iam;
+      const char name[] = "client-bench";
+      reply->type = htons(IAM);
+      reply->length = htons(sizeof(name) - 1);
+      memcpy(reply->data, name, sizeof(name) - 1);
+      sendto(bench->sock, iam, CLIENT_PROTO_DGRAM_HEADER_LEN + sizeof(name) - 1, 0,
+             (struct sockaddr *) &address, len);
+    } else if (ntohs(dgram->type) == KEEPALIVE && !bench->confirmed) {
+      bench->client = address;
+      bench->confirmed = true;
+    }
+  }
+}
+
+static void take_output(struct bench *bench, struct step *step, const char *data, size_t len,
+                        uint64_t now) {
+  step->bytes += len;
+  for (size_t i = 0; i < len;) {
+    size_t n = MIN(len - i, dgram_len - bench->offset);
+    if (bench->offset < STAMP_LEN) {
+      size_t stamp_bytes = MIN(n, STAMP_LEN - bench->offset);
+      memcpy(bench->stamp + bench->offset, data + i, stamp_bytes);
+      if (bench->offset + stamp_bytes == STAMP_LEN) {
+        uint64_t seq, sent_ns;
+        memcpy(&seq, bench->stamp, sizeof(seq));
+        memcpy(&sent_ns, bench->stamp + sizeof(seq), sizeof(sent_ns));
+        if (seq >= bench->seq || sent_ns > now) {
+          fprintf(stderr, "stdout is not whole datagrams of audio\n");
+          exit(1);
+        }
+        // the output of an earlier step has been accounted for as queued
+        if (seq >= bench->first_seq) {
+          latency_add(&step->latency, MIN((now - sent_ns) / 1000, UINT32_MAX));
+          step->delivered++;
+        }
+        if (!bench->any_out || seq > bench->last_out) bench->last_out = seq;
+        bench->any_out = true;
+      }
+    }
+    bench->offset = (bench->offset + n) % dgram_len;
+    i += n;
+  }
+}
+
+/* what the client has written so far, -1 at its end */
+static int read_output(struct bench *bench, struct step *step) {
+  char buffer[OUTPUT_LEN];
+  for (;;) {
+    ssize_t len = read(bench->output, buffer, sizeof(buffer));
+    if (len > 0) {
+      take_output(bench, step, buffer, len, now_ns());
+      continue;
+    }
+    if (len == 0) return -1;
+    return errno == EAGAIN || errno == EINTR ? 0 : -1;
+  }
+}
+
+static int send_audio(struct bench *bench, struct step *step) {
+  char buffer[CLIENT_PROTO_DGRAM_HEADER_LEN + MAX_DGRAM_LEN] __attribute__((aligned(4)));
+  struct client_protocol_dgram *dgram = (struct client_protocol_dgram *) buffer;
+  size_t len = CLIENT_PROTO_DGRAM_HEADER_LEN + dgram_len;
+  dgram->type = htons(AUDIO);
+  dgram->length = htons(dgram_len);
+  uint64_t seq = bench->seq++, sent_ns = now_ns();
+  memcpy(dgram->data, &seq, sizeof(seq));
+  memcpy(dgram->data + sizeof(seq), &sent_ns, sizeof(sent_ns));
+  memset(dgram->data + STAMP_LEN, 0x55, dgram_len - STAMP_LEN);
+  step->sent++;
+
+  if (metadata_every > 0 && seq % metadata_every == 0) {
+    char meta[CLIENT_PROTO_DGRAM_HEADER_LEN + 64] __attribute__((aligned(4)));
+    struct client_protocol_dgram *record = (struct client_protocol_dgram *) meta;
+    int meta_len = snprintf(record->data, 60, "StreamTitle='bench %" PRIu64 "';", seq);
+    record->type = htons(METADATA);
+    record->length = htons(meta_len);
+    if (send_dgram(bench, meta, CLIENT_PROTO_DGRAM_HEADER_LEN + meta_len) < 0) return -1;
+    step->metadata++;
+  }
+  bench->lost[seq % SEQ_RING] = (double) rand_r(&bench->seed) / RAND_MAX < loss;
+  if (bench->lost[seq % SEQ_RING]) {
+    step->lost++;
+    return 0;
+  }
+  if (!bench->holding && (double) rand_r(&bench->seed) / RAND_MAX < reorder) {
+    memcpy(bench->held, buffer, len);
+    bench->holding = true;
+    step->reordered++;
+    return 0;
+  }
+  if (send_dgram(bench, buffer, len) < 0) return -1;
+  if (bench->holding) {
+    bench->holding = false;
+    return send_dgram(bench, bench->held, len);
+  }
+  return 0;
+}
+
+/* streams at kbps for the configured time, then waits for stragglers */
+static int run_step(struct bench *bench, unsigned kbps, struct step *step) {
+  memset(step, 0, sizeof(*step));
+  latency_reset(&step->latency);
+  bench->first_seq = bench->seq;
+  uint64_t drops_before = kernel_drops(&bench->client);
+  uint64_t cpu_before = client_cpu_ticks(bench->pid);
+  uint64_t start = now_ns(), end = start + (uint64_t) seconds * 1000000000;
+  double dgrams_per_ns = kbps * 1000.0 / dgram_len / 1e9;
+
+  for (uint64_t now = start; now < end; now = now_ns()) {
+    uint64_t due = (now - start) * dgrams_per_ns;
+    for (unsigned i = 0; step->sent < due && i < SEND_BATCH; ++i)
+      if (send_audio(bench, step) < 0) return -1;
+    if (read_output(bench, step) < 0 || handle_control(bench) < 0) return -1;
+    if (step->sent >= due) {
+      struct pollfd fd = {bench->output, POLLIN, 0};
+      poll(&fd, 1, TICK_US / 1000);
+    }
+  }
+  if (bench->holding) {
+    bench->holding = false;
+    if (send_dgram(bench, bench->held, CLIENT_PROTO_DGRAM_HEADER_LEN + dgram_len) < 0)
+      return -1;
+  }
+  for (uint64_t drain_end = now_ns() + DRAIN_US * 1000ULL; now_ns() < drain_end;) {
+    if (read_output(bench, step) < 0 || handle_control(bench) < 0) return -1;
+    struct pollfd fd = {bench->output, POLLIN, 0};
+    poll(&fd, 1, TICK_US / 1000);
+  }
+  step->ns = now_ns() - start;
+  uint64_t seq = bench->any_out ? MAX(bench->last_out + 1, bench->first_seq) : bench->first_seq;
+  for (seq = MAX(seq, bench->seq - MIN(bench->seq, SEQ_RING)); seq < bench->seq; ++seq)
+    if (!bench->lost[seq % SEQ_RING]) step->queued++;
+  step->kernel_drops = kernel_drops(&bench->client) - drops_before;
+  step->cpu_ticks = client_cpu_ticks(bench->pid) - cpu_before;
+  return 0;
+}
+
+/* datagrams sent (not lost on purpose) that did not come out, nor can anymore */
+static uint64_t step_missing(const struct step *step) {
+  uint64_t expected = step->sent - step->lost;
+  return expected - MIN(step->delivered + step->queued, expected);
+}
+
+static double step_loss(const struct step *step) {
+  uint64_t expected = step->sent - step->lost;
+  return expected > 0 ? (double) step_missing(step) / expected : 0;
+}
+
+static void report(unsigned kbps, const struct step *step) {
+  uint64_t missing = step_missing(step);
+  uint64_t app_drops = missing - MIN(step->kernel_drops, missing);
+  double cpu = 100.0 * step->cpu_ticks / sysconf(_SC_CLK_TCK) / (step->ns / 1e9);
+  printf("%9u %9.0f %8" PRIu64 " %7" PRIu64 " %7" PRIu64 " %7" PRIu64 " %7" PRIu64 " %7" PRIu64
+         " %9.2f %6.1f %8.2f %8.2f %8.2f\n", kbps,
+         step->bytes / 1000.0 / (step->ns / 1e9 - DRAIN_US / 1e6), step->sent, step->lost,
+         step->reordered, step->kernel_drops, app_drops, step->queued, step->bytes / 1e6, cpu,
+         latency_quantile(&step->latency, 0.5) / 1000.0,
+         latency_quantile(&step->latency, 0.99) / 1000.0,
+         step->latency.total > 0 ? step->latency.max / 1000.0 : 0.0);
+}
+
+static void stop_client(struct bench *bench) {
+  kill(bench->pid, SIGINT);
+  // whatever it still has buffered comes out before EOF
+  struct step rest;
+  memset(&rest, 0, sizeof(rest));
+  latency_reset(&rest.latency);
+  for (uint64_t deadline = now_ns() + 2000000000ULL; now_ns() < deadline;) {
+    if (read_output(bench, &rest) < 0) break;
+    struct pollfd fd = {bench->output, POLLIN, 0};
+    poll(&fd, 1, 100);
+  }
+  if (waitpid(bench->pid, NULL, WNOHANG) == 0) {
+    kill(bench->pid, SIGKILL);
+    waitpid(bench->pid, NULL, 0);
+  }
+  close(bench->output);
+}
+
+int main(int argc, char *argv[]) {
+  parse_parameters(argc, argv);
+  signal(SIGPIPE, SIG_IGN);
+
+  struct bench bench;
+  memset(&bench, 0, sizeof(bench));
+  bench.seed = getpid() ^ time(NULL);
+  bench.lost = calloc(SEQ_RING, 1);
+  bench.sock = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in address = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+  if (!bench.lost || bench.sock < 0 || bind(bench.sock, (struct sockaddr *) &address, sizeof(address)) < 0) {
+    perror("socket");
+    return 1;
+  }
+  start_client(&bench, argv + optind, argc - optind);
+
+  struct step step;
+  memset(&step, 0, sizeof(step));
+  latency_reset(&step.latency);
+  for (uint64_t deadline = now_ns() + CONFIRM_TIMEOUT_S * 1000000000ULL;
+       !bench.confirmed && now_ns() < deadline;) {
+    if (handle_control(&bench) < 0 || read_output(&bench, &step) < 0) break;
+    struct pollfd fd = {bench.sock, POLLIN, 0};
+    poll(&fd, 1, 10);
+  }
+  if (!bench.confirmed) {
+    fprintf(stderr, "radio-client did not register\n");
+    stop_client(&bench);
+    return 1;
+  }
+
+  printf("%zu B datagrams, %.1f%% lost, %.1f%% reordered, metadata every %u, %u s per rate\n",
+         dgram_len, loss * 100, reorder * 100, metadata_every, seconds);
+  printf("%9s %9s %8s %7s %7s %7s %7s %7s %9s %6s %8s %8s %8s\n", "kB/s", "out kB/s", "sent",
+         "lost", "reord", "kernel", "app", "queued", "stdout MB", "cpu%", "p50 ms", "p99 ms", "max ms");
+  int ret = 0;
+  unsigned kbps = rate_kbps > 0 ? rate_kbps : RAMP_START_KBPS, last_clean = 0;
+  for (;;) {
+    if (run_step(&bench, kbps, &step) < 0) {
+      fprintf(stderr, "radio-client is gone\n");
+      ret = 1;
+      break;
+    }
+    report(kbps, &step);
+    fflush(stdout);
+    if (rate_kbps > 0) break;
+    double missing = step_loss(&step);
+    // a sender falling behind has found its own limit, not the client's
+    bool sender_limited = step.sent < 0.9 * kbps * 1000.0 / dgram_len * seconds;
+    if (missing > LOSS_LIMIT || sender_limited || kbps >= RAMP_MAX_KBPS) {
+      if (missing > LOSS_LIMIT)
+        printf("loss above %.0f%% between %u and %u kB/s\n", LOSS_LIMIT * 100, last_clean, kbps);
+      else
+        printf("no loss above %.0f%% up to %u kB/s%s\n", LOSS_LIMIT * 100, kbps,
+               sender_limited ? " (the sender's limit)" : "");
+      break;
+    }
+    last_clean = kbps;
+    kbps *= 2;
+  }
+  stop_client(&bench);
+  close(bench.sock);
+  free(bench.lost);
+  return ret;
+}
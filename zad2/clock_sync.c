@@ -0,0 +1,77 @@
+#include "clock_sync.h"
+
+#include <arpa/inet.h>
+#include <string.h>
+
+static void put_us(uint32_t *hi, uint32_t *lo, uint64_t us) {
+  *hi = htonl(us >> 32);
+  *lo = htonl(us & 0xffffffff);
+}
+
+static uint64_t get_us(uint32_t hi, uint32_t lo) {
+  return (uint64_t) ntohl(hi) << 32 | ntohl(lo);
+}
+
+void clock_sync_reset(struct clock_sync *sync) {
+  sync->count = sync->next = 0;
+}
+
+void clock_sync_seed(struct clock_sync *sync, const struct clock_sample *sample) {
+  sync->samples[0] = *sample;
+  sync->count = sync->next = 1;
+}
+
+void clock_sync_add(struct clock_sync *sync, const struct clock_info *answer,
+                    uint64_t received_us) {
+  int64_t t1 = get_us(answer->origin_hi, answer->origin_lo);
+  int64_t t2 = get_us(answer->receive_hi, answer->receive_lo);
+  int64_t t3 = get_us(answer->transmit_hi, answer->transmit_lo);
+  int64_t t4 = received_us;
+  int64_t delay = (t4 - t1) - (t3 - t2);
+  if (t1 == 0 || delay < 0 || delay > UINT32_MAX) return; // not an answer to a probe of ours
+  struct clock_sample *sample = &sync->samples[sync->next];
+  sample->offset_us = ((t2 - t1) + (t3 - t4)) / 2;
+  sample->delay_us = delay;
+  sync->next = (sync->next + 1) % CLOCK_SAMPLES;
+  if (sync->count < CLOCK_SAMPLES) sync->count++;
+}
+
+bool clock_sync_offset(const struct clock_sync *sync, int64_t *offset_us, uint32_t *delay_us) {
+  if (sync->count == 0) return false;
+  const struct clock_sample *best = &sync->samples[0];
+  for (size_t i = 1; i < sync->count; ++i)
+    if (sync->samples[i].delay_us < best->delay_us) best = &sync->samples[i];
+  *offset_us = best->offset_us;
+  *delay_us = best->delay_us;
+  return true;
+}
+
+void clock_probe_record(void *record, uint64_t now_us) {
+  struct client_protocol_dgram *header = record;
+  struct clock_info info;
+  memset(&info, 0, sizeof(info));
+  put_us(&info.transmit_hi, &info.transmit_lo, now_us);
+  header->type = htons(CLOCK);
+  header->length = htons(sizeof(info));
+  memcpy(header->data, &info, sizeof(info));
+}
+
+void clock_answer_record(void *record, const struct clock_info *probe, uint64_t received_us) {
+  struct client_protocol_dgram *header = record;
+  struct clock_info info;
+  info.origin_hi = probe->transmit_hi;
+  info.origin_lo = probe->transmit_lo;
+  put_us(&info.receive_hi, &info.receive_lo, received_us);
+  put_us(&info.transmit_hi, &info.transmit_lo, received_us);
+  header->type = htons(CLOCK);
+  header->length = htons(sizeof(info));
+  memcpy(header->data, &info, sizeof(info));
+}
+
+void clock_transmit(void *record, uint64_t now_us) {
+  struct client_protocol_dgram *header = record;
+  struct clock_info info;
+  memcpy(&info, header->data, sizeof(info));
+  put_us(&info.transmit_hi, &info.transmit_lo, now_us);
+  memcpy(header->data, &info, sizeof(info));
+}
@@ -0,0 +1,50 @@
+#ifndef _RADIO_CLOCK_SYNC_H_
+#define _RADIO_CLOCK_SYNC_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "client_protocol.h"
+
+/* Offset of a proxy's CLOCK_REALTIME from ours, from CLOCK probes riding
+ * on DISCOVER and KEEPALIVE. Of the last CLOCK_SAMPLES answers the one
+ * with the shortest round trip is used, its offset is off by at most
+ * half of that.                                                        */
+#define CLOCK_SAMPLES     8
+
+#define CLOCK_RECORD_LEN  (CLIENT_PROTO_DGRAM_HEADER_LEN + sizeof(struct clock_info))
+
+struct clock_sample {
+  int64_t offset_us;       // proxy - ours
+  uint32_t delay_us;       // round trip without the proxy's own time
+};
+
+struct clock_sync {
+  struct clock_sample samples[CLOCK_SAMPLES];
+  size_t count;
+  size_t next;
+};
+
+void clock_sync_reset(struct clock_sync *sync);
+
+/* starts over from one sample, e.g. the best one of another process */
+void clock_sync_seed(struct clock_sync *sync, const struct clock_sample *sample);
+
+/* an answer to our probe has come at received_us (our clock) */
+void clock_sync_add(struct clock_sync *sync, const struct clock_info *answer,
+                    uint64_t received_us);
+
+/* false until the first answer */
+bool clock_sync_offset(const struct clock_sync *sync, int64_t *offset_us, uint32_t *delay_us);
+
+/* writes a CLOCK record (CLOCK_RECORD_LEN bytes) probing at now_us */
+void clock_probe_record(void *record, uint64_t now_us);
+
+/* the answer to probe, got at received_us; its transmit time is set by
+ * clock_transmit right before it goes out                             */
+void clock_answer_record(void *record, const struct clock_info *probe, uint64_t received_us);
+
+void clock_transmit(void *record, uint64_t now_us);
+
+#endif  // _RADIO_CLOCK_SYNC_H_
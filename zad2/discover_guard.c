@@ -0,0 +1,181 @@
+#define _GNU_SOURCE
+
+#include "discover_guard.h"
+
+#include "client_protocol.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+
+#define TOKEN  1000000ULL
+
+static void bucket_fill(struct token_bucket *bucket, uint64_t burst, uint64_t now_us) {
+  bucket->tokens = burst * TOKEN;
+  bucket->last_us = now_us;
+}
+
+/* rate tokens per second, at most burst of them */
+static bool bucket_take(struct token_bucket *bucket, uint64_t rate, uint64_t burst,
+                        uint64_t now_us) {
+  uint64_t elapsed = now_us - bucket->last_us;
+  bucket->last_us = now_us;
+  bucket->tokens = MIN(bucket->tokens + elapsed * rate, burst * TOKEN);
+  if (bucket->tokens < TOKEN) return false;
+  bucket->tokens -= TOKEN;
+  return true;
+}
+
+void guard_init(struct discover_guard *guard) {
+  memset(guard, 0, sizeof(*guard));
+  bucket_fill(&guard->iam_bucket, GUARD_IAM_BURST, monotonic_us());
+}
+
+bool guard_admit(struct discover_guard *guard, const struct sockaddr_in *address,
+                 uint64_t now_us) {
+  in_addr_t addr = address->sin_addr.s_addr;
+  struct guard_bucket *source = &guard->buckets[(addr * 2654435761u) % GUARD_BUCKETS];
+  if (source->addr != addr || source->bucket.last_us == 0) {
+    // a source seen for the first time (or evicting another) starts with a full bucket
+    source->addr = addr;
+    bucket_fill(&source->bucket, GUARD_SOURCE_BURST, now_us);
+  }
+  if (!bucket_take(&source->bucket, GUARD_SOURCE_RATE, GUARD_SOURCE_BURST, now_us) ||
+      !bucket_take(&guard->iam_bucket, GUARD_IAM_RATE, GUARD_IAM_BURST, now_us)) {
+    guard->stats.rate_limited++;
+    return false;
+  }
+  return true;
+}
+
+static struct pending_client *find_pending(struct discover_guard *guard,
+                                           const struct sockaddr_in *address) {
+  for (size_t i = 0; i < guard->pending_count; ++i)
+    if (is_same_address(&guard->pending[i].address, address)) return &guard->pending[i];
+  return NULL;
+}
+
+/* unpredictable, a sender only learns it from the IAM */
+static uint64_t new_cookie(void) {
+  uint64_t cookie;
+  while (getrandom(&cookie, sizeof(cookie), 0) != sizeof(cookie))
+    if (errno != EINTR) exit(1);
+  return cookie;
+}
+
+uint64_t guard_pend(struct discover_guard *guard, const struct sockaddr_in *address,
+                    uint8_t version, time_t now) {
+  struct pending_client *pending = find_pending(guard, address);
+  bool refresh = pending != NULL;
+  if (!pending && guard->pending_count == GUARD_MAX_PENDING) {
+    // a real client confirms within a round trip, the oldest one is most likely a flood
+    pending = &guard->pending[0];
+    for (size_t i = 1; i < guard->pending_count; ++i)
+      if (guard->pending[i].since < pending->since) pending = &guard->pending[i];
+    pending->address = *address;
+    guard->stats.evicted++;
+  } else if (!pending) {
+    pending = &guard->pending[guard->pending_count++];
+    pending->address = *address;
+  }
+  // a repeated DISCOVER keeps the cookie, the first IAM may still be on its way
+  if (!refresh) pending->cookie = new_cookie();
+  pending->version = version;
+  pending->since = now;
+  return pending->cookie;
+}
+
+bool guard_confirm(struct discover_guard *guard, const struct sockaddr_in *address,
+                   const uint64_t *cookie, uint8_t *version) {
+  struct pending_client *pending = find_pending(guard, address);
+  if (!pending) return false;
+  if (pending->version >= PROTOCOL_V2 && (!cookie || *cookie != pending->cookie)) {
+    guard->stats.bad_cookies++;
+    return false;
+  }
+  *version = pending->version;
+  *pending = guard->pending[--guard->pending_count];
+  guard->stats.confirmed++;
+  return true;
+}
+
+void guard_expire(struct discover_guard *guard, time_t now, time_t timeout) {
+  for (size_t i = 0; i < guard->pending_count;) {
+    if (now - guard->pending[i].since > timeout) {
+      guard->pending[i] = guard->pending[--guard->pending_count];
+      guard->stats.expired++;
+    } else {
+      i++;
+    }
+  }
+}
+
+void guard_queue_reply(struct discover_guard *guard, int sock,
+                       const struct sockaddr_in *address, const void *data, size_t len,
+                       const void *tail, size_t tail_len, const struct clock_info *probe,
+                       uint64_t received_us) {
+  if (guard->batch_len == GUARD_BATCH) guard_flush(guard, sock);
+  size_t i = guard->batch_len++;
+  guard->addresses[i] = *address;
+  guard->iovs[i][0].iov_base = (void *) data;
+  guard->iovs[i][0].iov_len = len;
+  tail_len = MIN(tail_len, GUARD_TAIL_LEN);
+  if (tail_len > 0) memcpy(guard->tails[i], tail, tail_len);
+  guard->iovs[i][1].iov_base = guard->tails[i];
+  guard->iovs[i][1].iov_len = tail_len;
+  if (probe) {
+    clock_answer_record(guard->clocks[i], probe, received_us);
+    guard->iovs[i][2].iov_base = guard->clocks[i];
+    guard->iovs[i][2].iov_len = CLOCK_RECORD_LEN;
+  }
+  memset(&guard->msgs[i], 0, sizeof(guard->msgs[i]));
+  guard->msgs[i].msg_name = &guard->addresses[i];
+  guard->msgs[i].msg_namelen = sizeof(guard->addresses[i]);
+  guard->msgs[i].msg_iov = guard->iovs[i];
+  guard->msgs[i].msg_iovlen = probe ? 3 : 2;
+}
+
+void guard_flush(struct discover_guard *guard, int sock) {
+  if (guard->batch_len == 0) return;
+  guard->stats.batches++;
+  struct mmsghdr msgs[GUARD_BATCH];
+  memset(msgs, 0, sizeof(msgs));
+  uint64_t now_us = realtime_us();
+  for (size_t i = 0; i < guard->batch_len; ++i) {
+    msgs[i].msg_hdr = guard->msgs[i];
+    if (guard->msgs[i].msg_iovlen > 2) clock_transmit(guard->clocks[i], now_us);
+  }
+  size_t sent = 0;
+  while (sent < guard->batch_len) {
+    int ret = sendmmsg(sock, msgs + sent, guard->batch_len - sent, 0);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      // the first one failed (e.g. no route to a spoofed address), the rest may not
+      guard->stats.send_failed++;
+      sent++;
+      continue;
+    }
+    guard->stats.replies += ret;
+    sent += ret;
+  }
+  guard->batch_len = 0;
+}
+
+uint64_t guard_drops(const struct discover_guard *guard) {
+  const struct discover_stats *stats = &guard->stats;
+  return stats->rate_limited + stats->evicted + stats->expired + stats->send_failed +
+         stats->bad_cookies;
+}
+
+void guard_report(const struct discover_guard *guard) {
+  const struct discover_stats *stats = &guard->stats;
+  fprintf(stderr, "discover: %" PRIu64 " confirmed, dropped %" PRIu64 " rate limited, %" PRIu64
+          " evicted, %" PRIu64 " expired, %" PRIu64 " wrong cookies, %" PRIu64
+          " failed sends; %" PRIu64 " replies in %" PRIu64 " batches\n", stats->confirmed,
+          stats->rate_limited, stats->evicted, stats->expired, stats->bad_cookies,
+          stats->send_failed, stats->replies, stats->batches);
+}
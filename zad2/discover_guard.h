@@ -0,0 +1,109 @@
+#ifndef _RADIO_DISCOVER_GUARD_H_
+#define _RADIO_DISCOVER_GUARD_H_
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "clock_sync.h"
+
+/* Protection of the control thread against DISCOVER floods. A DISCOVER
+ * only puts its sender on a short, bounded pending list (and gets IAM);
+ * it becomes a client once a KEEPALIVE follows from the same address.
+ * A v2 sender is given a random COOKIE with IAM and has to echo it, so a
+ * spoofed address, which never sees the IAM, can't be registered; v1
+ * has no room for it, its KEEPALIVE proves nothing (see radio-proxy -V).
+ * DISCOVERs of each source (IP) and IAM replies in total are limited by
+ * token buckets, replies go out in batches with sendmmsg.              */
+
+#define GUARD_BUCKETS       1024  // per-source buckets, direct mapped by IP
+#define GUARD_SOURCE_RATE   8     // DISCOVERs per second of one source
+#define GUARD_SOURCE_BURST  16
+#define GUARD_IAM_RATE      1000  // IAM replies per second in total
+#define GUARD_IAM_BURST     256
+#define GUARD_MAX_PENDING   256
+#define GUARD_BATCH         32
+#define GUARD_TAIL_LEN      32    // records of a reply that are copied (LOAD, LEASE, COOKIE)
+#define GUARD_REPORT_S      10    // drops are reported at most that often
+
+struct token_bucket {
+  uint64_t tokens;         // in millionths of a token
+  uint64_t last_us;
+};
+
+struct guard_bucket {
+  in_addr_t addr;
+  struct token_bucket bucket;
+};
+
+struct pending_client {
+  struct sockaddr_in address;
+  uint8_t version;
+  uint64_t cookie;         // sent to v2 ones
+  time_t since;
+};
+
+struct discover_stats {
+  uint64_t rate_limited;   // DISCOVERs dropped by a bucket
+  uint64_t evicted;        // pending senders pushed out by newer ones
+  uint64_t expired;        // pending senders which never confirmed
+  uint64_t confirmed;
+  uint64_t bad_cookies;    // KEEPALIVEs of pending v2 senders without their cookie
+  uint64_t send_failed;    // replies the kernel refused
+  uint64_t replies;
+  uint64_t batches;
+};
+
+struct discover_guard {
+  struct guard_bucket buckets[GUARD_BUCKETS];
+  struct token_bucket iam_bucket;
+  struct pending_client pending[GUARD_MAX_PENDING];
+  size_t pending_count;
+  struct msghdr msgs[GUARD_BATCH];
+  struct iovec iovs[GUARD_BATCH][3];  // the reply, its tail, a CLOCK answer
+  struct sockaddr_in addresses[GUARD_BATCH];
+  char tails[GUARD_BATCH][GUARD_TAIL_LEN] __attribute__((aligned(4)));
+  char clocks[GUARD_BATCH][CLOCK_RECORD_LEN] __attribute__((aligned(4)));
+  size_t batch_len;
+  struct discover_stats stats;
+};
+
+void guard_init(struct discover_guard *guard);
+
+/* takes a token of the source's bucket and of the IAM one */
+bool guard_admit(struct discover_guard *guard, const struct sockaddr_in *address,
+                 uint64_t now_us);
+
+/* adds (or refreshes) a pending sender, the oldest one goes if there is
+ * no room; returns its cookie (the same while it stays pending)       */
+uint64_t guard_pend(struct discover_guard *guard, const struct sockaddr_in *address,
+                    uint8_t version, time_t now);
+
+/* true (and the version it asked for) if address was pending and, for v2,
+ * cookie (NULL - the KEEPALIVE had none) is the one it was given       */
+bool guard_confirm(struct discover_guard *guard, const struct sockaddr_in *address,
+                   const uint64_t *cookie, uint8_t *version);
+
+void guard_expire(struct discover_guard *guard, time_t now, time_t timeout);
+
+/* data (the same for many replies) is not copied and must not change
+ * until the flush; tail (up to GUARD_TAIL_LEN, even length) is copied
+ * and follows it, then a CLOCK answer to probe (got at received_us)
+ * unless probe is NULL                                                */
+void guard_queue_reply(struct discover_guard *guard, int sock,
+                       const struct sockaddr_in *address, const void *data, size_t len,
+                       const void *tail, size_t tail_len, const struct clock_info *probe,
+                       uint64_t received_us);
+
+/* sends the queued replies; a reply the kernel refuses is only counted */
+void guard_flush(struct discover_guard *guard, int sock);
+
+/* everything dropped so far, to see if there is something new to report */
+uint64_t guard_drops(const struct discover_guard *guard);
+
+/* the counters, on stderr */
+void guard_report(const struct discover_guard *guard);
+
+#endif  // _RADIO_DISCOVER_GUARD_H_
@@ -0,0 +1,164 @@
+#include "frame_aligner.h"
+
+#include "client_protocol.h"
+#include "utils.h"
+
+#include <string.h>
+#include <strings.h>
+
+#define MP3_HEADER_LEN   4
+#define ADTS_HEADER_LEN  7
+
+// kbps by [MPEG-1 / MPEG-2(.5)][layer I, II, III][bitrate index]
+static const uint16_t mp3_bitrates[2][3][15] = {
+  {{0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448},
+   {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384},
+   {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320}},
+  {{0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},
+   {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+   {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160}}
+};
+
+// Hz by [MPEG-1, MPEG-2, MPEG-2.5][sample rate index]
+static const uint32_t mp3_sample_rates[3][3] = {
+  {44100, 48000, 32000}, {22050, 24000, 16000}, {11025, 12000, 8000}
+};
+
+static const struct {
+  const char *type;
+  int codec;
+} content_types[] = {
+  {"audio/mpeg", FRAME_MP3},
+  {"audio/mp3", FRAME_MP3},
+  {"audio/mpeg3", FRAME_MP3},
+  {"audio/aac", FRAME_ADTS},
+  {"audio/aacp", FRAME_ADTS},
+  {"audio/x-aac", FRAME_ADTS},
+};
+
+int frame_codec(const char *content_type) {
+  for (size_t i = 0; i < SIZE(content_types); ++i)
+    if (strcasecmp(content_type, content_types[i].type) == 0) return content_types[i].codec;
+  return FRAME_NONE;
+}
+
+const char *frame_codec_name(int codec) {
+  return codec == FRAME_MP3 ? "mp3" : codec == FRAME_ADTS ? "adts" : "none";
+}
+
+/* frame length from the header at p, 0 if it is not one; the bits that
+ * stay the same for the whole stream go to *fixed                      */
+static size_t mp3_frame_len(const unsigned char *p, uint32_t *fixed) {
+  if (p[0] != 0xff || (p[1] & 0xe0) != 0xe0) return 0;
+  unsigned version = (p[1] >> 3) & 3;   // 0 - 2.5, 1 - reserved, 2 - 2, 3 - 1
+  unsigned layer = (p[1] >> 1) & 3;     // 3 - I, 2 - II, 1 - III
+  unsigned bitrate_index = p[2] >> 4;
+  unsigned rate_index = (p[2] >> 2) & 3;
+  unsigned padding = (p[2] >> 1) & 1;
+  if (version == 1 || layer == 0 || bitrate_index == 0 || bitrate_index == 15 || rate_index == 3)
+    return 0; // free format is not supported, its length is not in the header
+
+  unsigned mpeg1 = version == 3;
+  unsigned layer_index = 3 - layer;     // 0 - I, 1 - II, 2 - III
+  uint32_t bitrate = mp3_bitrates[!mpeg1][layer_index][bitrate_index] * 1000;
+  uint32_t rate = mp3_sample_rates[version == 3 ? 0 : version == 2 ? 1 : 2][rate_index];
+  *fixed = p[1] << 8 | (p[2] & 0x0c);   // version, layer, sample rate
+  if (layer_index == 0) return (12 * bitrate / rate + padding) * 4;
+  if (layer_index == 2 && !mpeg1) return 72 * bitrate / rate + padding;
+  return 144 * bitrate / rate + padding;
+}
+
+static size_t adts_frame_len(const unsigned char *p, uint32_t *fixed) {
+  if (p[0] != 0xff || (p[1] & 0xf6) != 0xf0) return 0; // sync, layer 0
+  if (((p[2] >> 2) & 0x0f) > 12) return 0;            // sampling frequency index
+  size_t len = (size_t) (p[3] & 3) << 11 | p[4] << 3 | p[5] >> 5;
+  if (len < ADTS_HEADER_LEN) return 0;
+  *fixed = p[1] << 16 | p[2] << 8 | (p[3] & 0xc0);     // profile, rate, channels
+  return len;
+}
+
+static size_t header_len(int codec) {
+  return codec == FRAME_MP3 ? MP3_HEADER_LEN : ADTS_HEADER_LEN;
+}
+
+static size_t frame_len(int codec, const char *p, uint32_t *fixed) {
+  const unsigned char *u = (const unsigned char *) p;
+  return codec == FRAME_MP3 ? mp3_frame_len(u, fixed) : adts_frame_len(u, fixed);
+}
+
+/* length of the frame starting at data[0]: 0 - not a frame (skip a byte),
+ * -1 - can't tell yet, more data is needed                              */
+static long check_frame(struct frame_aligner *aligner, const char *data, size_t len) {
+  size_t header = header_len(aligner->codec);
+  if (len < header) return -1;
+  uint32_t fixed, next_fixed;
+  size_t frame = frame_len(aligner->codec, data, &fixed);
+  if (frame == 0 || frame > FRAME_MAX_LEN) return 0;
+  if (aligner->synced) return frame;
+  // a sync word shows up in audio data too, the next header has to agree
+  if (len < frame + header) return -1;
+  if (frame_len(aligner->codec, data + frame, &next_fixed) == 0 || next_fixed != fixed) return 0;
+  return frame;
+}
+
+/* passes the whole frames from the beginning of data on, returns how many
+ * bytes were used (the rest is a frame that is not complete yet)        */
+static long pass_frames(struct frame_aligner *aligner, char *data, size_t len,
+                        icy_sink_t sink, void *arg) {
+  size_t pos = 0;
+  while (pos < len) {
+    long frame = check_frame(aligner, data + pos, len - pos);
+    if (frame < 0) break;
+    if (frame == 0) {
+      aligner->synced = false;
+      pos++;
+      continue;
+    }
+    if ((size_t) frame > len - pos) break;
+    aligner->synced = true;
+    if (sink(arg, AUDIO, data + pos, frame) < 0) return -1;
+    pos += frame;
+  }
+  return pos;
+}
+
+int frame_aligner_feed(struct frame_aligner *aligner, char *data, size_t len,
+                       icy_sink_t sink, void *arg) {
+  if (aligner->codec == FRAME_NONE) return len > 0 ? sink(arg, AUDIO, data, len) : 0;
+
+  // first the kept bytes, completed from data a piece at a time
+  while (aligner->carry_len > 0 && len > 0) {
+    size_t bytes = MIN(len, sizeof(aligner->carry) - aligner->carry_len);
+    memcpy(aligner->carry + aligner->carry_len, data, bytes);
+    size_t total = aligner->carry_len + bytes;
+    long used = pass_frames(aligner, aligner->carry, total, sink, arg);
+    if (used < 0) return -1;
+    if ((size_t) used >= aligner->carry_len) { // the rest of data goes on without copying
+      data += used - aligner->carry_len;
+      len -= used - aligner->carry_len;
+      aligner->carry_len = 0;
+      break;
+    }
+    if (used == 0 && total == sizeof(aligner->carry)) { // can't happen with valid frames
+      aligner->synced = false;
+      used = 1;
+    }
+    memmove(aligner->carry, aligner->carry + used, total - used);
+    aligner->carry_len = total - used;
+    data += bytes;
+    len -= bytes;
+  }
+  if (aligner->carry_len > 0) return 0; // all of data is kept with it
+
+  long used = pass_frames(aligner, data, len, sink, arg);
+  if (used < 0) return -1;
+  memcpy(aligner->carry, data + used, len - used);
+  aligner->carry_len = len - used;
+  return 0;
+}
+
+void frame_aligner_init(struct frame_aligner *aligner, int codec) {
+  aligner->codec = codec;
+  aligner->synced = false;
+  aligner->carry_len = 0;
+}
@@ -0,0 +1,38 @@
+#ifndef _RADIO_FRAME_ALIGNER_H_
+#define _RADIO_FRAME_ALIGNER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "icy_demux.h"
+
+#define FRAME_NONE  0   // unknown codec, audio is passed on as it comes
+#define FRAME_MP3   1   // MPEG-1/2/2.5 layer I-III
+#define FRAME_ADTS  2   // AAC in ADTS
+
+#define FRAME_MAX_LEN  8192   // ADTS frame_length has 13 bits
+
+/* Cuts the audio stream at codec frame boundaries: the sink gets one whole
+ * frame per call, a frame split between reads is kept until it is
+ * complete. Bytes that are not frames (ID3 tags, garbage before the first
+ * sync) are dropped. Sync is taken only where two consecutive frame
+ * headers agree, and re-taken the same way after a broken frame.       */
+struct frame_aligner {
+  int codec;
+  bool synced;
+  size_t carry_len;
+  char carry[2 * FRAME_MAX_LEN];   // a frame and the next header fit
+};
+
+/* codec of an HTTP content-type value */
+int frame_codec(const char *content_type);
+
+const char *frame_codec_name(int codec);
+
+void frame_aligner_init(struct frame_aligner *aligner, int codec);
+
+int frame_aligner_feed(struct frame_aligner *aligner, char *data, size_t len,
+                       icy_sink_t sink, void *arg);
+
+#endif  // _RADIO_FRAME_ALIGNER_H_
@@ -0,0 +1,294 @@
+#include "hot_restart.h"
+
+#include "client_protocol.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define HANDOFF_MAGIC    0x52414448   // "RADH"
+#define HANDOFF_VERSION  5
+
+#define HANDOFF_RELAY_COOKIE  1
+#define HANDOFF_RELAY_SYNCED  2
+#define HANDOFF_ACK      'A'
+
+/* fixed width fields, both processes run on the same host */
+struct handoff_header {
+  uint32_t magic;
+  uint32_t version;
+  int64_t icy_metaint;
+  uint64_t demux_left;
+  uint32_t demux_state;
+  uint32_t icy_name_len;
+  uint32_t clients;
+  uint32_t iam_extra_len;
+  uint32_t frame_codec;
+  uint32_t frame_carry_len;
+  uint32_t relay_lease_ms;
+  uint32_t relay_flags;    // HANDOFF_RELAY_*
+  uint64_t relay_cookie;
+  int64_t relay_offset_us;
+  uint32_t relay_delay_us;
+};
+
+struct handoff_client {
+  int64_t last_keepalive;
+  uint32_t lease_ms;
+  uint32_t addr;           // network order, as in sockaddr_in
+  uint16_t port;
+  uint8_t version;
+  uint8_t valid;
+};
+
+static int unix_address(const char *path, struct sockaddr_un *address) {
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address->sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(address->sun_path, path);
+  return 0;
+}
+
+static int write_all(int fd, const void *buffer, size_t len) {
+  while (len > 0) {
+    ssize_t ret = write(fd, buffer, len);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    buffer = (const char *) buffer + ret;
+    len -= ret;
+  }
+  return 0;
+}
+
+static int read_all(int fd, void *buffer, size_t len) {
+  while (len > 0) {
+    ssize_t ret = read(fd, buffer, len);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret <= 0) {
+      if (ret == 0) errno = ECONNRESET;
+      return -1;
+    }
+    buffer = (char *) buffer + ret;
+    len -= ret;
+  }
+  return 0;
+}
+
+int handoff_listen(const char *path) {
+  struct sockaddr_un address;
+  if (unix_address(path, &address) < 0) return -1;
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0) return -1;
+  unlink(path); // left by the previous process (or a crashed one)
+  if (bind(sock, (struct sockaddr *) &address, sizeof(address)) < 0 || listen(sock, 1) < 0) {
+    int saved_errno = errno;
+    close(sock);
+    errno = saved_errno;
+    return -1;
+  }
+  return sock;
+}
+
+int handoff_send(int conn, const struct handoff_state *state, unsigned ack_timeout) {
+  if (pthread_mutex_lock(&mutex) != 0) exit(1);
+  size_t count = 0;
+  FOR_LIST(c, client_list) count++;
+  struct handoff_client *clients = malloc((count + 1) * sizeof(struct handoff_client));
+  if (!clients) {
+    if (pthread_mutex_unlock(&mutex) != 0) exit(1);
+    return -1;
+  }
+  size_t i = 0;
+  FOR_LIST(c, client_list) {
+    clients[i].last_keepalive = c->last_keepalive;
+    clients[i].lease_ms = c->lease_ms;
+    clients[i].addr = c->client_address.sin_addr.s_addr;
+    clients[i].port = c->client_address.sin_port;
+    clients[i].version = c->version;
+    clients[i].valid = c->valid;
+    i++;
+  }
+  if (pthread_mutex_unlock(&mutex) != 0) exit(1);
+
+  struct handoff_header header;
+  memset(&header, 0, sizeof(header));
+  header.magic = HANDOFF_MAGIC;
+  header.version = HANDOFF_VERSION;
+  header.icy_metaint = state->demux.metaint;
+  header.demux_left = state->demux.left;
+  header.demux_state = state->demux.state;
+  header.icy_name_len = state->icy_name_len;
+  header.clients = count;
+  header.iam_extra_len = state->iam_extra_len;
+  header.frame_codec = state->frame_codec;
+  header.frame_carry_len = state->frame_carry_len;
+  header.relay_lease_ms = state->relay.lease_ms;
+  header.relay_flags = (state->relay.has_cookie ? HANDOFF_RELAY_COOKIE : 0) |
+                       (state->relay.synced ? HANDOFF_RELAY_SYNCED : 0);
+  header.relay_cookie = state->relay.cookie;
+  header.relay_offset_us = state->relay.clock.offset_us;
+  header.relay_delay_us = state->relay.clock.delay_us;
+
+  // the header carries both sockets
+  int fds[2] = {state->upstream_sock, state->client_sock};
+  char control[CMSG_SPACE(sizeof(fds))] __attribute__((aligned(_Alignof(struct cmsghdr))));
+  memset(control, 0, sizeof(control));
+  struct iovec iov = {&header, sizeof(header)};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  int ret = -1;
+  if (sendmsg(conn, &msg, MSG_NOSIGNAL) != sizeof(header)) goto end;
+  if (write_all(conn, state->icy_name, state->icy_name_len) < 0) goto end;
+  if (write_all(conn, state->iam_extra, state->iam_extra_len) < 0) goto end;
+  if (write_all(conn, state->frame_carry, state->frame_carry_len) < 0) goto end;
+  if (write_all(conn, clients, count * sizeof(struct handoff_client)) < 0) goto end;
+
+  struct timeval tv = {ack_timeout, 0};
+  char ack;
+  if (setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) goto end;
+  if (read_all(conn, &ack, 1) < 0 || ack != HANDOFF_ACK) goto end;
+  ret = 0;
+
+  end:
+  free(clients);
+  return ret;
+}
+
+int handoff_receive(const char *path, struct handoff_state *state) {
+  struct sockaddr_un address;
+  if (unix_address(path, &address) < 0) return -1;
+  int conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (conn < 0) return -1;
+  if (connect(conn, (struct sockaddr *) &address, sizeof(address)) < 0) {
+    int saved_errno = errno;
+    close(conn);
+    errno = saved_errno;
+    // nothing running (or a stale socket file)
+    return errno == ENOENT || errno == ECONNREFUSED ? 1 : -1;
+  }
+
+  state->upstream_sock = state->client_sock = -1;
+  state->icy_name = NULL;
+  state->iam_extra = NULL;
+  state->frame_carry = NULL;
+  struct handoff_client *clients = NULL;
+
+  struct handoff_header header;
+  int fds[2];
+  char control[CMSG_SPACE(sizeof(fds))] __attribute__((aligned(_Alignof(struct cmsghdr))));
+  struct iovec iov = {&header, sizeof(header)};
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t len;
+  do {
+    len = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+  } while (len < 0 && errno == EINTR);
+  if (len < 0) goto handle_errors;
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+      cmsg->cmsg_len == CMSG_LEN(sizeof(fds))) {
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    state->upstream_sock = fds[0];
+    state->client_sock = fds[1];
+  }
+  if (state->upstream_sock < 0 || len == 0) goto handle_errors;
+  // the rest of the header could have come in a separate read
+  if ((size_t) len < sizeof(header) &&
+      read_all(conn, (char *) &header + len, sizeof(header) - len) < 0)
+    goto handle_errors;
+  if (header.magic != HANDOFF_MAGIC || header.version != HANDOFF_VERSION)
+    goto handle_errors;
+
+  state->icy_name_len = header.icy_name_len;
+  state->icy_name = malloc(header.icy_name_len + 1);
+  state->iam_extra_len = header.iam_extra_len;
+  state->iam_extra = malloc(header.iam_extra_len + 1);
+  state->frame_codec = header.frame_codec;
+  state->frame_carry_len = header.frame_carry_len;
+  state->relay.lease_ms = header.relay_lease_ms;
+  state->relay.has_cookie = header.relay_flags & HANDOFF_RELAY_COOKIE;
+  state->relay.cookie = header.relay_cookie;
+  state->relay.synced = header.relay_flags & HANDOFF_RELAY_SYNCED;
+  state->relay.clock.offset_us = header.relay_offset_us;
+  state->relay.clock.delay_us = header.relay_delay_us;
+  state->frame_carry = malloc(header.frame_carry_len + 1);
+  clients = malloc((header.clients + 1) * sizeof(struct handoff_client));
+  if (!state->icy_name || !state->iam_extra || !state->frame_carry || !clients)
+    goto handle_errors;
+  if (read_all(conn, state->icy_name, header.icy_name_len) < 0 ||
+      read_all(conn, state->iam_extra, header.iam_extra_len) < 0 ||
+      read_all(conn, state->frame_carry, header.frame_carry_len) < 0 ||
+      read_all(conn, clients, header.clients * sizeof(struct handoff_client)) < 0)
+    goto handle_errors;
+
+  icy_demux_init(&state->demux, header.icy_metaint);
+  state->demux.state = header.demux_state;
+  state->demux.left = header.demux_left;
+
+  if (pthread_mutex_lock(&mutex) != 0) exit(1);
+  for (uint32_t i = 0; i < header.clients; ++i) {
+    struct client *client = malloc(sizeof(struct client));
+    if (!client) break; // that client has to DISCOVER again
+    memset(client, 0, sizeof(*client));
+    client->last_keepalive = clients[i].last_keepalive;
+    client->lease_ms = clients[i].lease_ms;
+    client->client_address.sin_family = AF_INET;
+    client->client_address.sin_addr.s_addr = clients[i].addr;
+    client->client_address.sin_port = clients[i].port;
+    client->version = clients[i].version;
+    client->replaying = false; // replays are not handed over, such clients go live
+    client->valid = clients[i].valid;
+    add_client(&client_list, client);
+  }
+  if (pthread_mutex_unlock(&mutex) != 0) exit(1);
+  free(clients);
+
+  char ack = HANDOFF_ACK;
+  if (write_all(conn, &ack, 1) < 0) {
+    // the old process keeps running, so must not we
+    if (pthread_mutex_lock(&mutex) != 0) exit(1);
+    clear_list(&client_list);
+    if (pthread_mutex_unlock(&mutex) != 0) exit(1);
+    clients = NULL;
+    goto handle_errors;
+  }
+  close(conn);
+  return 0;
+
+  handle_errors:
+  free(clients);
+  free(state->icy_name);
+  state->icy_name = NULL;
+  free(state->iam_extra);
+  state->iam_extra = NULL;
+  free(state->frame_carry);
+  state->frame_carry = NULL;
+  if (state->upstream_sock >= 0) close(state->upstream_sock);
+  if (state->client_sock >= 0) close(state->client_sock);
+  close(conn);
+  return -1;
+}
@@ -0,0 +1,41 @@
+#ifndef _RADIO_HOT_RESTART_H_
+#define _RADIO_HOT_RESTART_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "icy_demux.h"
+#include "relay.h"
+
+/* Hot restart: a running radio-proxy listens on a unix socket; a new one
+ * started with the same path connects to it and gets the upstream socket,
+ * the UDP socket (SCM_RIGHTS), the ICY demux position and the client table
+ * (and in relay mode the registration with the upstream proxy).
+ * The old process stops at a read boundary, so nothing is lost or sent
+ * twice, and exits once the new one acknowledges the state.           */
+struct handoff_state {
+  int upstream_sock;
+  int client_sock;
+  struct icy_demux demux;
+  char *icy_name;          // malloc'ed, already without "icy-name:"
+  size_t icy_name_len;
+  char *iam_extra;         // malloc'ed, records v2 clients get after IAM
+  size_t iam_extra_len;
+  int frame_codec;         // FRAME_NONE unless audio is frame aligned
+  char *frame_carry;       // the partial frame not sent yet (malloc'ed on receive)
+  size_t frame_carry_len;
+  struct relay_registration relay;  // of a relay, so that it goes on with its upstream
+};
+
+int handoff_listen(const char *path);
+
+/* new process: takes the state over from the process listening on path,
+ * returns 1 if there is none and -1 if the handoff failed. Received
+ * clients are added to client_list.                                    */
+int handoff_receive(const char *path, struct handoff_state *state);
+
+/* old process: sends the state and the client table over conn, 0 once the
+ * new process has confirmed it (the old one should exit then)          */
+int handoff_send(int conn, const struct handoff_state *state, unsigned ack_timeout);
+
+#endif  // _RADIO_HOT_RESTART_H_
@@ -1,20 +1,78 @@
+#define _GNU_SOURCE
+
 #include "http_connection.h"
 
 #include "client_protocol.h"
+#include "frame_aligner.h"
+#include "icy_demux.h"
+#include "packet_pool.h"
+#include "packetizer.h"
+#include "trace.h"
+#include "uring.h"
 #include "utils.h"
+#include "xdp_tx.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-#define MAX_UDP_MSG_SIZE 0x400
-#define MAX_UDP_DATA_LEN (0x400 - CLIENT_PROTO_DGRAM_HEADER_LEN)
+#define SPLICE_LEN        0x100000  // at most moved by one splice
+#define SPLICE_PIPE_SIZE  0x100000  // requested for a stdout pipe
+
+static struct packet_pool packet_pool;
+static struct packetizer packetizer;
+static int udp_sock = -1;
+static struct shm_ring *local_ring = NULL;
+static struct archive *archive = NULL;
+static struct frame_aligner aligner = {.codec = FRAME_NONE};
+static int stdout_pipe = -1;      // unknown until the first receive_http_data
+
+_Atomic bool stop_ingest = false;
+
+/* io_uring backend of the ingest thread: the fan-out keeps a reference to
+ * each datagram's packet and queues its sends, they are submitted together
+ * with the next upstream read (or on publish) in one io_uring_enter      */
+#define FANOUT_SLOTS    64        // packets kept at a time
+#define FANOUT_SENDS    256       // also the ring size
+#define FIXED_UPSTREAM  0
+#define FIXED_CLIENTS   1
+#define READ_USER_DATA  1
+
+/* AF_XDP peers are resolved on the control thread, again now and then */
+#define XDP_PEER_RETRY_S    2     // unreachable ones, their neighbour may be resolving
+#define XDP_PEER_REFRESH_S  60    // reachable ones, routes and neighbours change
+#define XDP_REFRESH_BATCH   16    // per call, the control thread has more to do
+
+struct fanout_send {
+  struct msghdr msg;
+  struct iovec iov;
+  struct sockaddr_in address;
+};
 
-static char udp_buffer[MAX_UDP_MSG_SIZE] __attribute__((aligned(_Alignof(struct client_protocol_dgram))));
+static struct uring ring;
+static bool use_uring = false;
+static struct packet **fanout_slots = NULL;
+static struct fanout_send *fanout_sends = NULL;
+static unsigned slots_used = 0, sends_used = 0;
+static unsigned sends_submitted = 0;
+static unsigned in_flight = 0;    // submitted sends not completed yet
+static char *fixed_buffer = NULL; // registered for READ_FIXED
+static size_t fixed_buffer_len = 0;
+static struct __kernel_timespec read_timeout = {0, 0};
+
+/* AF_XDP backend of the fan-out: frames are queued per client and the
+ * kernel is kicked on publish (or when the ring fills up)            */
+static struct xdp_tx xdp;
+static bool use_xdp = false;
 
 extern volatile sig_atomic_t cont;
 extern pthread_mutex_t client_mutex;
@@ -27,10 +85,12 @@ static const char *ok_answer[] = {
 
 static const char *prefixes[] = {
   "icy-metaint:",
-  "icy-name:"
+  "icy-name:",
+  "content-type:",
+  "icy-br:"
 };
 
-static const int prefixes_size[] = {12, 9};
+static const int prefixes_size[] = {12, 9, 13, 7};
 
 static bool parse_first_line(const char *buffer, size_t size) {
   for (size_t i = 0; i < SIZE(ok_answer); ++i) {
@@ -41,12 +101,27 @@ static bool parse_first_line(const char *buffer, size_t size) {
   return false;
 }
 
+/* until fd (non-blocking and full) takes more */
+static int wait_writable(int fd) {
+  struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+  if (poll(&pfd, 1, -1) < 0 && errno != EINTR) return -1;
+  return 0;
+}
+
+/* blocks like a write to a blocking fd would; a full disk is waited for
+ * (a recorder may free some space) until the proxy is stopped          */
 static ssize_t write_exact(int fd, const void *buffer, size_t size) {
   size_t pos = 0;
   while (pos < size) {
     ssize_t ret = write(fd, (void *)((char *)buffer + pos), size - pos);
     if (ret < 0) {
-      if (errno == ENOSPC || errno == EDQUOT) continue;
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN && wait_writable(fd) == 0) continue;
+      if ((errno == ENOSPC || errno == EDQUOT) && cont && !stop_ingest) {
+        struct timespec wait = {0, 100000000};
+        nanosleep(&wait, NULL);
+        continue;
+      }
       return -1;
     }
     pos += ret;
@@ -87,9 +162,21 @@ void send_http_request(int sock, const char *resource, bool metadata) {
   exit(-1);
 }
 
-int receive_http_header(int sock, long *icy_metaint, char **icy_name,
-                        size_t *icy_name_len, char *buffer, size_t buffer_len,
-                        size_t *received_data) {
+/* the value after "content-type:", available bytes of it are in the buffer
+ * (at least 17, longer values are cut - no codec has such a type) */
+static void copy_content_type(const char *value, size_t available, char *content_type,
+                              size_t content_type_len) {
+  size_t pos = 0, len = 0;
+  while (pos < available && value[pos] == ' ') pos++;
+  while (pos < available && value[pos] != '\r' && value[pos] != ';' && value[pos] != ' ' &&
+         len + 1 < content_type_len)
+    content_type[len++] = value[pos++];
+  content_type[len] = '\0';
+}
+
+int receive_http_header(struct stream_source *source, long *icy_metaint, char **icy_name,
+                        size_t *icy_name_len, char *content_type, size_t content_type_len,
+                        long *icy_br, char *buffer, size_t buffer_len, size_t *received_data) {
   ssize_t len;
   unsigned line = 0;
   size_t line_pos = 0;
@@ -97,9 +184,10 @@ int receive_http_header(int sock, long *icy_metaint, char **icy_name,
   size_t last_CRLF_pos = 0;
   bool is_name = false, is_current_name = false, cont = true;
   *icy_name_len = 0;
+  if (content_type_len > 0) content_type[0] = '\0';
 
   while (cont) {
-    len = read(sock, buffer + pos, buffer_len - pos);
+    len = source->read(source, buffer + pos, buffer_len - pos);
     if (len < 0) {
       break;
     }
@@ -120,6 +208,12 @@ int receive_http_header(int sock, long *icy_metaint, char **icy_name,
             //printf("found name\n");
             is_name = true;
             is_current_name = false;
+          } else if (content_type_len > 0 &&
+                     strncasecmp(prefixes[2], buffer + i, prefixes_size[2]) == 0) {
+            copy_content_type(buffer + i + prefixes_size[2], pos - i - prefixes_size[2],
+                              content_type, content_type_len);
+          } else if (icy_br && strncasecmp(prefixes[3], buffer + i, prefixes_size[3]) == 0) {
+            *icy_br = strtol(buffer + i + prefixes_size[3], NULL, 10);
           }
         }
       }
@@ -190,111 +284,420 @@ int receive_http_header(int sock, long *icy_metaint, char **icy_name,
   return 0;
 }
 
-int send_udp_data(int sock, uint16_t type, char *buffer, size_t len) {
-  size_t pos = 0;
-  while (pos < len) {
-    struct client_protocol_dgram *dgram = (struct client_protocol_dgram *) udp_buffer;
-    dgram->type = htons(type);
-    uint16_t length = MIN(len - pos, MAX_UDP_DATA_LEN);
-    dgram->length = htons(length);
-    memcpy(dgram->data, buffer + pos, length);
+/* takes completions, the read's result (if it is among them) is stored */
+static void reap(int *read_result) {
+  struct io_uring_cqe *cqe;
+  while ((cqe = uring_cqe(&ring)) != NULL) {
+    if (cqe->user_data == READ_USER_DATA) *read_result = cqe->res;
+    else if (cqe->user_data == 0) in_flight--; // sends, (link) timeouts are ignored
+    uring_cqe_seen(&ring);
+  }
+}
 
-    if (pthread_mutex_lock(&mutex) != 0) exit(1);
+/* submits the queued sends, waits for them and lets their packets go */
+static void fanout_flush(void) {
+  int unused = 0;
+  in_flight += sends_used - sends_submitted;
+  while (in_flight > 0) {
+    if (uring_enter(&ring, in_flight, -1) < 0 && errno != EINTR) exit(1);
+    reap(&unused);
+  }
+  while (slots_used > 0) packet_put(fanout_slots[--slots_used]);
+  sends_used = sends_submitted = 0;
+}
 
+/* the packet is kept (not copied) until its sends are done */
+static void fanout_keep(struct packet *packet) {
+  if (slots_used == FANOUT_SLOTS) fanout_flush();
+  packet_ref(packet);
+  fanout_slots[slots_used++] = packet;
+}
+
+static void fanout_queue(struct packet *packet, size_t len, uint8_t version) {
+  fanout_keep(packet);
+  FOR_LIST(c, client_list) {
+    if ((c->version >= PROTOCOL_V2) != (version >= PROTOCOL_V2) || c->replaying) continue;
+    struct io_uring_sqe *sqe = sends_used < FANOUT_SENDS ? uring_sqe(&ring) : NULL;
+    if (!sqe) {
+      fanout_flush();
+      fanout_keep(packet); // for the rest of the clients
+      sqe = uring_sqe(&ring);
+    }
+    struct fanout_send *send = &fanout_sends[sends_used++];
+    send->address = c->client_address;
+    send->iov.iov_base = packet->data;
+    send->iov.iov_len = len;
+    send->msg.msg_name = &send->address;
+    send->msg.msg_namelen = sizeof(send->address);
+    send->msg.msg_iov = &send->iov;
+    send->msg.msg_iovlen = 1;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = FIXED_CLIENTS;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (uint64_t) (uintptr_t) &send->msg;
+    sqe->len = 1;
+  }
+}
+
+static void send_to_clients(void *arg __attribute__((unused)), struct packet *packet,
+                            size_t len, uint8_t version) {
+  const void *dgram = packet->data;
+  TRACE_BEGIN("fanout_lock_wait");
+  if (pthread_mutex_lock(&mutex) != 0) exit(1);
+  TRACE_END("fanout_lock_wait");
+
+  TRACE_BEGIN("fanout_send");
+  if (use_xdp) {
     FOR_LIST(c, client_list) {
-      ssize_t len = sendto(sock, dgram, length + CLIENT_PROTO_DGRAM_HEADER_LEN, 0,
-                           (struct sockaddr *)&c->client_address,
-                           (socklen_t) sizeof(c->client_address));
-
-      /* if an error occurred, it's probably a strange bug on our side
-       * and we don't even know what is a state of a program */
-      if (len != (ssize_t)(length + CLIENT_PROTO_DGRAM_HEADER_LEN)) {
-        if (pthread_mutex_unlock(&mutex) != 0) exit(1);
+      if ((c->version >= PROTOCOL_V2) != (version >= PROTOCOL_V2) || c->replaying) continue;
+      if (c->xdp_peer && c->xdp_peer->reachable) {
+        if (xdp_tx_send(&xdp, c->xdp_peer, dgram, len) == 0) continue;
+        /* the ring is stuck (it was just kicked) or the datagram too long:
+         * what is queued goes to the driver before the socket's datagram,
+         * so the client gets its datagrams in order as far as UDP does  */
+        if (xdp.unsent > 0) xdp_tx_kick(&xdp);
       }
+      // those out of the interface's reach (or not resolved yet) get it the usual way
+      sendto(udp_sock, dgram, len, 0, (struct sockaddr *)&c->client_address,
+             (socklen_t) sizeof(c->client_address));
     }
-
+    TRACE_END("fanout_send");
+    if (pthread_mutex_unlock(&mutex) != 0) exit(1);
+    return;
+  }
+  if (use_uring) {
+    fanout_queue(packet, len, version);
+    TRACE_END("fanout_send");
     if (pthread_mutex_unlock(&mutex) != 0) exit(1);
-    pos += length;
+    return;
+  }
+  FOR_LIST(c, client_list) {
+    if ((c->version >= PROTOCOL_V2) != (version >= PROTOCOL_V2) || c->replaying) continue;
+    /* if an error occurred, it's probably a strange bug on our side
+     * and we don't even know what is a state of a program - the client
+     * is simply skipped */
+    sendto(udp_sock, dgram, len, 0, (struct sockaddr *)&c->client_address,
+           (socklen_t) sizeof(c->client_address));
+  }
+  TRACE_END("fanout_send");
+
+  if (pthread_mutex_unlock(&mutex) != 0) exit(1);
+}
+
+void local_delivery_init(struct shm_ring *ring) {
+  local_ring = ring;
+}
+
+void archive_delivery_init(struct archive *delivery_archive) {
+  archive = delivery_archive;
+}
+
+static void publish_rings(void) {
+  if (local_ring) shm_ring_publish(local_ring);
+  if (archive) archive_publish(archive);
+}
+
+/* all packets of the fan-out, from the packetizer to the (io_uring) sends */
+int udp_data_init(int sock) {
+  udp_sock = sock;
+  if (packet_pool_init(&packet_pool, FANOUT_SLOTS + 2, V2_MAX_DGRAM_LEN) < 0) return -1;
+  if (packetizer_init(&packetizer, &packet_pool, MAX_UDP_MSG_SIZE, V2_MAX_DGRAM_LEN,
+                      &send_to_clients, NULL) < 0) {
+    packet_pool_destroy(&packet_pool);
+    return -1;
   }
   return 0;
 }
 
-int receive_http_data(int sock, long icy_metaint, char *buffer,
-                      size_t buffer_len, size_t data_len, int client_sock) {
-  if (icy_metaint < 0) { // no metadata
-    for (;;) {
-      if (client_sock == -1) {
-        if (write_exact(STDOUT_FILENO, buffer, data_len) < 0) return -1; // failed write to stdout
-      } else {
-        if (send_udp_data(client_sock, AUDIO, buffer, data_len) < 0) return -1;
-      }
-      if (!cont) break;
-      ssize_t len = read(sock, buffer, buffer_len);
-      if (len < 0) return -1; // strange error or timeout
-      data_len = len;
-    }
-  } else {
-    bool metadata = false;
-    size_t chunk = icy_metaint;
-    size_t pos = 0;
-
-    while (pos < data_len) {
-      if (metadata) {
-        chunk = (ssize_t)(unsigned char)buffer[pos++];
-        chunk *= 16;
-      }
+void udp_data_destroy(void) {
+  packetizer_destroy(&packetizer);
+  packet_pool_destroy(&packet_pool);
+}
 
-      size_t bytes = MIN(chunk, data_len - pos);
+int flush_udp_data(void) {
+  packetizer_flush(&packetizer);
+  return 0;
+}
 
-      if (bytes > 0) {
-        if (client_sock == -1) {
-          if (write_exact(metadata ? STDERR_FILENO : STDOUT_FILENO, buffer + pos, bytes) < 0)
-            return -1;
-        } else {
-          if (send_udp_data(client_sock, metadata ? METADATA : AUDIO, buffer + pos, bytes) < 0)
-            return -1;
-        }
-        chunk -= bytes;
-        pos += bytes;
-      }
+void ingest_stamp(uint64_t realtime_us) {
+  packetizer_stamp(&packetizer, realtime_us);
+}
 
-      if (chunk == 0) {
-        metadata = !metadata;
-        if (!metadata) chunk = icy_metaint;
-      }
+/* one io_uring_enter per upstream read: queued sends go out first */
+static ssize_t uring_read(struct stream_source *source __attribute__((unused)), void *buffer,
+                          size_t len) {
+  if (uring_sq_space(&ring) < 2) fanout_flush();
+  struct io_uring_sqe *sqe = uring_sqe(&ring);
+  struct io_uring_sqe *timeout_sqe = read_timeout.tv_sec > 0 ? uring_sqe(&ring) : NULL;
+  bool fixed = fixed_buffer && (char *) buffer >= fixed_buffer &&
+               (char *) buffer + len <= fixed_buffer + fixed_buffer_len;
+  sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  sqe->fd = FIXED_UPSTREAM;
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->addr = (uint64_t) (uintptr_t) buffer;
+  sqe->len = len;
+  sqe->user_data = READ_USER_DATA;
+  if (timeout_sqe) { // SO_RCVTIMEO does not apply here
+    sqe->flags |= IOSQE_IO_LINK;
+    timeout_sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    timeout_sqe->addr = (uint64_t) (uintptr_t) &read_timeout;
+    timeout_sqe->len = 1;
+    timeout_sqe->user_data = READ_USER_DATA + 1;
+  }
+
+  in_flight += sends_used - sends_submitted;
+  sends_submitted = sends_used;
+  int result = INT32_MIN;
+  while (result == INT32_MIN) {
+    if (uring_enter(&ring, 1, -1) < 0 && errno != EINTR) return -1;
+    reap(&result);
+  }
+  // slots may be reused once every send is done (normally they are by now)
+  fanout_flush();
+
+  if (result == -ECANCELED) result = -EAGAIN; // timed out, as read(2) with SO_RCVTIMEO
+  if (result < 0) {
+    errno = -result;
+    return -1;
+  }
+  return result;
+}
+
+int uring_delivery_init(struct stream_source *source, char *buffer, size_t buffer_len) {
+  if (uring_init(&ring, FANOUT_SENDS) < 0) return -1;
+  fanout_slots = calloc(FANOUT_SLOTS, sizeof(*fanout_slots));
+  fanout_sends = calloc(FANOUT_SENDS, sizeof(struct fanout_send));
+  if (!fanout_slots || !fanout_sends) goto handle_errors;
+  int files[2] = {source ? source->fd : -1, udp_sock};
+  if (uring_register(&ring, IORING_REGISTER_FILES, files, SIZE(files)) < 0) goto handle_errors;
+
+  // registering pins memory (RLIMIT_MEMLOCK), plain reads do if it fails
+  struct iovec iov = {buffer, buffer_len};
+  if (source && uring_register(&ring, IORING_REGISTER_BUFFERS, &iov, 1) == 0) {
+    fixed_buffer = buffer;
+    fixed_buffer_len = buffer_len;
+  }
+  struct timeval tv;
+  socklen_t tv_len = sizeof(tv);
+  if (source && getsockopt(source->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, &tv_len) == 0) {
+    read_timeout.tv_sec = tv.tv_sec;
+    read_timeout.tv_nsec = tv.tv_usec * 1000LL;
+  }
+  if (source) source->read = &uring_read;
+  use_uring = true;
+  return 0;
+
+  handle_errors:;
+  int saved_errno = errno;
+  free(fanout_slots);
+  free(fanout_sends);
+  fanout_slots = NULL;
+  fanout_sends = NULL;
+  uring_destroy(&ring);
+  errno = saved_errno;
+  return -1;
+}
+
+void uring_delivery_destroy(void) {
+  if (!use_uring) return;
+  fanout_flush();
+  use_uring = false;
+  uring_destroy(&ring);
+  free(fanout_slots);
+  free(fanout_sends);
+}
+
+int xdp_delivery_init(const char *ifname, uint32_t queue) {
+  if (xdp_tx_init(&xdp, ifname, queue, udp_sock) < 0) return -1;
+  use_xdp = true;
+  return 0;
+}
+
+void xdp_delivery_destroy(void) {
+  if (!use_xdp) return;
+  xdp_tx_kick(&xdp);
+  use_xdp = false;
+  xdp_tx_destroy(&xdp);
+}
+
+struct xdp_peer *xdp_delivery_peer(const struct sockaddr_in *address, time_t now) {
+  if (!use_xdp) return NULL;
+  struct xdp_peer *peer = xdp_peer_create(&xdp, address);
+  if (peer) peer->resolved = now;
+  return peer;
+}
+
+void xdp_delivery_refresh(time_t now) {
+  if (!use_xdp) return;
+  struct client *stale[XDP_REFRESH_BATCH];
+  struct sockaddr_in addresses[XDP_REFRESH_BATCH];
+  size_t count = 0;
+  if (pthread_mutex_lock(&mutex) != 0) exit(1);
+  FOR_LIST(c, client_list) {
+    if (count == XDP_REFRESH_BATCH) break;
+    const struct xdp_peer *peer = c->xdp_peer;
+    if (!peer || now - peer->resolved >= (peer->reachable ? XDP_PEER_REFRESH_S
+                                                           : XDP_PEER_RETRY_S)) {
+      stale[count] = c;
+      addresses[count++] = c->client_address;
     }
+  }
+  if (pthread_mutex_unlock(&mutex) != 0) exit(1);
+  if (count == 0) return;
+
+  // the tables are read without the lock, the fan-out uses the old peers meanwhile
+  struct xdp_peer *peers[XDP_REFRESH_BATCH];
+  for (size_t i = 0; i < count; ++i) peers[i] = xdp_delivery_peer(&addresses[i], now);
+  // the caller alone removes clients, so they are all still listed
+  if (pthread_mutex_lock(&mutex) != 0) exit(1);
+  for (size_t i = 0; i < count; ++i) {
+    if (!peers[i]) continue;
+    struct xdp_peer *old = stale[i]->xdp_peer;
+    stale[i]->xdp_peer = peers[i];
+    peers[i] = old;
+  }
+  if (pthread_mutex_unlock(&mutex) != 0) exit(1);
+  for (size_t i = 0; i < count; ++i) free(peers[i]);
+}
 
-    while (cont) {
-      if (metadata) {
-        unsigned char chunk_size;
-        ssize_t len = read(sock, &chunk_size, 1);
-        if (len <= 0) return -1;
-        chunk = chunk_size;
-        chunk *= 16;
-
-        if (chunk == 0) {
-          metadata = false;
-          chunk = icy_metaint;
-        }
-      }
+static int send_frame(void *arg __attribute__((unused)), uint16_t type __attribute__((unused)),
+                      char *frame, size_t len) {
+  size_t all = client_count, v2 = v2_clients;
+  if (all > 0) packetizer_add_frame(&packetizer, frame, len, v2 < all, v2 > 0);
+  return 0;
+}
 
-      do {
-        ssize_t bytes = read(sock, buffer, MIN(chunk, buffer_len));
-        if (bytes < 0) return -1;
-        if (client_sock == -1) {
-          if (write_exact(metadata ? STDERR_FILENO : STDOUT_FILENO, buffer, bytes) < 0)
-            return -1;
-        } else {
-          if (send_udp_data(client_sock, metadata ? METADATA : AUDIO, buffer, bytes) < 0)
-            return -1;
-        }
-        chunk -= bytes;
-      } while (chunk > 0);
+void frame_delivery_init(int codec, const char *carry, size_t carry_len) {
+  frame_aligner_init(&aligner, codec);
+  if (carry_len > sizeof(aligner.carry)) return;
+  memcpy(aligner.carry, carry, carry_len);
+  aligner.carry_len = carry_len;
+}
 
-      metadata = !metadata;
-      if (!metadata) chunk = icy_metaint;
+int frame_delivery_codec(void) {
+  return aligner.codec;
+}
+
+const char *frame_delivery_carry(size_t *len) {
+  *len = aligner.carry_len;
+  return aligner.carry;
+}
+
+int send_udp_data(uint16_t type, char *buffer, size_t len) {
+  size_t all = client_count, v2 = v2_clients;
+  TRACE_BEGIN("packetize");
+  // frames are followed across the stream even without clients
+  if (type == AUDIO && aligner.codec != FRAME_NONE)
+    frame_aligner_feed(&aligner, buffer, len, &send_frame, NULL);
+  else if (all > 0)
+    packetizer_add(&packetizer, type, buffer, len, v2 < all, v2 > 0);
+  TRACE_END("packetize");
+  return 0;
+}
+
+int deliver_data(int client_sock, uint16_t type, char *data, size_t len) {
+  if (local_ring && shm_ring_write(local_ring, type, data, len) < 0) return -1;
+  if (archive && archive_append(archive, type, data, len) < 0) return -1;
+  if (client_sock == -1) // failed write to stdout/stderr
+    return write_exact(type == METADATA ? STDERR_FILENO : STDOUT_FILENO, data, len) < 0 ? -1 : 0;
+  return send_udp_data(type, data, len);
+}
+
+void publish_data(int client_sock) {
+  if (client_sock != -1) flush_udp_data();
+  if (use_xdp) xdp_tx_kick(&xdp);
+  if (use_uring) fanout_flush();
+  publish_rings();
+}
+
+static int deliver(void *arg, uint16_t type, char *data, size_t len) {
+  return deliver_data(*(int *)arg, type, data, len);
+}
+
+/* stdout mode can move audio from the upstream socket to a stdout pipe
+ * without copying it; nothing else may need the bytes then            */
+static bool can_splice(struct stream_source *source, const struct icy_demux *demux) {
+  if (source->read != &fd_read || local_ring || archive || demux->metaint == 0) return false;
+  struct stat st;
+  if (fstat(source->fd, &st) < 0 || !S_ISSOCK(st.st_mode)) return false;
+  if (stdout_pipe < 0) {
+    stdout_pipe = fstat(STDOUT_FILENO, &st) == 0 && S_ISFIFO(st.st_mode);
+    // may fail above /proc/sys/fs/pipe-max-size, the current size is fine then
+    if (stdout_pipe) fcntl(STDOUT_FILENO, F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+  }
+  return stdout_pipe;
+}
+
+/* up to len bytes of audio from sock into stdout, 0 at the end of the stream */
+static ssize_t splice_audio(int sock, size_t len) {
+  for (;;) {
+    ssize_t ret = splice(sock, NULL, STDOUT_FILENO, NULL, len, SPLICE_F_MOVE);
+    if (ret >= 0) return ret;
+    if (errno == EINTR) continue; // e.g. SIGUSR1 trace dump
+    if (errno != EAGAIN) return -1;
+    // a non-blocking stdout is full, or the upstream has timed out
+    struct pollfd pfd = {.fd = STDOUT_FILENO, .events = POLLOUT};
+    if (poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLOUT)) return -1;
+    if (wait_writable(STDOUT_FILENO) < 0) return -1;
+  }
+}
+
+/* audio spans are spliced, only the length bytes and metadata (exactly,
+ * so that no audio comes with them) are read and go through the demux */
+static int splice_http_data(struct stream_source *source, struct icy_demux *demux,
+                            char *buffer, size_t buffer_len) {
+  int client_sock = -1;
+  while (cont && !stop_ingest) {
+    ssize_t len;
+    if (demux->metaint < 0 || demux->state == ICY_AUDIO) {
+      TRACE_BEGIN("upstream_splice");
+      len = splice_audio(source->fd, demux->metaint < 0 ? SPLICE_LEN
+                                                         : MIN(demux->left, SPLICE_LEN));
+      TRACE_END("upstream_splice");
+      if (len > 0 && demux->metaint > 0 && (demux->left -= len) == 0)
+        demux->state = ICY_LENGTH;
+    } else {
+      TRACE_BEGIN("upstream_read");
+      len = source->read(source, buffer,
+                         demux->state == ICY_LENGTH ? 1 : MIN(demux->left, buffer_len));
+      TRACE_END("upstream_read");
+      if (len > 0 && icy_demux_feed(demux, buffer, len, &deliver, &client_sock) < 0) return -1;
+    }
+    if (len < 0) return -1; // strange error or timeout
+    if (len == 0) break;    // end of stream
+  }
+  return 0;
+}
+
+int receive_http_data(struct stream_source *source, struct icy_demux *demux, char *buffer,
+                      size_t buffer_len, size_t data_len, int client_sock) {
+  char *start = buffer;
+  ingest_stamp(realtime_us()); // what came with the header is not older than that
+  for (;;) {
+    TRACE_BEGIN("demux");
+    if (icy_demux_feed(demux, buffer, data_len, &deliver, &client_sock) < 0) return -1;
+    // audio ending right before metadata waits, so both share a datagram
+    if (client_sock != -1 && demux->state != ICY_LENGTH && flush_udp_data() < 0) return -1;
+    publish_rings();
+    if (use_xdp) xdp_tx_kick(&xdp); // frames of a read go out before the next one
+    if (use_uring && source->read != &uring_read) fanout_flush(); // no read to submit them with
+    TRACE_END("demux");
+    if (!cont || stop_ingest) break;
+    if (client_sock == -1 && can_splice(source, demux)) {
+      if (splice_http_data(source, demux, start, buffer_len) < 0) return -1;
+      break;
     }
+    TRACE_BEGIN("upstream_read");
+    buffer = start;
+    ssize_t len = source->map ? source->map(source, &buffer, buffer_len)
+                              : source->read(source, buffer, buffer_len);
+    TRACE_END("upstream_read");
+    if (len < 0) return -1; // strange error or timeout
+    if (len == 0) break;    // end of stream
+    data_len = len;
+    ingest_stamp(realtime_us());
   }
+  publish_data(client_sock);
 
   return 0;
 }
@@ -1,20 +1,97 @@
 #ifndef _RADIO_HTTP_CONNECTION_H_
 #define _RADIO_HTTP_CONNECTION_H_
 
+#include <netinet/in.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <time.h>
+
+#include "archive.h"
+#include "icy_demux.h"
+#include "shm_ring.h"
+#include "stream_source.h"
+
+#define MAX_UDP_MSG_SIZE 0x400
+
+struct xdp_peer;
 
 void send_http_request(int sock, const char *resource, bool metadata);
 
 /* additional data (after CRLF that ends a header is being stored in buffer
- * and its size is being stored in *received_data       */
-int receive_http_header(int sock, long *icy_metaint, char **icy_name,
-                        size_t *icy_name_len, char *buffer, size_t buffer_len,
-                        size_t *received_data);
+ * and its size is being stored in *received_data; content-type (without
+ * parameters, "" if there is none) goes to content_type, icy-br (kbps,
+ * left as it is if there is none) to *icy_br unless it is NULL  */
+int receive_http_header(struct stream_source *source, long *icy_metaint, char **icy_name,
+                        size_t *icy_name_len, char *content_type, size_t content_type_len,
+                        long *icy_br, char *buffer, size_t buffer_len, size_t *received_data);
+
+/* fan-out of demuxed data to clients on the given UDP socket */
+int udp_data_init(int sock);
+
+void udp_data_destroy(void);
+
+int send_udp_data(uint16_t type, char *buffer, size_t len);
+
+/* sends the partially filled v2 datagram, if any */
+int flush_udp_data(void);
+
+/* data delivered from now on was read from upstream (at the origin) at
+ * realtime_us; v2 datagrams carry it in STAMP                         */
+void ingest_stamp(uint64_t realtime_us);
+
+/* switches source reads and the fan-out to io_uring (after udp_data_init);
+ * buffer (the one reads go to) is registered if possible. With source NULL
+ * only the fan-out is. -1 if io_uring is not available, nothing changes then */
+int uring_delivery_init(struct stream_source *source, char *buffer, size_t buffer_len);
+
+void uring_delivery_destroy(void);
+
+/* sends the fan-out through AF_XDP on a queue of interface ifname (after
+ * udp_data_init, instead of io_uring sends); -1 if it can't, the socket
+ * keeps sending then                                                   */
+int xdp_delivery_init(const char *ifname, uint32_t queue);
+
+void xdp_delivery_destroy(void);
+
+/* frame headers for a new client, NULL without AF_XDP (or memory) */
+struct xdp_peer *xdp_delivery_peer(const struct sockaddr_in *address, time_t now);
+
+/* resolves the peers of clients again once they may be out of date,
+ * a few per call; only from the thread that removes clients        */
+void xdp_delivery_refresh(time_t now);
+
+/* audio goes to clients in whole codec frames (FRAME_NONE - as it comes);
+ * carry is a partial frame kept by a previous process                  */
+void frame_delivery_init(int codec, const char *carry, size_t carry_len);
+
+int frame_delivery_codec(void);
+
+/* the partial frame kept for the next read */
+const char *frame_delivery_carry(size_t *len);
+
+/* demuxed data is also appended to ring (NULL to disable) */
+void local_delivery_init(struct shm_ring *ring);
+
+/* and recorded in the time-shift archive (NULL to disable) */
+void archive_delivery_init(struct archive *archive);
+
+/* passes a piece of audio or metadata on: to clients on client_sock (or
+ * stdout/stderr if it is -1) and to the local ring                     */
+int deliver_data(int client_sock, uint16_t type, char *data, size_t len);
+
+/* sends out whatever deliver_data has batched */
+void publish_data(int client_sock);
+
+// makes receive_http_data return at the next read boundary
+extern _Atomic bool stop_ingest;
 
 /* set client_sock to -1 if audio/metadata should be passed to stdout/stderr
- * instead of clients        */
-int receive_http_data(int sock, long icy_metaint, char *buffer,
+ * instead of clients; demux keeps the stream position between calls. A
+ * source that can map its data is not copied into buffer; nor is audio
+ * from a socket going to a stdout pipe (it is spliced)                */
+int receive_http_data(struct stream_source *source, struct icy_demux *demux, char *buffer,
                       size_t buffer_len, size_t data_len, int client_sock);
 
 #endif  // _RADIO_HTTP_CONNECTION_H_
@@ -0,0 +1,47 @@
+#include "icy_demux.h"
+
+#include "client_protocol.h"
+#include "utils.h"
+
+void icy_demux_init(struct icy_demux *demux, long metaint) {
+  demux->metaint = metaint;
+  demux->state = ICY_AUDIO;
+  demux->left = metaint;
+}
+
+int icy_demux_feed(struct icy_demux *demux, char *buffer, size_t len,
+                   icy_sink_t sink, void *arg) {
+  if (demux->metaint < 0) // no metadata
+    return len > 0 ? sink(arg, AUDIO, buffer, len) : 0;
+
+  size_t pos = 0;
+  while (pos < len) {
+    if (demux->state == ICY_LENGTH) {
+      demux->left = (size_t)(unsigned char) buffer[pos++] * 16;
+      if (demux->left > 0) {
+        demux->state = ICY_METADATA;
+      } else {
+        demux->state = ICY_AUDIO;
+        demux->left = demux->metaint;
+      }
+      continue;
+    }
+
+    size_t bytes = MIN(demux->left, len - pos);
+    if (bytes > 0 &&
+        sink(arg, demux->state == ICY_METADATA ? METADATA : AUDIO, buffer + pos, bytes) < 0)
+      return -1;
+    pos += bytes;
+    demux->left -= bytes;
+
+    if (demux->left == 0) {
+      if (demux->state == ICY_METADATA) {
+        demux->state = ICY_AUDIO;
+        demux->left = demux->metaint;
+      } else {
+        demux->state = ICY_LENGTH;
+      }
+    }
+  }
+  return 0;
+}
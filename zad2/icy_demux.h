@@ -0,0 +1,27 @@
+#ifndef _RADIO_ICY_DEMUX_H_
+#define _RADIO_ICY_DEMUX_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ICY_AUDIO     0
+#define ICY_LENGTH    1   // next byte is the metadata length / 16
+#define ICY_METADATA  2
+
+/* splits an ICY stream (icy-metaint bytes of audio, a length byte, metadata,
+ * audio again...) into AUDIO and METADATA pieces, across any read sizes */
+struct icy_demux {
+  long metaint;           // < 0 - no metadata in the stream
+  int state;
+  size_t left;            // bytes left in the current audio or metadata block
+};
+
+/* data points into the fed buffer, a negative return value stops feeding */
+typedef int (*icy_sink_t)(void *arg, uint16_t type, char *data, size_t len);
+
+void icy_demux_init(struct icy_demux *demux, long metaint);
+
+int icy_demux_feed(struct icy_demux *demux, char *buffer, size_t len,
+                   icy_sink_t sink, void *arg);
+
+#endif  // _RADIO_ICY_DEMUX_H_
@@ -0,0 +1,204 @@
+#include "latency.h"
+
+#include "utils.h"
+
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+void latency_reset(struct latency_histogram *histogram) {
+  memset(histogram, 0, sizeof(*histogram));
+  histogram->min = UINT32_MAX;
+}
+
+static unsigned bucket(uint32_t us) {
+  if (us < LATENCY_SUB_BUCKETS) return us;
+  unsigned e = 31 - __builtin_clz(us); // >= 2
+  return LATENCY_SUB_BUCKETS * (e - 1) + ((us >> (e - 2)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+static uint32_t bucket_upper(unsigned index) {
+  if (index < LATENCY_SUB_BUCKETS) return index;
+  unsigned e = index / LATENCY_SUB_BUCKETS + 1, sub = index % LATENCY_SUB_BUCKETS;
+  uint64_t lower = (uint64_t) (LATENCY_SUB_BUCKETS + sub) << (e - 2);
+  return MIN(lower + ((uint64_t) 1 << (e - 2)) - 1, UINT32_MAX);
+}
+
+void latency_add(struct latency_histogram *histogram, uint32_t us) {
+  histogram->counts[bucket(us)]++;
+  histogram->total++;
+  histogram->min = MIN(histogram->min, us);
+  histogram->max = MAX(histogram->max, us);
+}
+
+uint32_t latency_quantile(const struct latency_histogram *histogram, double q) {
+  if (histogram->total == 0) return 0;
+  double exact = q * histogram->total;
+  uint64_t rank = exact;
+  if (rank < exact || rank == 0) rank++;
+  uint64_t seen = 0;
+  for (unsigned i = 0; i < LATENCY_BUCKETS; ++i) {
+    seen += histogram->counts[i];
+    if (seen >= rank) return MIN(bucket_upper(i), histogram->max);
+  }
+  return histogram->max;
+}
+
+void tracker_reset(struct delivery_tracker *tracker) {
+  latency_reset(&tracker->window);
+  tracker->seq_known = false;
+  tracker->lost = 0;
+}
+
+uint64_t stamp_ingest_us(const struct stamp_info *stamp) {
+  return (uint64_t) ntohl(stamp->ingest_us_hi) << 32 | ntohl(stamp->ingest_us_lo);
+}
+
+uint32_t tracker_add(struct delivery_tracker *tracker, const struct stamp_info *stamp,
+                     uint64_t now_us) {
+  uint32_t seq = ntohl(stamp->seq);
+  // a jump back is a reordered datagram or a restarted proxy, not a loss
+  int32_t gap = (int32_t) (seq - tracker->next_seq);
+  uint32_t lost = tracker->seq_known && gap > 0 ? gap : 0;
+  tracker->lost += lost;
+  if (!tracker->seq_known || gap >= 0) tracker->next_seq = seq + 1;
+  tracker->seq_known = true;
+
+  uint64_t ingest = stamp_ingest_us(stamp);
+  // clocks out of sync can make it negative
+  uint64_t delay = now_us > ingest ? now_us - ingest : 0;
+  latency_add(&tracker->window, MIN(delay, UINT32_MAX));
+  return lost;
+}
+
+bool tracker_report(struct delivery_tracker *tracker, struct delivery_report *report) {
+  struct latency_histogram *window = &tracker->window;
+  if (window->total == 0 && tracker->lost == 0) return false;
+  report->samples = htonl(MIN(window->total, UINT32_MAX));
+  report->lost = htonl(tracker->lost);
+  report->min_us = htonl(window->total > 0 ? window->min : 0);
+  report->p50_us = htonl(latency_quantile(window, 0.5));
+  report->p99_us = htonl(latency_quantile(window, 0.99));
+  latency_reset(window);
+  tracker->lost = 0;
+  return true;
+}
+
+void playout_reset(struct playout_tracker *tracker) {
+  latency_reset(&tracker->window);
+  tracker->late = 0;
+}
+
+void playout_add(struct playout_tracker *tracker, uint64_t error_us) {
+  latency_add(&tracker->window, MIN(error_us, UINT32_MAX));
+  if (error_us > PLAYOUT_LATE_US) tracker->late++;
+}
+
+bool playout_report(struct playout_tracker *tracker, uint32_t clock_delay_us,
+                    struct playout_report *report) {
+  struct latency_histogram *window = &tracker->window;
+  if (window->total == 0) return false;
+  report->samples = htonl(MIN(window->total, UINT32_MAX));
+  report->late = htonl(tracker->late);
+  report->p50_us = htonl(latency_quantile(window, 0.5));
+  report->p99_us = htonl(latency_quantile(window, 0.99));
+  report->clock_delay_us = htonl(clock_delay_us);
+  playout_reset(tracker);
+  return true;
+}
+
+int latency_record(struct fleet_latency *fleet, struct client *client,
+                   const struct delivery_report *report) {
+  if (!client->latency) {
+    client->latency = malloc(sizeof(struct client_latency));
+    if (!client->latency) return -1;
+    latency_reset(&client->latency->p50);
+    latency_reset(&client->latency->p99);
+    client->latency->samples = client->latency->lost = 0;
+  }
+  if (fleet->reports == 0) {
+    latency_reset(&fleet->p50);
+    latency_reset(&fleet->p99);
+    fleet->samples = fleet->lost = 0;
+  }
+  struct client_latency *latency = client->latency;
+  uint32_t samples = ntohl(report->samples), lost = ntohl(report->lost);
+  uint32_t p50 = ntohl(report->p50_us), p99 = ntohl(report->p99_us);
+  latency->samples += samples;
+  latency->lost += lost;
+  fleet->samples += samples;
+  fleet->lost += lost;
+  fleet->reports++;
+  if (samples > 0) { // only losses otherwise
+    latency_add(&latency->p50, p50);
+    latency_add(&latency->p99, p99);
+    latency->last_p99 = p99;
+    latency_add(&fleet->p50, p50);
+    latency_add(&fleet->p99, p99);
+  }
+  return 0;
+}
+
+void latency_record_playout(struct fleet_latency *fleet, const struct playout_report *report) {
+  uint32_t p50 = ntohl(report->p50_us), p99 = ntohl(report->p99_us);
+  if (fleet->playout_reports == 0) {
+    fleet->playout_samples = fleet->playout_late = 0;
+    fleet->playout_min_p50 = UINT32_MAX;
+    fleet->playout_max_p50 = fleet->playout_max_p99 = fleet->max_clock_delay = 0;
+  }
+  fleet->playout_reports++;
+  fleet->playout_samples += ntohl(report->samples);
+  fleet->playout_late += ntohl(report->late);
+  fleet->playout_min_p50 = MIN(fleet->playout_min_p50, p50);
+  fleet->playout_max_p50 = MAX(fleet->playout_max_p50, p50);
+  fleet->playout_max_p99 = MAX(fleet->playout_max_p99, p99);
+  fleet->max_clock_delay = MAX(fleet->max_clock_delay, ntohl(report->clock_delay_us));
+}
+
+static void playout_print(struct fleet_latency *fleet) {
+  if (fleet->playout_reports == 0) return;
+  fprintf(stderr, "playout: %" PRIu64 " reports, skew %.1f ms (median write error %.1f to "
+          "%.1f ms) +/- %.1f ms of clock offsets, p99 error max %.1f ms, late %" PRIu64
+          " of %" PRIu64 " datagrams\n", fleet->playout_reports,
+          (fleet->playout_max_p50 - fleet->playout_min_p50) / 1000.0,
+          fleet->playout_min_p50 / 1000.0, fleet->playout_max_p50 / 1000.0,
+          fleet->max_clock_delay / 2000.0, fleet->playout_max_p99 / 1000.0, fleet->playout_late,
+          fleet->playout_samples);
+  fleet->playout_reports = 0;
+}
+
+void latency_print(struct fleet_latency *fleet, client_list_t list) {
+  playout_print(fleet);
+  if (fleet->reports == 0) return;
+  double loss = fleet->samples + fleet->lost > 0 ?
+                100.0 * fleet->lost / (fleet->samples + fleet->lost) : 0;
+  fprintf(stderr, "latency: %" PRIu64 " reports, p50 of p50s %.1f ms, p99 of p99s %.1f ms, "
+          "max p99 %.1f ms, lost %" PRIu64 " of %" PRIu64 " datagrams (%.2f%%)\n",
+          fleet->reports, latency_quantile(&fleet->p50, 0.5) / 1000.0,
+          latency_quantile(&fleet->p99, 0.99) / 1000.0,
+          fleet->p99.total > 0 ? fleet->p99.max / 1000.0 : 0.0, fleet->lost,
+          fleet->samples + fleet->lost, loss);
+
+  // the client whose reports have been worst, by the p99 of its p99s
+  struct client *worst = NULL;
+  uint32_t worst_p99 = 0;
+  FOR_LIST(c, list) {
+    if (!c->latency || c->latency->p99.total == 0) continue;
+    uint32_t p99 = latency_quantile(&c->latency->p99, 0.99);
+    if (!worst || p99 > worst_p99) {
+      worst = c;
+      worst_p99 = p99;
+    }
+  }
+  if (worst) {
+    char address[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &worst->client_address.sin_addr, address, sizeof(address));
+    fprintf(stderr, "latency: worst client %s:%u p99 %.1f ms (last %.1f ms), lost %" PRIu64
+            " of %" PRIu64 "\n", address, ntohs(worst->client_address.sin_port),
+            worst_p99 / 1000.0, worst->latency->last_p99 / 1000.0, worst->latency->lost,
+            worst->latency->samples + worst->latency->lost);
+  }
+  fleet->reports = 0;
+}
@@ -0,0 +1,111 @@
+#ifndef _RADIO_LATENCY_H_
+#define _RADIO_LATENCY_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "client_protocol.h"
+
+/* Delivery latency: clients measure it from STAMP records (upstream read
+ * at the origin proxy to their write, so clocks have to be in sync) and
+ * report it in KEEPALIVE; proxies keep a histogram per client and one of
+ * all reports.                                                         */
+
+/* log-linear buckets: 4 per power of two (at most 19% off), up to 2^32 us */
+#define LATENCY_SUB_BUCKETS  4
+#define LATENCY_BUCKETS      128
+
+#define LATENCY_REPORT_S     60    // how often a proxy reports on stderr
+
+#define PLAYOUT_LATE_US      2000  // later than that, a datagram spoils the sync
+
+struct latency_histogram {
+  uint64_t counts[LATENCY_BUCKETS];
+  uint64_t total;
+  uint32_t min;
+  uint32_t max;
+};
+
+void latency_reset(struct latency_histogram *histogram);
+
+void latency_add(struct latency_histogram *histogram, uint32_t us);
+
+/* the upper bound of the bucket holding quantile q (0 if empty) */
+uint32_t latency_quantile(const struct latency_histogram *histogram, double q);
+
+/* client side: stamps of the chosen proxy's datagrams */
+struct delivery_tracker {
+  struct latency_histogram window; // since the last report
+  uint32_t next_seq;
+  bool seq_known;
+  uint32_t lost;
+};
+
+void tracker_reset(struct delivery_tracker *tracker);
+
+/* CLOCK_REALTIME of the upstream read a stamp carries */
+uint64_t stamp_ingest_us(const struct stamp_info *stamp);
+
+/* a datagram has come, its audio has been written at now_us; returns
+ * how many datagrams its sequence number shows to be lost before it */
+uint32_t tracker_add(struct delivery_tracker *tracker, const struct stamp_info *stamp,
+                     uint64_t now_us);
+
+/* false if there is nothing to report; starts a new window */
+bool tracker_report(struct delivery_tracker *tracker, struct delivery_report *report);
+
+/* client side, synchronized playout: how long after its playout time
+ * the audio of a datagram got written                               */
+struct playout_tracker {
+  struct latency_histogram window; // since the last report
+  uint32_t late;
+};
+
+void playout_reset(struct playout_tracker *tracker);
+
+void playout_add(struct playout_tracker *tracker, uint64_t error_us);
+
+/* false if there is nothing to report; starts a new window */
+bool playout_report(struct playout_tracker *tracker, uint32_t clock_delay_us,
+                    struct playout_report *report);
+
+/* proxy side */
+struct client_latency {
+  struct latency_histogram p50;    // of the client's reports
+  struct latency_histogram p99;
+  uint64_t samples;
+  uint64_t lost;
+  uint32_t last_p99;
+};
+
+/* Clients playing out in sync write the same audio at the same time, up
+ * to their write errors and clock offsets: the skew between two of them
+ * is the difference of their median errors (PLAYOUT), give or take
+ * half of their clock round trips.                                    */
+struct fleet_latency {
+  struct latency_histogram p50;    // of all reports, since the last print
+  struct latency_histogram p99;
+  uint64_t samples;
+  uint64_t lost;
+  uint64_t reports;
+  uint64_t playout_reports;        // and of PLAYOUT ones
+  uint64_t playout_samples;
+  uint64_t playout_late;
+  uint32_t playout_min_p50;
+  uint32_t playout_max_p50;
+  uint32_t playout_max_p99;
+  uint32_t max_clock_delay;
+};
+
+/* a report of client (from KEEPALIVE data), -1 if it cannot be kept */
+int latency_record(struct fleet_latency *fleet, struct client *client,
+                   const struct delivery_report *report);
+
+/* a PLAYOUT report of some client */
+void latency_record_playout(struct fleet_latency *fleet, const struct playout_report *report);
+
+/* prints the fleet histograms and the worst client on stderr (from the
+ * thread changing list), then starts new fleet ones                    */
+void latency_print(struct fleet_latency *fleet, client_list_t list);
+
+#endif  // _RADIO_LATENCY_H_
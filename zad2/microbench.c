@@ -0,0 +1,428 @@
+/* Microbenchmarks of the ingest pipeline stages, run on in-memory data:
+ * HTTP header parsing, ICY demux and packetization. Allocations are
+ * counted by wrapping malloc and friends (see the Makefile). With
+ * -x ifname -a address the fan-out to clients at address (reached
+ * through ifname) is measured too: socket, io_uring and AF_XDP sends.  */
+
+#include "client_protocol.h"
+#include "frame_aligner.h"
+#include "http_connection.h"
+#include "icy_demux.h"
+#include "packetizer.h"
+#include "stream_source.h"
+#include "utils.h"
+
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BUFFER_LEN     0x1000
+#define MIN_BENCH_NS   200000000ULL
+#define STREAM_LEN     (4 << 20)
+#define FANOUT_CLIENTS 16
+#define FANOUT_PORT    40000   // of the first client, nothing listens there
+
+// needed by http_connection.c
+volatile sig_atomic_t cont = 1;
+pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned long allocations = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+  allocations++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+  allocations++;
+  return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  allocations++;
+  return __real_realloc(ptr, size);
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct memory_source {
+  struct stream_source base;
+  const char *data;
+  size_t len;
+  size_t pos;
+  size_t split;            // at most this many bytes per read
+};
+
+static ssize_t memory_read(struct stream_source *source, void *buffer, size_t len) {
+  struct memory_source *memory = (struct memory_source *) source;
+  size_t bytes = MIN(MIN(len, memory->split), memory->len - memory->pos);
+  memcpy(buffer, memory->data + memory->pos, bytes);
+  memory->pos += bytes;
+  return bytes;
+}
+
+static void memory_source_init(struct memory_source *source, const char *data, size_t len,
+                               size_t split) {
+  source->base.read = &memory_read;
+  source->base.map = NULL;
+  source->base.fd = -1;
+  source->data = data;
+  source->len = len;
+  source->pos = 0;
+  source->split = split;
+}
+
+struct result {
+  uint64_t runs;
+  uint64_t bytes;
+  uint64_t ns;
+  unsigned long allocations;
+};
+
+static void report(const char *name, const struct result *result) {
+  printf("%-40s %8.3f ns/byte %10.1f allocs/run %10" PRIu64 " runs\n", name,
+         (double) result->ns / result->bytes,
+         (double) result->allocations / result->runs, result->runs);
+}
+
+/* ---- HTTP header ---- */
+
+static char *make_response(size_t header_len, size_t *len) {
+  size_t body_len = BUFFER_LEN;
+  char *response = malloc(header_len + body_len + 64);
+  if (!response) exit(1);
+  size_t pos = sprintf(response, "ICY 200 OK\r\nicy-name:Benchmark Radio\r\nicy-metaint:16000\r\n");
+  for (unsigned i = 0; pos + 2 < header_len; ++i) {
+    size_t line = MIN(header_len - pos - 2, 64);
+    if (line < 8) line = 8;
+    pos += sprintf(response + pos, "x-%u:", i % 10);
+    while (line-- > 7) response[pos++] = 'a';
+    response[pos++] = '\r';
+    response[pos++] = '\n';
+  }
+  response[pos++] = '\r';
+  response[pos++] = '\n';
+  memset(response + pos, 0x55, body_len);
+  *len = pos + body_len;
+  return response;
+}
+
+static void bench_header(size_t header_len, size_t split) {
+  size_t len;
+  char *response = make_response(header_len, &len);
+  char buffer[BUFFER_LEN];
+  struct result result = {0, 0, 0, 0};
+
+  uint64_t start = now_ns();
+  unsigned long allocations_before = allocations;
+  do {
+    struct memory_source source;
+    memory_source_init(&source, response, len, split);
+    long icy_metaint = -1;
+    char *icy_name = NULL;
+    size_t icy_name_len, received;
+    char content_type[32];
+    if (receive_http_header(&source.base, &icy_metaint, &icy_name, &icy_name_len, content_type,
+                            sizeof(content_type), NULL, buffer, BUFFER_LEN, &received) < 0 ||
+        icy_metaint != 16000) {
+      fprintf(stderr, "header parsing failed (%zu bytes, split %zu)\n", header_len, split);
+      exit(1);
+    }
+    free(icy_name);
+    result.runs++;
+    result.bytes += len - received;
+    result.ns = now_ns() - start;
+  } while (result.ns < MIN_BENCH_NS);
+  result.allocations = allocations - allocations_before;
+
+  char name[64];
+  snprintf(name, sizeof(name), "header %zu B, reads of %zu B", header_len, split);
+  report(name, &result);
+  free(response);
+}
+
+/* ---- ICY demux ---- */
+
+static char *make_icy_stream(long metaint, size_t *len) {
+  char *stream = malloc(STREAM_LEN + STREAM_LEN / 16 + 64);
+  if (!stream) exit(1);
+  size_t pos = 0;
+  while (pos < STREAM_LEN) {
+    memset(stream + pos, 0x55, metaint);
+    pos += metaint;
+    stream[pos++] = 2; // 32 bytes of metadata
+    memset(stream + pos, 'm', 32);
+    pos += 32;
+  }
+  *len = pos;
+  return stream;
+}
+
+static int count_sink(void *arg, uint16_t type __attribute__((unused)),
+                      char *data __attribute__((unused)), size_t len) {
+  *(uint64_t *)arg += len;
+  return 0;
+}
+
+static void bench_demux(long metaint) {
+  size_t len;
+  char *stream = make_icy_stream(metaint, &len);
+  struct result result = {0, 0, 0, 0};
+  uint64_t delivered = 0;
+
+  uint64_t start = now_ns();
+  unsigned long allocations_before = allocations;
+  do {
+    struct icy_demux demux;
+    icy_demux_init(&demux, metaint);
+    for (size_t pos = 0; pos < len; pos += BUFFER_LEN)
+      icy_demux_feed(&demux, stream + pos, MIN(BUFFER_LEN, len - pos), &count_sink, &delivered);
+    result.runs++;
+    result.bytes += len;
+    result.ns = now_ns() - start;
+  } while (result.ns < MIN_BENCH_NS);
+  result.allocations = allocations - allocations_before;
+
+  char name[64];
+  snprintf(name, sizeof(name), "demux icy-metaint %ld", metaint);
+  report(name, &result);
+  free(stream);
+}
+
+/* ---- packetizer ---- */
+
+static void count_send(void *arg, struct packet *packet __attribute__((unused)), size_t len,
+                       uint8_t version __attribute__((unused))) {
+  uint64_t *counters = arg;
+  counters[0]++;
+  counters[1] += len;
+}
+
+static void bench_packetizer(size_t dgram_len, bool v2) {
+  static char audio[STREAM_LEN];
+  struct packetizer packetizer;
+  uint64_t counters[2] = {0, 0};
+  struct result result = {0, 0, 0, 0};
+
+  unsigned long allocations_before = allocations;
+  if (packetizer_init(&packetizer, NULL, dgram_len, dgram_len, &count_send, counters) < 0)
+    exit(1);
+  uint64_t start = now_ns();
+  do {
+    for (size_t pos = 0; pos < STREAM_LEN; pos += BUFFER_LEN) {
+      packetizer_add(&packetizer, AUDIO, audio + pos, BUFFER_LEN, !v2, v2);
+      packetizer_flush(&packetizer);
+    }
+    result.runs++;
+    result.bytes += STREAM_LEN;
+    result.ns = now_ns() - start;
+  } while (result.ns < MIN_BENCH_NS);
+  packetizer_destroy(&packetizer);
+  result.allocations = allocations - allocations_before;
+
+  char name[64];
+  snprintf(name, sizeof(name), "packetize v%d, %zu B datagrams", v2 ? 2 : 1, dgram_len);
+  report(name, &result);
+  printf("%-40s %8.1f datagrams/MiB\n", "", (double) counters[0] / result.runs / (STREAM_LEN >> 20));
+}
+
+/* ---- frame alignment ---- */
+
+#define MP3_FRAME_LEN  417     // MPEG-1 layer III, 128 kbps, 44.1 kHz, no padding
+
+struct frame_counters {
+  struct packetizer *packetizer;
+  uint64_t frames;
+};
+
+static int add_frame(void *arg, uint16_t type __attribute__((unused)), char *data, size_t len) {
+  struct frame_counters *counters = arg;
+  counters->frames++;
+  packetizer_add_frame(counters->packetizer, data, len, false, true);
+  return 0;
+}
+
+/* reads shorter than a frame leave a partial one in the carry */
+static void bench_frames(size_t read_len) {
+  static char stream[STREAM_LEN];
+  size_t len = STREAM_LEN / MP3_FRAME_LEN * MP3_FRAME_LEN;
+  for (size_t pos = 0; pos < len; pos += MP3_FRAME_LEN) {
+    memset(stream + pos, 0x55, MP3_FRAME_LEN);
+    memcpy(stream + pos, "\xff\xfb\x90\x64", 4);
+  }
+  struct packetizer packetizer;
+  uint64_t counters[2] = {0, 0};
+  struct frame_counters frame_counters = {&packetizer, 0};
+  struct frame_aligner *aligner = malloc(sizeof(struct frame_aligner));
+  struct result result = {0, 0, 0, 0};
+  if (!aligner) exit(1);
+
+  unsigned long allocations_before = allocations;
+  if (packetizer_init(&packetizer, NULL, MAX_UDP_MSG_SIZE, V2_MAX_DGRAM_LEN, &count_send,
+                      counters) < 0)
+    exit(1);
+  uint64_t start = now_ns();
+  do {
+    frame_aligner_init(aligner, FRAME_MP3);
+    for (size_t pos = 0; pos < len; pos += read_len) {
+      frame_aligner_feed(aligner, stream + pos, MIN(read_len, len - pos), &add_frame,
+                         &frame_counters);
+      packetizer_flush(&packetizer);
+    }
+    result.runs++;
+    result.bytes += len;
+    result.ns = now_ns() - start;
+  } while (result.ns < MIN_BENCH_NS);
+  packetizer_destroy(&packetizer);
+  result.allocations = allocations - allocations_before;
+
+  if (frame_counters.frames != result.runs * (len / MP3_FRAME_LEN)) {
+    fprintf(stderr, "frames lost with reads of %zu B\n", read_len);
+    exit(1);
+  }
+  char name[64];
+  snprintf(name, sizeof(name), "frame-aligned v2, mp3, reads of %zu B", read_len);
+  report(name, &result);
+  printf("%-40s %8.1f datagrams/MiB, %.0f%% of frames found\n", "",
+         (double) counters[0] / result.runs / ((double) len / (1 << 20)),
+         100.0 * frame_counters.frames / result.runs / (len / MP3_FRAME_LEN));
+  free(aligner);
+}
+
+/* ---- fan-out ---- */
+
+static uint64_t tx_packets(const char *ifname) {
+  char path[64];
+  unsigned long long packets = 0;
+  snprintf(path, sizeof(path), "/sys/class/net/%s/statistics/tx_packets", ifname);
+  FILE *file = fopen(path, "r");
+  if (file) {
+    if (fscanf(file, "%llu", &packets) != 1) packets = 0;
+    fclose(file);
+  }
+  return packets;
+}
+
+enum fanout_backend {FANOUT_SOCKET, FANOUT_URING, FANOUT_XDP};
+
+static void bench_fanout(const char *ifname, const char *address, enum fanout_backend backend) {
+  const char *names[] = {"socket", "io_uring", "AF_XDP"};
+  static char audio[STREAM_LEN];
+  struct sockaddr_in peer = {.sin_family = AF_INET, .sin_port = htons(FANOUT_PORT)};
+  struct sockaddr_in any = {.sin_family = AF_INET};
+  struct result result = {0, 0, 0, 0};
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0 || bind(sock, (struct sockaddr *) &any, sizeof(any)) < 0 ||
+      inet_pton(AF_INET, address, &peer.sin_addr) != 1) {
+    fprintf(stderr, "fan-out to %s not possible\n", address);
+    exit(1);
+  }
+  // resolves the neighbour for the AF_XDP headers
+  sendto(sock, "", 0, 0, (struct sockaddr *) &peer, sizeof(peer));
+  usleep(100000);
+
+  for (unsigned i = 0; i < FANOUT_CLIENTS; ++i) {
+    struct client *client = calloc(1, sizeof(struct client));
+    if (!client) exit(1);
+    client->client_address = peer;
+    client->client_address.sin_port = htons(FANOUT_PORT + i);
+    client->valid = true;
+    client->version = PROTOCOL_V2;
+    add_client(&client_list, client);
+  }
+  if (udp_data_init(sock) < 0) exit(1);
+  if ((backend == FANOUT_URING && uring_delivery_init(NULL, NULL, 0) < 0) ||
+      (backend == FANOUT_XDP && xdp_delivery_init(ifname, 0) < 0)) {
+    fprintf(stderr, "%s not available on %s\n", names[backend], ifname);
+    exit(1);
+  }
+  xdp_delivery_refresh(time(NULL));  // the peers, as the control thread would
+
+  unsigned long allocations_before = allocations;
+  uint64_t packets_before = tx_packets(ifname);
+  uint64_t start = now_ns();
+  do {
+    for (size_t pos = 0; pos < STREAM_LEN; pos += BUFFER_LEN) {
+      send_udp_data(AUDIO, audio + pos, BUFFER_LEN);
+      publish_data(sock);
+    }
+    result.runs++;
+    result.bytes += STREAM_LEN;
+    result.ns = now_ns() - start;
+  } while (result.ns < MIN_BENCH_NS);
+  result.allocations = allocations - allocations_before;
+  uring_delivery_destroy();
+  xdp_delivery_destroy();
+  uint64_t dgrams = tx_packets(ifname) - packets_before;
+
+  udp_data_destroy();
+  clear_list(&client_list);
+  close(sock);
+
+  char name[64];
+  snprintf(name, sizeof(name), "fan-out to %d clients, %s", FANOUT_CLIENTS, names[backend]);
+  report(name, &result);
+  if (dgrams)
+    printf("%-40s %8.0f ns/datagram, %.0f k datagrams/s on %s\n", "",
+           (double) result.ns / dgrams, dgrams * 1e6 / result.ns, ifname);
+}
+
+int main(int argc, char *argv[]) {
+  const char *ifname = NULL, *address = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "x:a:")) != -1) {
+    switch (opt) {
+      case 'x':
+        ifname = optarg;
+        break;
+      case 'a':
+        address = optarg;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-x ifname -a address]\n", argv[0]);
+        exit(1);
+    }
+  }
+  if (ifname && !address) {
+    fprintf(stderr, "-x needs the clients' address (-a)\n");
+    exit(1);
+  }
+
+  const size_t header_lens[] = {128, 1024, 8192};
+  const size_t splits[] = {1, 100, 1460, BUFFER_LEN};
+  for (size_t i = 0; i < SIZE(header_lens); ++i)
+    for (size_t j = 0; j < SIZE(splits); ++j)
+      bench_header(header_lens[i], splits[j]);
+
+  const long metaints[] = {256, 1024, 8192, 16000, 65536};
+  for (size_t i = 0; i < SIZE(metaints); ++i)
+    bench_demux(metaints[i]);
+
+  const size_t dgram_lens[] = {512, 1024, 1472, 8192};
+  for (size_t i = 0; i < SIZE(dgram_lens); ++i) {
+    bench_packetizer(dgram_lens[i], false);
+    bench_packetizer(dgram_lens[i], true);
+  }
+  bench_frames(BUFFER_LEN);
+  bench_frames(100);
+
+  if (ifname) {
+    bench_fanout(ifname, address, FANOUT_SOCKET);
+    bench_fanout(ifname, address, FANOUT_URING);
+    bench_fanout(ifname, address, FANOUT_XDP);
+  }
+  return 0;
+}
@@ -0,0 +1,57 @@
+#include "packet_pool.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+int packet_pool_init(struct packet_pool *pool, unsigned count, size_t data_len) {
+  pool->stride = (sizeof(struct packet) + data_len + PACKET_ALIGN - 1) / PACKET_ALIGN * PACKET_ALIGN;
+  pool->data_len = data_len;
+  pool->count = count;
+  pool->free = NULL;
+  pool->free_count = 0;
+  if (posix_memalign((void **) &pool->memory, PACKET_ALIGN, pool->stride * count) != 0) {
+    pool->memory = NULL;
+    errno = ENOMEM;
+    return -1;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  for (unsigned i = count; i-- > 0;) {
+    struct packet *packet = (struct packet *) (pool->memory + i * pool->stride);
+    atomic_init(&packet->refs, 0);
+    packet->pool = pool;
+    packet->next_free = pool->free;
+    pool->free = packet;
+  }
+  pool->free_count = count;
+  return 0;
+}
+
+void packet_pool_destroy(struct packet_pool *pool) {
+  if (!pool->memory) return;
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->memory);
+  pool->memory = NULL;
+}
+
+struct packet *packet_get(struct packet_pool *pool) {
+  if (pthread_mutex_lock(&pool->lock) != 0) exit(1);
+  struct packet *packet = pool->free;
+  if (packet) {
+    pool->free = packet->next_free;
+    pool->free_count--;
+    atomic_store_explicit(&packet->refs, 1, memory_order_relaxed);
+  }
+  if (pthread_mutex_unlock(&pool->lock) != 0) exit(1);
+  return packet;
+}
+
+void packet_put(struct packet *packet) {
+  // the last one out sees the writes of all others (acq_rel)
+  if (atomic_fetch_sub_explicit(&packet->refs, 1, memory_order_acq_rel) != 1) return;
+  struct packet_pool *pool = packet->pool;
+  if (pthread_mutex_lock(&pool->lock) != 0) exit(1);
+  packet->next_free = pool->free;
+  pool->free = packet;
+  pool->free_count++;
+  if (pthread_mutex_unlock(&pool->lock) != 0) exit(1);
+}
@@ -0,0 +1,48 @@
+#ifndef _RADIO_PACKET_POOL_H_
+#define _RADIO_PACKET_POOL_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Fixed-size datagram buffers, allocated once and shared by reference:
+ * the packetizer builds a datagram in a packet, whoever still needs the
+ * bytes after the send callback returns (queued io_uring sends) takes a
+ * reference, and the last packet_put returns the packet to its pool.
+ * References may be dropped from any thread.                          */
+#define PACKET_ALIGN  64         // of the data, a cache line
+
+struct packet_pool;
+
+struct packet {
+  _Atomic unsigned refs;
+  struct packet_pool *pool;
+  struct packet *next_free;
+  char data[] __attribute__((aligned(PACKET_ALIGN)));
+};
+
+struct packet_pool {
+  char *memory;
+  size_t stride;           // between packets, a multiple of PACKET_ALIGN
+  size_t data_len;         // room in a packet
+  unsigned count;
+  pthread_mutex_t lock;    // guards the free list
+  struct packet *free;
+  unsigned free_count;
+};
+
+int packet_pool_init(struct packet_pool *pool, unsigned count, size_t data_len);
+
+void packet_pool_destroy(struct packet_pool *pool);
+
+/* a packet with one reference, NULL when all are in use */
+struct packet *packet_get(struct packet_pool *pool);
+
+static inline void packet_ref(struct packet *packet) {
+  atomic_fetch_add_explicit(&packet->refs, 1, memory_order_relaxed);
+}
+
+void packet_put(struct packet *packet);
+
+#endif  // _RADIO_PACKET_POOL_H_
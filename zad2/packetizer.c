@@ -0,0 +1,160 @@
+#include "packetizer.h"
+
+#include "client_protocol.h"
+#include "utils.h"
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+
+int packetizer_init(struct packetizer *packetizer, struct packet_pool *pool, size_t v1_max_len,
+                    size_t v2_max_len, packet_send_t send, void *arg) {
+  packetizer->v1_max_len = MIN(v1_max_len, CLIENT_PROTO_DGRAM_HEADER_LEN + UINT16_MAX);
+  packetizer->v2_max_len = v2_max_len & ~(size_t) 1; // records are padded to even length
+  packetizer->v2_len = 0;
+  packetizer->v1_len = 0;
+  packetizer->stamp_us = 0;
+  packetizer->seq = 0;
+  packetizer->send = send;
+  packetizer->arg = arg;
+  packetizer->v1 = packetizer->v2 = NULL;
+  packetizer->own_pool.memory = NULL;
+  if (!pool && packet_pool_init(&packetizer->own_pool, 2,
+                                MAX(packetizer->v1_max_len, packetizer->v2_max_len)) == 0)
+    pool = &packetizer->own_pool;
+  packetizer->pool = pool;
+  if (pool) {
+    packetizer->v1 = packet_get(pool);
+    packetizer->v2 = packet_get(pool);
+  }
+  if (!packetizer->v1 || !packetizer->v2 ||
+      MAX(packetizer->v1_max_len, packetizer->v2_max_len) > pool->data_len ||
+      packetizer->v1_max_len <= CLIENT_PROTO_DGRAM_HEADER_LEN ||
+      packetizer->v2_max_len <= 2 * CLIENT_PROTO_DGRAM_HEADER_LEN + sizeof(struct stamp_info)) {
+    packetizer_destroy(packetizer);
+    return -1;
+  }
+  return 0;
+}
+
+void packetizer_destroy(struct packetizer *packetizer) {
+  if (packetizer->v1) packet_put(packetizer->v1);
+  if (packetizer->v2) packet_put(packetizer->v2);
+  packetizer->v1 = packetizer->v2 = NULL;
+  packet_pool_destroy(&packetizer->own_pool);
+}
+
+/* sends a datagram built in *packet, which is then replaced if a sender kept it */
+static void send_packet(struct packetizer *packetizer, struct packet **packet, size_t len,
+                        uint8_t version) {
+  packetizer->send(packetizer->arg, *packet, len, version);
+  if (atomic_load_explicit(&(*packet)->refs, memory_order_acquire) == 1) return;
+  packet_put(*packet);
+  *packet = packet_get(packetizer->pool);
+  if (!*packet) exit(1); // senders keep fewer than the pool has
+}
+
+static void flush_v1(struct packetizer *packetizer) {
+  if (packetizer->v1_len == 0) return;
+  struct client_protocol_dgram *dgram = (struct client_protocol_dgram *) packetizer->v1->data;
+  dgram->type = htons(AUDIO);
+  dgram->length = htons(packetizer->v1_len);
+  send_packet(packetizer, &packetizer->v1, packetizer->v1_len + CLIENT_PROTO_DGRAM_HEADER_LEN,
+              PROTOCOL_V1);
+  packetizer->v1_len = 0;
+}
+
+static void flush_v2(struct packetizer *packetizer) {
+  if (packetizer->v2_len > 0) {
+    send_packet(packetizer, &packetizer->v2, packetizer->v2_len, PROTOCOL_V2);
+    packetizer->v2_len = 0;
+  }
+}
+
+void packetizer_flush(struct packetizer *packetizer) {
+  flush_v1(packetizer);
+  flush_v2(packetizer);
+}
+
+void packetizer_stamp(struct packetizer *packetizer, uint64_t realtime_us) {
+  packetizer->stamp_us = realtime_us;
+}
+
+/* a datagram carries the time of its oldest data */
+static void begin_v2(struct packetizer *packetizer) {
+  if (packetizer->v2_len > 0 || packetizer->stamp_us == 0) return;
+  struct client_protocol_dgram *record = (struct client_protocol_dgram *) packetizer->v2->data;
+  struct stamp_info stamp = {htonl(packetizer->seq++), htonl(packetizer->stamp_us >> 32),
+                             htonl(packetizer->stamp_us & UINT32_MAX)};
+  record->type = htons(STAMP);
+  record->length = htons(sizeof(stamp));
+  memcpy(record->data, &stamp, sizeof(stamp)); // even length
+  packetizer->v2_len = CLIENT_PROTO_DGRAM_HEADER_LEN + sizeof(stamp);
+}
+
+static void pack_v2(struct packetizer *packetizer, uint16_t type, const char *data, size_t len) {
+  size_t pos = 0;
+  while (pos < len) {
+    if (packetizer->v2_len + CLIENT_PROTO_DGRAM_HEADER_LEN >= packetizer->v2_max_len)
+      flush_v2(packetizer);
+    begin_v2(packetizer);
+
+    char *end = packetizer->v2->data + packetizer->v2_len;
+    struct client_protocol_dgram *record = (struct client_protocol_dgram *) end;
+    size_t room = packetizer->v2_max_len - packetizer->v2_len - CLIENT_PROTO_DGRAM_HEADER_LEN;
+    uint16_t length = MIN(MIN(len - pos, room), UINT16_MAX);
+    record->type = htons(type);
+    record->length = htons(length);
+    memcpy(record->data, data + pos, length);
+    packetizer->v2_len += CLIENT_PROTO_DGRAM_HEADER_LEN + length;
+    if (packetizer->v2_len & 1) // v2_max_len is even, so there is room
+      packetizer->v2->data[packetizer->v2_len++] = 0;
+    pos += length;
+  }
+}
+
+void packetizer_add(struct packetizer *packetizer, uint16_t type, const char *data,
+                    size_t len, bool v1, bool v2) {
+  if (v2) pack_v2(packetizer, type, data, len);
+  if (!v1) return;
+  flush_v1(packetizer); // gathered frames go first
+
+  size_t max_data = packetizer->v1_max_len - CLIENT_PROTO_DGRAM_HEADER_LEN;
+  size_t pos = 0;
+  while (pos < len) {
+    struct client_protocol_dgram *dgram = (struct client_protocol_dgram *) packetizer->v1->data;
+    uint16_t length = MIN(len - pos, max_data);
+    dgram->type = htons(type);
+    dgram->length = htons(length);
+    memcpy(dgram->data, data + pos, length);
+    send_packet(packetizer, &packetizer->v1, length + CLIENT_PROTO_DGRAM_HEADER_LEN, PROTOCOL_V1);
+    pos += length;
+  }
+}
+
+void packetizer_add_frame(struct packetizer *packetizer, const char *data, size_t len,
+                          bool v1, bool v2) {
+  if (v2) {
+    size_t record = CLIENT_PROTO_DGRAM_HEADER_LEN + len;
+    if (packetizer->v2_len + record > packetizer->v2_max_len) flush_v2(packetizer);
+    // an empty datagram starts with a STAMP, a frame that only fits alone goes without it
+    uint64_t stamp_us = packetizer->stamp_us;
+    if (packetizer->v2_len == 0 && stamp_us != 0 && record <= packetizer->v2_max_len &&
+        record + CLIENT_PROTO_DGRAM_HEADER_LEN + sizeof(struct stamp_info) > packetizer->v2_max_len)
+      packetizer->stamp_us = 0;
+    begin_v2(packetizer);
+    pack_v2(packetizer, AUDIO, data, len); // splits only a frame longer than a datagram
+    packetizer->stamp_us = stamp_us;
+  }
+  if (!v1) return;
+
+  size_t max_data = packetizer->v1_max_len - CLIENT_PROTO_DGRAM_HEADER_LEN;
+  if (packetizer->v1_len + len > max_data) flush_v1(packetizer);
+  if (len > max_data) {
+    packetizer_add(packetizer, AUDIO, data, len, true, false);
+    return;
+  }
+  struct client_protocol_dgram *dgram = (struct client_protocol_dgram *) packetizer->v1->data;
+  memcpy(dgram->data + packetizer->v1_len, data, len);
+  packetizer->v1_len += len;
+}
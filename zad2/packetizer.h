@@ -0,0 +1,55 @@
+#ifndef _RADIO_PACKETIZER_H_
+#define _RADIO_PACKETIZER_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "packet_pool.h"
+
+/* len bytes of packet->data; a sender that needs them after returning
+ * takes a reference (packet_ref)                                     */
+typedef void (*packet_send_t)(void *arg, struct packet *packet, size_t len, uint8_t version);
+
+/* cuts demuxed data into client protocol datagrams: v1 ones (a single
+ * record each) are sent right away, v2 records are packed together and
+ * sent when the datagram is full or on packetizer_flush. With a stamp
+ * set, each v2 datagram starts with a STAMP record. Datagrams are built
+ * right in packets of a pool, a sent one is filled again unless a sender
+ * kept a reference to it.                                              */
+struct packetizer {
+  size_t v1_max_len;       // whole datagram, header included
+  size_t v2_max_len;
+  struct packet_pool *pool;
+  struct packet_pool own_pool; // of two packets, used when no pool is given
+  struct packet *v1;
+  struct packet *v2;
+  size_t v2_len;
+  size_t v1_len;           // whole frames waiting in v1 (data only)
+  uint64_t stamp_us;       // ingest time of the data being added, 0 - no stamps
+  uint32_t seq;            // of the next stamped datagram
+  packet_send_t send;
+  void *arg;
+};
+
+/* pool (NULL - a pool of its own) must have two packets free and room
+ * for datagrams of both lengths                                      */
+int packetizer_init(struct packetizer *packetizer, struct packet_pool *pool, size_t v1_max_len,
+                    size_t v2_max_len, packet_send_t send, void *arg);
+
+void packetizer_destroy(struct packetizer *packetizer);
+
+void packetizer_add(struct packetizer *packetizer, uint16_t type, const char *data,
+                    size_t len, bool v1, bool v2);
+
+/* adds a whole codec frame: it is not split between datagrams unless it
+ * is longer than one, v1 frames are gathered until the datagram is full */
+void packetizer_add_frame(struct packetizer *packetizer, const char *data, size_t len,
+                          bool v1, bool v2);
+
+void packetizer_flush(struct packetizer *packetizer);
+
+/* data added from now on was read from upstream at realtime_us */
+void packetizer_stamp(struct packetizer *packetizer, uint64_t realtime_us);
+
+#endif  // _RADIO_PACKETIZER_H_
@@ -0,0 +1,170 @@
+#define _GNU_SOURCE
+
+#include "proxy_registry.h"
+
+#include "client_protocol.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_CAPACITY        8
+#define INITIAL_INDEX_CAPACITY  16
+
+void registry_init(struct proxy_registry *registry) {
+  memset(registry, 0, sizeof(*registry));
+}
+
+void registry_clear(struct proxy_registry *registry) {
+  for (size_t i = 0; i < registry->count; ++i)
+    free(registry->proxies[i].name);
+  free(registry->proxies);
+  free(registry->index);
+  registry_init(registry);
+}
+
+static size_t hash_address(const struct sockaddr_in *address) {
+  uint64_t key = ((uint64_t) address->sin_addr.s_addr << 16) | address->sin_port;
+  key *= 0x9e3779b97f4a7c15ULL;
+  return (size_t)(key >> 32);
+}
+
+/* returns index slot holding address or the empty slot where it belongs */
+static size_t find_slot(const struct proxy_registry *registry,
+                        const struct sockaddr_in *address) {
+  size_t mask = registry->index_capacity - 1;
+  size_t slot = hash_address(address) & mask;
+  while (registry->index[slot] != 0) {
+    const struct proxy *p = &registry->proxies[registry->index[slot] - 1];
+    if (is_same_address(&p->address, address)) break;
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+static int grow_index(struct proxy_registry *registry) {
+  size_t capacity = registry->index_capacity ? 2 * registry->index_capacity
+                                             : INITIAL_INDEX_CAPACITY;
+  size_t *index = calloc(capacity, sizeof(size_t));
+  if (!index) return -1;
+  free(registry->index);
+  registry->index = index;
+  registry->index_capacity = capacity;
+  for (size_t i = 0; i < registry->count; ++i)
+    registry->index[find_slot(registry, &registry->proxies[i].address)] = i + 1;
+  return 0;
+}
+
+struct proxy *registry_find(struct proxy_registry *registry,
+                            const struct sockaddr_in *address) {
+  if (registry->count == 0) return NULL;
+  size_t pos = registry->index[find_slot(registry, address)];
+  return pos ? &registry->proxies[pos - 1] : NULL;
+}
+
+struct proxy *registry_insert(struct proxy_registry *registry,
+                              const struct sockaddr_in *address) {
+  struct proxy *proxy = registry_find(registry, address);
+  if (proxy) return proxy;
+
+  if (registry->count == registry->capacity) {
+    size_t capacity = registry->capacity ? 2 * registry->capacity : INITIAL_CAPACITY;
+    struct proxy *proxies = realloc(registry->proxies, capacity * sizeof(struct proxy));
+    if (!proxies) return NULL;
+    registry->proxies = proxies;
+    registry->capacity = capacity;
+  }
+  // keep the load factor under 1/2
+  if (2 * (registry->count + 1) > registry->index_capacity && grow_index(registry) < 0)
+    return NULL;
+
+  proxy = &registry->proxies[registry->count];
+  memset(proxy, 0, sizeof(*proxy));
+  proxy->address = *address;
+  proxy->srtt_us = RTT_UNKNOWN;
+  proxy->load = LOAD_UNKNOWN;
+  registry->index[find_slot(registry, address)] = ++registry->count;
+  return proxy;
+}
+
+int registry_set_name(struct proxy *proxy, const char *name, size_t name_len) {
+  if (proxy->name_len == name_len && memcmp(proxy->name, name, name_len) == 0)
+    return 0;
+  char *new_name = realloc(proxy->name, name_len ? name_len : 1);
+  if (!new_name) return -1;
+  memcpy(new_name, name, name_len);
+  proxy->name = new_name;
+  proxy->name_len = name_len;
+  return 1;
+}
+
+void registry_remove(struct proxy_registry *registry,
+                     const struct sockaddr_in *address) {
+  if (registry->count == 0) return;
+  size_t mask = registry->index_capacity - 1;
+  size_t slot = find_slot(registry, address);
+  size_t pos = registry->index[slot];
+  if (pos == 0) return;
+
+  // backward shift deletion, so that no tombstones are needed
+  size_t hole = slot;
+  for (size_t next = (hole + 1) & mask; registry->index[next] != 0; next = (next + 1) & mask) {
+    size_t home = hash_address(&registry->proxies[registry->index[next] - 1].address) & mask;
+    if (((next - home) & mask) >= ((next - hole) & mask)) {
+      registry->index[hole] = registry->index[next];
+      hole = next;
+    }
+  }
+  registry->index[hole] = 0;
+
+  free(registry->proxies[pos - 1].name);
+  if (pos != registry->count) {
+    registry->proxies[pos - 1] = registry->proxies[registry->count - 1];
+    registry->index[find_slot(registry, &registry->proxies[pos - 1].address)] = pos;
+  }
+  registry->count--;
+}
+
+void registry_add_rtt_sample(struct proxy *proxy, int64_t rtt_us) {
+  if (rtt_us < 0) return;
+  if (proxy->srtt_us == RTT_UNKNOWN)
+    proxy->srtt_us = rtt_us;
+  else // the same gain as TCP uses for srtt
+    proxy->srtt_us += (rtt_us - proxy->srtt_us) / 8;
+}
+
+int registry_set_load(struct proxy *proxy, uint32_t clients, uint32_t capacity) {
+  if (proxy->load == clients && proxy->capacity == capacity) return 0;
+  proxy->load = clients;
+  proxy->capacity = capacity;
+  return 1;
+}
+
+static bool is_full(const struct proxy *proxy) {
+  return proxy->load != LOAD_UNKNOWN && proxy->capacity > 0 && proxy->load >= proxy->capacity;
+}
+
+/* proxies without a limit (or not reporting load) count as empty */
+static uint64_t load_bucket(const struct proxy *proxy) {
+  if (proxy->load == LOAD_UNKNOWN || proxy->capacity == 0) return 0;
+  return (uint64_t) proxy->load * LOAD_BUCKETS / proxy->capacity;
+}
+
+static int compare_proxies(const void *a, const void *b, void *arg) {
+  const struct proxy *proxies = arg;
+  const struct proxy *first = &proxies[*(const size_t *)a];
+  const struct proxy *second = &proxies[*(const size_t *)b];
+  if (is_full(first) != is_full(second))
+    return is_full(first) ? 1 : -1;
+  if (load_bucket(first) != load_bucket(second))
+    return load_bucket(first) < load_bucket(second) ? -1 : 1;
+  if (first->srtt_us != second->srtt_us)
+    return first->srtt_us < second->srtt_us ? -1 : 1;
+  if (first->load != second->load)
+    return first->load < second->load ? -1 : 1;
+  return 0;
+}
+
+void registry_rank(const struct proxy_registry *registry, size_t *order) {
+  for (size_t i = 0; i < registry->count; ++i) order[i] = i;
+  qsort_r(order, registry->count, sizeof(size_t), &compare_proxies, registry->proxies);
+}
@@ -0,0 +1,67 @@
+#ifndef _RADIO_PROXY_REGISTRY_H_
+#define _RADIO_PROXY_REGISTRY_H_
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stream_stats.h"
+
+#define RTT_UNKNOWN   INT64_MAX
+#define LOAD_UNKNOWN  UINT32_MAX
+#define LOAD_BUCKETS  10
+
+struct proxy {
+  struct sockaddr_in address;
+  char *name;
+  size_t name_len;
+  int64_t srtt_us;         // smoothed DISCOVER -> IAM round trip time
+  uint32_t load;           // clients reported by the proxy, LOAD_UNKNOWN if it doesn't
+  uint32_t capacity;       // its client limit, 0 if none
+  uint64_t probe_sent_us;  // time of the last unicast DISCOVER, 0 if none pending
+  uint64_t sampled_probe;  // broadcast probe this entry has already been sampled for
+  struct stream_stats stats;
+};
+
+/* Proxies discovered so far. Entries live in a growable array (indices are
+ * not stable - removal moves the last entry into the freed slot) and are
+ * indexed by address with an open addressing hash table.               */
+struct proxy_registry {
+  struct proxy *proxies;
+  size_t count;
+  size_t capacity;
+  size_t *index;           // position + 1, 0 means empty slot
+  size_t index_capacity;   // power of two
+};
+
+void registry_init(struct proxy_registry *registry);
+
+void registry_clear(struct proxy_registry *registry);
+
+struct proxy *registry_find(struct proxy_registry *registry,
+                            const struct sockaddr_in *address);
+
+/* returns the existing entry for address or a newly created one (with an
+ * empty name and unknown rtt and load), NULL when out of memory        */
+struct proxy *registry_insert(struct proxy_registry *registry,
+                              const struct sockaddr_in *address);
+
+int registry_set_name(struct proxy *proxy, const char *name, size_t name_len);
+
+void registry_remove(struct proxy_registry *registry,
+                     const struct sockaddr_in *address);
+
+/* feeds one round trip measurement into the entry's smoothed rtt */
+void registry_add_rtt_sample(struct proxy *proxy, int64_t rtt_us);
+
+/* returns 1 if the load shown for the proxy has changed */
+int registry_set_load(struct proxy *proxy, uint32_t clients, uint32_t capacity);
+
+/* fills order (of size registry->count) with entry positions, best first:
+ * full proxies go last, the rest by utilization (in LOAD_BUCKETS coarse
+ * steps, so that nearby proxies still win between similarly loaded ones),
+ * then by the lowest measured rtt and the fewest clients              */
+void registry_rank(const struct proxy_registry *registry, size_t *order);
+
+#endif  // _RADIO_PROXY_REGISTRY_H_
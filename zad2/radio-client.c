@@ -1,53 +1,154 @@
+#define _GNU_SOURCE
+
+#include "audio_output.h"
 #include "client_protocol.h"
+#include "clock_sync.h"
+#include "latency.h"
+#include "proxy_registry.h"
+#include "screen.h"
+#include "shm_ring.h"
+#include "stream_stats.h"
+#include "thread_layout.h"
+#include "trace.h"
 #include "utils.h"
 #include "telnet.h"
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <netdb.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
-#define MAX_PROXY           20
 #define METADATA_BUFFER_LEN 80
+#define RTT_TEXT_LEN        48
+#define STATUS_TEXT_LEN     128
+#define CONTROL_LEN         128
+
+// the status line is refreshed at most this often
+#define STATUS_INTERVAL_US 1000000
+
+// metadata-triggered redraws happen at most this often
+#define MIN_REDRAW_INTERVAL_US 100000
+
+// how often the receive loop wakes up when nothing arrives
+#define RECV_TIMEOUT_US 100000
+
+// how long auto-select mode collects IAM answers before choosing a proxy
+#define AUTO_SELECT_WINDOW_US 300000
+
+// a playout time further ahead than the latency and this is not waited for
+#define PLAYOUT_MAX_AHEAD_US 1000000
+
+// asked for with -l, the socket holds the audio waiting for its playout time
+#define PLAYOUT_RCVBUF 0x400000
+
+// the keepalive thread checks for shutdown and new leases this often
+#define KEEPALIVE_STEP_US 500000
+
+// records of the local ring are the proxy's reads of the stream
+#define LOCAL_SLOT_LEN 0x1000
+
+// the rest of a datagram too long for a slot (IAM, v1 proxies)
+#define SPILL_LEN (UDP_BUFFER_LEN - RECV_SLOT_LEN)
 
 char *hostaddr = NULL;
 char *proxy_port = NULL;
 char *telnet_port = NULL;
+char *local_name = NULL;
 unsigned timeout = 5;
+unsigned replay_seconds = 0;  // how far behind live to play, 0 - live
+unsigned playout_ms = 0;      // fixed latency of synchronized playout, 0 - as it comes
+bool auto_select = false;
+int output_mode = OUTPUT_STDIO;
+bool show_status = false;
 
 struct addrinfo addr_hints, *addr_result;
 
-struct proxy {
-  struct sockaddr_in address;
-  char *name;
-  size_t name_len;
-};
+// registry, chosen proxy and probe times are guarded by registry_mutex
+struct proxy_registry registry;
+bool proxy_chosen = false;
+struct sockaddr_in chosen_address;
+uint64_t broadcast_probe_us = 0;
+uint64_t broadcast_probe_seq = 0;
+struct stream_stats local_stats;  // of the shared memory ring in local mode
+
+// proxies in the order they are currently shown in the menu
+struct sockaddr_in *menu = NULL;
+size_t menu_len = 0;
 
-unsigned chosen_proxy = 0;
-unsigned active_proxy = 0;
-_Atomic unsigned marked_line = 0;
-time_t last_data;
-struct proxy proxy[MAX_PROXY + 1];
+_Atomic time_t last_data;
+
+// metadata and redraw requests are guarded by telnet_mutex
 size_t metadata_len = 0;
 char metadata[METADATA_BUFFER_LEN];
+bool redraw_requested = false;
+bool redraw_urgent = false;
+
+// socket-wide receive queue overflow counter (SO_RXQ_OVFL)
+uint32_t kernel_drops = 0;
+bool stdout_is_pipe = false;
+
+// telnet sessions, touched only by the main event loop
+struct session {
+  int sock;
+  unsigned marked_line;
+  bool blocked;            // last render hit a full socket buffer
+  struct screen screen;
+  struct frame frame;
+};
+
+struct session *sessions = NULL;
+size_t session_count = 0;
+size_t session_capacity = 0;
+uint64_t last_redraw_us = 0;
+
+// written by other threads to wake the event loop up
+int wake_pipe[2] = {-1, -1};
 
 pthread_mutex_t telnet_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// stamps of the chosen proxy's datagrams, under registry_mutex
+struct delivery_tracker delivery;
+// the chosen proxy's clock and how our playout keeps to it, under registry_mutex
+struct clock_sync clock_sync;
+struct playout_tracker playout;
+// how often the chosen proxy wants KEEPALIVEs, under registry_mutex
+uint32_t lease_ms = KEEPALIVE_INTERVAL_MS;
+// given with its IAM, echoed in KEEPALIVEs; under registry_mutex
+uint64_t cookie;
+bool has_cookie = false;
+// of the batch being handled by the receiver: playout times (0 - none) and
+// when their audio got written (known for the first batch_written), our clock
+struct stamp_info batch_stamps[RECV_BATCH];
+uint64_t batch_playout[RECV_BATCH];
+uint64_t batch_written_us[RECV_BATCH];
+size_t batch_stamp_count = 0;
+size_t batch_written = 0;
 
 bool cont = true;
 
 static void print_usage(char *prog_name) {
-  fprintf(stderr, "Usage: %s -H hostaddr -P proxy_port -p telnet_port [-T timeout]\n", prog_name);
+  fprintf(stderr, "Usage: %s (-H hostaddr -P proxy_port | -L shm_name) -p telnet_port", prog_name);
+  fprintf(stderr, " [-T timeout] [-a] [-b seconds_back] [-l latency_ms]");
+  fprintf(stderr, " [-o stdio/writev/splice] [-s] [-X thread=cpus[:fifo[=prio]]]...\n");
+  fprintf(stderr, "threads: receiver (data plane), keepalive, ui (control plane)\n");
 }
 
 static void parse_parameters(int argc, char *argv[]) {
   int opt;
 
-  while ((opt = getopt(argc, argv, "H:P:p:T:")) != -1) {
+  while ((opt = getopt(argc, argv, "H:P:p:T:ao:sL:b:l:X:")) != -1) {
     switch (opt) {
       case 'H':
         hostaddr = optarg;
@@ -61,6 +162,36 @@ static void parse_parameters(int argc, char *argv[]) {
       case 'T':
         timeout = atoi(optarg);
         break;
+      case 'a':
+        auto_select = true;
+        break;
+      case 's':
+        show_status = true;
+        break;
+      case 'b':
+        replay_seconds = atoi(optarg);
+        break;
+      case 'l':
+        playout_ms = atoi(optarg);
+        break;
+      case 'L':
+        local_name = optarg;
+        break;
+      case 'X':
+        if (thread_layout_add(optarg) < 0) exit(1);
+        break;
+      case 'o':
+        if (strcmp(optarg, "stdio") == 0) {
+          output_mode = OUTPUT_STDIO;
+        } else if (strcmp(optarg, "writev") == 0) {
+          output_mode = OUTPUT_WRITEV;
+        } else if (strcmp(optarg, "splice") == 0) {
+          output_mode = OUTPUT_SPLICE;
+        } else {
+          print_usage(argv[0]);
+          exit(1);
+        }
+        break;
       default: /* '?' */
         print_usage(argv[0]);
         exit(1);
@@ -89,111 +220,387 @@ static bool is_good(int err_num) {
   return false;
 }
 
-static void *send_keepalive(void *arg) {
-  int sock = *(int *)arg;
-  struct client_protocol_dgram dgram;
-  dgram.type = htons(KEEPALIVE);
-  dgram.length = htons(0);
-  while (cont) {
-    if (chosen_proxy > 0) {
-      ssize_t ret = sendto(sock, &dgram, CLIENT_PROTO_DGRAM_HEADER_LEN, 0,
-                           (struct sockaddr *) &proxy[chosen_proxy].address,
-                           (socklen_t) sizeof(proxy[chosen_proxy].address));
-      if (ret != CLIENT_PROTO_DGRAM_HEADER_LEN)
-        perror("sendto");
-    }
-    if (cont) {
-      sleep(3);
-      usleep(500000);
-    }
+static void lock(pthread_mutex_t *mutex) {
+  int err;
+  if ((err = pthread_mutex_lock(mutex)) != 0) {
+    errno = err;
+    perror("pthread_mutex_lock");
+    exit(1);
   }
-  return NULL;
 }
 
-static void update(int sock) {
+static void unlock(pthread_mutex_t *mutex) {
   int err;
-  if ((err = pthread_mutex_lock(&telnet_mutex)) != 0) {
+  if ((err = pthread_mutex_unlock(mutex)) != 0) {
     errno = err;
-    perror("pthread_mutex_lock");
-    return;
+    perror("pthread_mutex_unlock");
+    exit(1);
   }
-  ssize_t ret;
-  ret = write(sock, CLRSCR, CLRSCR_LEN);
-  if (ret != CLRSCR_LEN) goto end;
+}
 
-  ret = write(sock, MOVE_LEFT_UP, MOVE_LEFT_UP_LEN);
-  if (ret != MOVE_LEFT_UP_LEN) goto end;
-  for (unsigned i = 0; i < active_proxy + 3; ++i) {
-    if (i == marked_line) {
-      ret = write(sock, UNDERSCORE, UNDERSCORE_LEN);
-      if (ret != UNDERSCORE_LEN) goto end;
-    }
-    if (i == 0) {
-      ret = write(sock, szukaj, SZUKAJ_LEN);
-      if (ret != SZUKAJ_LEN) goto end;
-    }
-    if (i > 0 && i <= active_proxy) {
-      ret = write(sock, posrednik, POSREDNIK_LEN);
-      if (ret != POSREDNIK_LEN) goto end;
+/* DISCOVER carries the highest protocol version we understand, and a
+ * CLOCK probe (answered along with IAM)                           */
+static int send_discover(int sock, const struct sockaddr *address, socklen_t address_len) {
+  char buffer[CLIENT_PROTO_DGRAM_HEADER_LEN + 2 + CLOCK_RECORD_LEN] __attribute__((aligned(_Alignof(struct client_protocol_dgram))));
+  struct client_protocol_dgram *dgram = (struct client_protocol_dgram *) buffer;
+  dgram->type = htons(DISCOVER);
+  dgram->length = htons(1);
+  dgram->data[0] = PROTOCOL_V2;
+  dgram->data[1] = 0;
+  clock_probe_record(buffer + CLIENT_PROTO_DGRAM_HEADER_LEN + 2, realtime_us());
+  ssize_t ret = sendto(sock, buffer, sizeof(buffer), 0, address, address_len);
+  if (ret != sizeof(buffer)) {
+    perror("sendto");
+    return -1;
+  }
+  return 0;
+}
 
-      ret = write(sock, proxy[i].name, proxy[i].name_len);
-      if (ret < 0 || (size_t) ret != proxy[i].name_len) goto end;
+/* broadcasts DISCOVER, every proxy answering it gets an rtt sample */
+static int discover_all(int sock) {
+  if (local_name) return 0; // no proxies to look for
+  lock(&registry_mutex);
+  broadcast_probe_us = monotonic_us();
+  broadcast_probe_seq++;
+  unlock(&registry_mutex);
+  return send_discover(sock, addr_result->ai_addr, addr_result->ai_addrlen);
+}
 
-      if (i == chosen_proxy) {
-        ret = write(sock, " *", 2);
-        if (ret != 2) goto end;
-      }
+/* asks a proxy with an archive to play the stream from seconds ago */
+static int send_replay(int sock, const struct sockaddr *address, socklen_t address_len,
+                       uint32_t seconds) {
+  char buffer[CLIENT_PROTO_DGRAM_HEADER_LEN + sizeof(uint32_t)] __attribute__((aligned(_Alignof(struct client_protocol_dgram))));
+  struct client_protocol_dgram *dgram = (struct client_protocol_dgram *) buffer;
+  dgram->type = htons(REPLAY);
+  dgram->length = htons(sizeof(uint32_t));
+  seconds = htonl(seconds);
+  memcpy(dgram->data, &seconds, sizeof(seconds));
+  ssize_t ret = sendto(sock, buffer, sizeof(buffer), 0, address, address_len);
+  if (ret != sizeof(buffer)) {
+    perror("sendto");
+    return -1;
+  }
+  return 0;
+}
+
+/* registry_mutex has to be held */
+static int choose_proxy(int sock, struct proxy *proxy) {
+  proxy->probe_sent_us = monotonic_us();
+  if (!proxy_chosen || !is_same_address(&chosen_address, &proxy->address)) {
+    stats_reset(&proxy->stats);
+    tracker_reset(&delivery);
+    clock_sync_reset(&clock_sync);
+    playout_reset(&playout);
+    lease_ms = KEEPALIVE_INTERVAL_MS;
+    has_cookie = false;
+  }
+  chosen_address = proxy->address;
+  proxy_chosen = true;
+  last_data = time(NULL);
+  if (send_discover(sock, (struct sockaddr *) &proxy->address,
+                    (socklen_t) sizeof(proxy->address)) < 0)
+    return -1;
+  // proxies without an archive ignore it and stream live
+  if (replay_seconds > 0)
+    return send_replay(sock, (struct sockaddr *) &proxy->address,
+                       (socklen_t) sizeof(proxy->address), replay_seconds);
+  return 0;
+}
+
+/* to the chosen proxy, if there is one, with delivery (and playout) since
+ * the last one and a CLOCK probe                                      */
+static void keepalive_chosen(int sock) {
+  char buffer[CLIENT_PROTO_DGRAM_HEADER_LEN + sizeof(struct delivery_report) +
+              CLIENT_PROTO_DGRAM_HEADER_LEN + sizeof(struct playout_report) +
+              CLIENT_PROTO_DGRAM_HEADER_LEN + sizeof(cookie) +
+              CLOCK_RECORD_LEN] __attribute__((aligned(_Alignof(struct client_protocol_dgram))));
+  struct client_protocol_dgram *dgram = (struct client_protocol_dgram *) buffer;
+  struct delivery_report report;
+  struct playout_report playout_info;
+  int64_t offset;
+  uint32_t delay = 0;
+  lock(&registry_mutex);
+  bool chosen = proxy_chosen;
+  struct sockaddr_in address = chosen_address;
+  bool reported = chosen && tracker_report(&delivery, &report);
+  if (chosen) clock_sync_offset(&clock_sync, &offset, &delay);
+  bool played = chosen && playout_report(&playout, delay, &playout_info);
+  bool echo = chosen && has_cookie;
+  uint64_t echoed = cookie;
+  unlock(&registry_mutex);
+  if (chosen) {
+    dgram->type = htons(KEEPALIVE);
+    dgram->length = htons(reported ? sizeof(report) : 0);
+    if (reported) memcpy(dgram->data, &report, sizeof(report));
+    size_t len = CLIENT_PROTO_DGRAM_HEADER_LEN + (reported ? sizeof(report) : 0);
+    if (played) {
+      struct client_protocol_dgram *record = (struct client_protocol_dgram *) (buffer + len);
+      record->type = htons(PLAYOUT);
+      record->length = htons(sizeof(playout_info));
+      memcpy(record->data, &playout_info, sizeof(playout_info));
+      len += CLIENT_PROTO_DGRAM_HEADER_LEN + sizeof(playout_info);
     }
-    if (i == active_proxy + 1) {
-      ret = write(sock, koniec, KONIEC_LEN);
-      if (ret != KONIEC_LEN) goto end;
+    if (echo) {
+      struct client_protocol_dgram *record = (struct client_protocol_dgram *) (buffer + len);
+      record->type = htons(COOKIE);
+      record->length = htons(sizeof(echoed));
+      memcpy(record->data, &echoed, sizeof(echoed));
+      len += CLIENT_PROTO_DGRAM_HEADER_LEN + sizeof(echoed);
     }
-    if (i == active_proxy + 2) {
-      ret = write(sock, metadata, metadata_len);
-      if (ret < 0 || (size_t) ret != metadata_len) goto end;
+    clock_probe_record(buffer + len, realtime_us());
+    len += CLOCK_RECORD_LEN;
+    ssize_t ret = sendto(sock, buffer, len, 0,
+                         (struct sockaddr *) &address, (socklen_t) sizeof(address));
+    if (ret != (ssize_t) len)
+      perror("sendto");
+  }
+}
+
+/* renews the lease up to LEASE_JITTER_PCT early, so that clients started
+ * together do not keep coming at once; a new lease counts from the last
+ * KEEPALIVE                                                            */
+static void *send_keepalive(void *arg) {
+  int sock = *(int *)arg;
+  thread_enter("keepalive", THREAD_CONTROL);
+  unsigned seed = getpid() ^ time(NULL);
+  while (cont) {
+    keepalive_chosen(sock);
+    uint64_t sent = monotonic_us();
+    unsigned early = rand_r(&seed) % (LEASE_JITTER_PCT * 10 + 1); // per mille
+    while (cont) {
+      lock(&registry_mutex);
+      uint64_t interval = (uint64_t) lease_ms * (1000 - early); // us
+      unlock(&registry_mutex);
+      uint64_t now = monotonic_us();
+      if (now - sent >= interval) break;
+      usleep(MIN(sent + interval - now, KEEPALIVE_STEP_US));
     }
-    ret = write(sock, ENDL, ENDL_LEN);
-    if (ret != ENDL_LEN) goto end;
-    if (i == marked_line) {
-      ret = write(sock, NO_ATTR, NO_ATTR_LEN);
-      if (ret != NO_ATTR_LEN) goto end;
+  }
+  thread_leave();
+  return NULL;
+}
+
+/* registry_mutex and telnet_mutex have to be held; marked lines follow
+ * their proxy (or Koniec) to its new row                               */
+static int rebuild_menu(void) {
+  size_t order[registry.count + 1];
+  registry_rank(&registry, order);
+  if (registry.count > menu_len || menu == NULL) {
+    struct sockaddr_in *new_menu = realloc(menu, (registry.count + 1) * sizeof(*menu));
+    if (!new_menu) return -1;
+    menu = new_menu;
+  }
+  for (size_t i = 0; i < session_count; ++i) {
+    unsigned *line = &sessions[i].marked_line;
+    if (*line == 0) continue;
+    if (*line > menu_len) {
+      *line = registry.count + 1;
+      continue;
     }
+    const struct sockaddr_in *marked = &menu[*line - 1];
+    unsigned row = 0;
+    for (size_t j = 0; j < registry.count && row == 0; ++j)
+      if (is_same_address(&registry.proxies[order[j]].address, marked)) row = j + 1;
+    // a proxy gone from the registry leaves the cursor where it was, among proxies
+    *line = row > 0 ? row : MIN(*line, registry.count);
   }
-  end:
-  if ((err = pthread_mutex_unlock(&telnet_mutex)) != 0) {
-    errno = err;
-    perror("pthread_mutex_unlock");
-    return;
+  for (size_t i = 0; i < registry.count; ++i)
+    menu[i] = registry.proxies[order[i]].address;
+  menu_len = registry.count;
+  return 0;
+}
+
+static size_t format_rtt(char *buffer, const struct proxy *proxy) {
+  int ret;
+  if (proxy->srtt_us == RTT_UNKNOWN)
+    return 0;
+  if (proxy->load == LOAD_UNKNOWN)
+    ret = snprintf(buffer, RTT_TEXT_LEN, " (%" PRId64 ".%" PRId64 " ms)",
+                   proxy->srtt_us / 1000, proxy->srtt_us / 100 % 10);
+  else if (proxy->capacity == 0)
+    ret = snprintf(buffer, RTT_TEXT_LEN, " (%" PRId64 ".%" PRId64 " ms, %" PRIu32 ")",
+                   proxy->srtt_us / 1000, proxy->srtt_us / 100 % 10, proxy->load);
+  else
+    ret = snprintf(buffer, RTT_TEXT_LEN, " (%" PRId64 ".%" PRId64 " ms, %" PRIu32 "/%" PRIu32 ")",
+                   proxy->srtt_us / 1000, proxy->srtt_us / 100 % 10, proxy->load,
+                   proxy->capacity);
+  return ret < 0 ? 0 : MIN((size_t) ret, RTT_TEXT_LEN - 1);
+}
+
+static uint64_t realtime_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* registry_mutex has to be held */
+static size_t format_status(char *buffer, long output_backlog) {
+  static const char prefix[] = "Status: ";
+  memcpy(buffer, prefix, sizeof(prefix) - 1);
+  const struct proxy *proxy = proxy_chosen ? registry_find(&registry, &chosen_address) : NULL;
+  const struct stream_stats *stats = local_name ? &local_stats : proxy ? &proxy->stats : NULL;
+  if (!stats) {
+    memcpy(buffer + sizeof(prefix) - 1, "-", 1);
+    return sizeof(prefix);
   }
+  return sizeof(prefix) - 1 + stats_format(stats, realtime_ns(), output_backlog,
+                                           buffer + sizeof(prefix) - 1,
+                                           STATUS_TEXT_LEN - sizeof(prefix) + 1);
 }
 
-void pass_metadata(int sock, const struct client_protocol_dgram *dgram) {
-  int err;
-  if ((err = pthread_mutex_lock(&telnet_mutex)) != 0) {
-    errno = err;
-    perror("pthread_mutex_lock");
+/* registry_mutex and telnet_mutex have to be held */
+static int build_frame(struct frame *frame, unsigned marked_line, const char *status,
+                       size_t status_len) {
+  frame_reset(frame);
+  for (unsigned i = 0; i < menu_len + 3; ++i) {
+    if (i == marked_line && frame_append(frame, UNDERSCORE, UNDERSCORE_LEN) < 0)
+      return -1;
+    if (i == 0 && frame_append(frame, szukaj, SZUKAJ_LEN) < 0)
+      return -1;
+    if (i > 0 && i <= menu_len) {
+      const struct proxy *proxy = registry_find(&registry, &menu[i - 1]);
+      char rtt[RTT_TEXT_LEN];
+      size_t rtt_len = format_rtt(rtt, proxy);
+      if (frame_append(frame, posrednik, POSREDNIK_LEN) < 0 ||
+          frame_append(frame, proxy->name, proxy->name_len) < 0 ||
+          frame_append(frame, rtt, rtt_len) < 0)
+        return -1;
+      if (proxy_chosen && is_same_address(&chosen_address, &proxy->address) &&
+          frame_append(frame, " *", 2) < 0)
+        return -1;
+    }
+    if (i == menu_len + 1 && frame_append(frame, koniec, KONIEC_LEN) < 0)
+      return -1;
+    if (i == menu_len + 2 && frame_append(frame, metadata, metadata_len) < 0)
+      return -1;
+    if (i == marked_line && frame_append(frame, NO_ATTR, NO_ATTR_LEN) < 0)
+      return -1;
+    if (frame_end_line(frame) < 0)
+      return -1;
+  }
+  if (status_len > 0 &&
+      (frame_append(frame, status, status_len) < 0 || frame_end_line(frame) < 0))
+    return -1;
+  return 0;
+}
+
+/* asks the event loop for a redraw of all sessions; non-urgent requests
+ * (metadata changes) are coalesced to MIN_REDRAW_INTERVAL_US            */
+static void request_redraw(bool urgent) {
+  lock(&telnet_mutex);
+  bool wake = !redraw_requested || (urgent && !redraw_urgent);
+  redraw_requested = true;
+  redraw_urgent = redraw_urgent || urgent;
+  unlock(&telnet_mutex);
+  if (wake && write(wake_pipe[1], "", 1) < 0 && errno != EAGAIN)
+    perror("write");
+}
+
+static void render_session(struct session *session) {
+  if (session->blocked) return; // redrawn in full once writable
+  if (screen_render(&session->screen, &session->frame, session->sock) < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK)
+      session->blocked = true;
+    else
+      perror("write");
+  }
+}
+
+/* frames are built under the locks, written after releasing them */
+static void redraw(struct session *only) {
+  long output_backlog = -1;
+  int in_pipe;
+  if (show_status && stdout_is_pipe && ioctl(STDOUT_FILENO, FIONREAD, &in_pipe) == 0)
+    output_backlog = in_pipe;
+
+  lock(&telnet_mutex);
+  lock(&registry_mutex);
+  int ret = rebuild_menu();
+  char status[STATUS_TEXT_LEN];
+  size_t status_len = show_status ? format_status(status, output_backlog) : 0;
+  for (size_t i = 0; i < session_count && ret == 0; ++i) {
+    if (only && &sessions[i] != only) continue;
+    ret = build_frame(&sessions[i].frame, sessions[i].marked_line, status, status_len);
+  }
+  unlock(&registry_mutex);
+  if (!only) {
+    redraw_requested = false;
+    redraw_urgent = false;
+    last_redraw_us = monotonic_us();
+  }
+  unlock(&telnet_mutex);
+  if (ret < 0) {
+    perror("malloc");
     return;
   }
 
-  metadata_len = MIN(ntohs(dgram->length), METADATA_BUFFER_LEN);
-  memcpy(metadata, dgram->data, metadata_len);
+  for (size_t i = 0; i < session_count; ++i) {
+    if (only && &sessions[i] != only) continue;
+    render_session(&sessions[i]);
+  }
+}
 
-  if ((err = pthread_mutex_unlock(&telnet_mutex)) != 0) {
-    errno = err;
-    perror("pthread_mutex_unlock");
+/* poll timeout until a pending redraw is due, -1 if nothing is pending */
+static int redraw_timeout(void) {
+  lock(&telnet_mutex);
+  int ret = -1;
+  uint64_t since = monotonic_us() - last_redraw_us;
+  if (redraw_requested) {
+    if (redraw_urgent || since >= MIN_REDRAW_INTERVAL_US)
+      ret = 0;
+    else
+      ret = (MIN_REDRAW_INTERVAL_US - since + 999) / 1000;
+  }
+  if (show_status && session_count > 0) {
+    int status_due = since >= STATUS_INTERVAL_US ? 0 : (STATUS_INTERVAL_US - since + 999) / 1000;
+    ret = ret < 0 ? status_due : MIN(ret, status_due);
   }
-  update(sock);
+  unlock(&telnet_mutex);
+  return ret;
 }
 
-static int telnet_communication_routine(int telnet_sock, int proxy_sock) {
-  marked_line = 0;
-  ssize_t ret = write(telnet_sock, CHANGE_MODE, CHANGE_MODE_LEN);
-  if (ret != CHANGE_MODE_LEN) {
-    perror("write");
-    close(telnet_sock);
-    return 1;
+void pass_metadata(const char *data, size_t len) {
+  lock(&telnet_mutex);
+  metadata_len = MIN(len, METADATA_BUFFER_LEN);
+  memcpy(metadata, data, metadata_len);
+  unlock(&telnet_mutex);
+  request_redraw(false);
+}
+
+static int open_session(int sock) {
+  if (session_count == session_capacity) {
+    size_t capacity = session_capacity ? 2 * session_capacity : 4;
+    struct session *new_sessions = realloc(sessions, capacity * sizeof(struct session));
+    if (!new_sessions) return -1;
+    sessions = new_sessions;
+    session_capacity = capacity;
   }
-  update(telnet_sock);
+
+  ssize_t ret = write(sock, CHANGE_MODE, CHANGE_MODE_LEN);
+  if (ret != CHANGE_MODE_LEN) return -1;
+  int flags = fcntl(sock, F_GETFL);
+  if (flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0) return -1;
+
+  struct session *session = &sessions[session_count++];
+  session->sock = sock;
+  session->marked_line = 0;
+  session->blocked = false;
+  screen_init(&session->screen);
+  frame_init(&session->frame);
+  redraw(session);
+  return 0;
+}
+
+static void close_session(size_t i) {
+  if (close(sessions[i].sock) < 0) perror("close");
+  screen_destroy(&sessions[i].screen);
+  frame_destroy(&sessions[i].frame);
+  sessions[i] = sessions[--session_count];
+}
+
+/* returns -1 when the session has ended and 1 when the whole program
+ * should finish (Koniec chosen)                                        */
+static int handle_session_input(struct session *session, int proxy_sock) {
   /* Na moim komputerze (na studentsie też) telnet na prośbę o zmianę trybu
    * odpowiada w następujący sposób: (trzy pierwsze ready z odpowiedzią)
    * "\xff\xfd\x3\xff\xfb\x22\xff\xfa\x22\x3\x1\x0\x0\x3\x62\x3\x4\x2\xf\x5",
@@ -203,152 +610,554 @@ static int telnet_communication_routine(int telnet_sock, int proxy_sock) {
    * zachowa się w ten sposób), więc ignoruję.
    */
   char buffer[TELNET_BUFFER_SIZE];
+  ssize_t c = read(session->sock, buffer, TELNET_BUFFER_SIZE);
+  if (c == 0) return -1; // end of connection
+  if (c < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return 0;
+    perror("read");
+    return -1;
+  }
+  // the menu is rebuilt under registry_mutex, lines are counted the same way
+  lock(&registry_mutex);
+  size_t lines = menu_len;
+  unlock(&registry_mutex);
+  if (c == msg_len[UP] && strncmp(buffer, message[UP], c) == 0) {
+    if (session->marked_line > 0) {
+      session->marked_line--;
+      redraw(session);
+    }
+  }
+  if (c == msg_len[DOWN] && strncmp(buffer, message[DOWN], c) == 0) {
+    if (session->marked_line < lines + 1) {
+      session->marked_line++;
+      redraw(session);
+    }
+  }
+  if (c == msg_len[CRLF] && strncmp(buffer, message[CRLF], c) == 0) {
+    if (session->marked_line == 0) {
+      discover_all(proxy_sock);
+    } else if (session->marked_line <= lines) {
+      lock(&registry_mutex);
+      struct proxy *proxy = session->marked_line <= menu_len
+                            ? registry_find(&registry, &menu[session->marked_line - 1])
+                            : NULL;
+      if (proxy) choose_proxy(proxy_sock, proxy);
+      unlock(&registry_mutex);
+      redraw(NULL);
+    } else if (session->marked_line == lines + 1) { // koniec
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* serves all telnet sessions, returns when one of them chooses Koniec */
+static int event_loop(int listen_sock, int proxy_sock) {
+  struct pollfd *fds = NULL;
+  size_t fds_capacity = 0;
   int retval = 0;
-  while (1) {
-    ssize_t c = read(telnet_sock, buffer, TELNET_BUFFER_SIZE);
-    if (c == 0) break; // end of connection
-    if (c < 0) {
-      perror("read");
-      continue;
+
+  while (cont) {
+    if (fds_capacity < session_count + 2) {
+      struct pollfd *new_fds = realloc(fds, (session_count + 2) * sizeof(struct pollfd));
+      if (!new_fds) {
+        perror("malloc");
+        retval = 1;
+        break;
+      }
+      fds = new_fds;
+      fds_capacity = session_count + 2;
+    }
+    fds[0].fd = listen_sock;
+    fds[0].events = POLLIN;
+    fds[1].fd = wake_pipe[0];
+    fds[1].events = POLLIN;
+    size_t polled = session_count;
+    for (size_t i = 0; i < polled; ++i) {
+      fds[i + 2].fd = sessions[i].sock;
+      fds[i + 2].events = POLLIN | (sessions[i].blocked ? POLLOUT : 0);
+    }
+
+    if (poll(fds, polled + 2, redraw_timeout()) < 0) {
+      if (errno == EINTR) continue;
+      perror("poll");
+      retval = 1;
+      break;
     }
-    if (c == msg_len[UP] && strncmp(buffer, message[UP], c) == 0) {
-      if (marked_line > 0) {
-        marked_line--;
-        update(telnet_sock);
+
+    if (fds[1].revents & POLLIN) {
+      char drain[64];
+      while (read(wake_pipe[0], drain, sizeof(drain)) > 0) {}
+    }
+
+    // backwards, as closing a session moves the last one into its place
+    for (size_t i = polled; i-- > 0;) {
+      struct session *session = &sessions[i];
+      if (fds[i + 2].revents & POLLOUT) {
+        session->blocked = false;
+        screen_invalidate(&session->screen);
+        redraw(session);
+      }
+      if (fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR)) {
+        int ret = handle_session_input(session, proxy_sock);
+        if (ret < 0) close_session(i);
+        if (ret > 0) goto end;
       }
     }
-    if (c == msg_len[DOWN] && strncmp(buffer, message[DOWN], c) == 0) {
-      if (marked_line < active_proxy + 1) {
-        marked_line++;
-        update(telnet_sock);
+
+    if (fds[0].revents & POLLIN) {
+      int telnet_sock = accept(listen_sock, NULL, NULL);
+      if (telnet_sock < 0) {
+        if (!is_good(errno) && errno != EINTR) {
+          perror("accept");
+          retval = 1;
+          break;
+        }
+      } else if (open_session(telnet_sock) < 0) {
+        perror("telnet session");
+        close(telnet_sock);
       }
     }
-    if (c == msg_len[CRLF] && strncmp(buffer, message[CRLF], c) == 0) {
-      if (marked_line <= active_proxy) {
-        struct client_protocol_dgram dgram;
-        dgram.type = htons(DISCOVER);
-        dgram.length = htons(0);
-        ssize_t ret;
-        if (marked_line == 0) {
-          ret = sendto(proxy_sock, &dgram, CLIENT_PROTO_DGRAM_HEADER_LEN, 0,
-                       addr_result->ai_addr, addr_result->ai_addrlen);
+
+    if (redraw_timeout() == 0) redraw(NULL);
+  }
+  end:
+  free(fds);
+  return retval;
+}
+
+/* remembers the answering proxy and its round trip time, returns whether
+ * anything shown in the menu has changed                               */
+static bool register_iam(const struct sockaddr_in *address,
+                         const struct client_protocol_dgram *dgram) {
+  uint64_t now = monotonic_us();
+  bool changed = false;
+  lock(&registry_mutex);
+  bool known = registry_find(&registry, address) != NULL;
+  struct proxy *proxy = registry_insert(&registry, address);
+  if (!proxy) {
+    perror("malloc");
+    goto end;
+  }
+  int ret = registry_set_name(proxy, dgram->data, ntohs(dgram->length));
+  if (ret < 0) {
+    perror("malloc");
+    if (!known) registry_remove(&registry, address);
+    goto end;
+  }
+  changed = ret > 0 || !known;
+
+  if (proxy->probe_sent_us != 0) {
+    registry_add_rtt_sample(proxy, now - proxy->probe_sent_us);
+    proxy->probe_sent_us = 0;
+    changed = true;
+  } else if (broadcast_probe_seq != proxy->sampled_probe &&
+             now - broadcast_probe_us <= (uint64_t) timeout * 1000000) {
+    registry_add_rtt_sample(proxy, now - broadcast_probe_us);
+    changed = true;
+  }
+  proxy->sampled_probe = broadcast_probe_seq;
+  end:
+  unlock(&registry_mutex);
+  return changed;
+}
+
+/* client count and limit a v2 proxy sends along with IAM */
+static bool register_load(const struct sockaddr_in *address,
+                          const struct client_protocol_dgram *record) {
+  struct load_info info;
+  if (ntohs(record->length) < sizeof(info)) return false;
+  memcpy(&info, record->data, sizeof(info));
+  lock(&registry_mutex);
+  struct proxy *proxy = registry_find(&registry, address);
+  bool changed = proxy && registry_set_load(proxy, ntohl(info.clients), ntohl(info.max_clients));
+  unlock(&registry_mutex);
+  return changed;
+}
+
+/* drops timeouted proxy and, in auto-select mode, picks the best one */
+static bool maintain_chosen_proxy(int sock) {
+  bool changed = false;
+  bool rediscover = false;
+  lock(&registry_mutex);
+  if (proxy_chosen && time(NULL) - last_data > timeout) {
+    registry_remove(&registry, &chosen_address);
+    proxy_chosen = false;
+    changed = true;
+    rediscover = auto_select;
+  }
+  if (auto_select && !proxy_chosen && broadcast_probe_seq > 0) {
+    uint64_t since_probe = monotonic_us() - broadcast_probe_us;
+    if (registry.count > 0 && since_probe >= AUTO_SELECT_WINDOW_US) {
+      size_t order[registry.count];
+      registry_rank(&registry, order);
+      choose_proxy(sock, &registry.proxies[order[0]]);
+      changed = true;
+    } else if (registry.count == 0 && since_probe > (uint64_t) timeout * 1000000) {
+      rediscover = true;
+    }
+  }
+  unlock(&registry_mutex);
+  if (rediscover) discover_all(sock);
+  return changed;
+}
+
+struct audio_output output;
+
+// IAM of the chosen proxy has come, the receiver confirms it with KEEPALIVE
+bool confirm_due = false;
+
+/* the audio of the stamps so far has been written out */
+static void note_written(uint64_t now_us) {
+  for (; batch_written < batch_stamp_count; ++batch_written)
+    batch_written_us[batch_written] = now_us;
+}
+
+/* sleeps until the playout time of the datagram stamp comes with (in our
+ * clock, returned); 0 while the proxy's clock is not known or does not
+ * make sense                                                          */
+static uint64_t wait_for_playout(const struct stamp_info *stamp) {
+  int64_t offset;
+  uint32_t delay;
+  lock(&registry_mutex);
+  bool synced = clock_sync_offset(&clock_sync, &offset, &delay);
+  unlock(&registry_mutex);
+  if (!synced) return 0;
+  uint64_t target = stamp_ingest_us(stamp) + (uint64_t) playout_ms * 1000 - offset;
+  uint64_t now = realtime_us();
+  if (target > now + (uint64_t) playout_ms * 1000 + PLAYOUT_MAX_AHEAD_US) return 0;
+  if (target > now) {
+    struct timespec until = {target / 1000000, target % 1000000 * 1000};
+    while (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &until, NULL) == EINTR && cont);
+  }
+  return target;
+}
+
+static void handle_record(size_t slot, const struct client_protocol_dgram *record,
+                          const struct sockaddr_in *proxy_address, uint64_t arrival_ns,
+                          size_t dgram_len) {
+  uint16_t type = ntohs(record->type);
+  uint16_t length = ntohs(record->length);
+  switch (type) {
+    case AUDIO:
+    case METADATA:
+      lock(&registry_mutex);
+      bool from_chosen = proxy_chosen && is_same_address(proxy_address, &chosen_address);
+      if (from_chosen && show_status && dgram_len > 0) {
+        struct proxy *proxy = registry_find(&registry, &chosen_address);
+        if (proxy) stats_record(&proxy->stats, arrival_ns, dgram_len);
+      }
+      unlock(&registry_mutex);
+      if (from_chosen) {
+        last_data = time(NULL);
+        if (type == AUDIO) {
+          if (audio_output_write(&output, slot, record->data, length) < 0)
+            perror("write");
         } else {
-          ret = sendto(proxy_sock, &dgram, CLIENT_PROTO_DGRAM_HEADER_LEN, 0,
-                       (struct sockaddr *) &proxy[marked_line].address,
-                       (socklen_t) sizeof(proxy[marked_line].address));
-          chosen_proxy = marked_line;
-          update(telnet_sock);
-        }
-        if (ret != CLIENT_PROTO_DGRAM_HEADER_LEN) {
-          perror("sendto");
-          continue;
+          pass_metadata(record->data, length);
         }
-      } else { // koniec
-        break;
       }
-    }
+      break;
+    case IAM:
+      if (register_iam(proxy_address, record))
+        request_redraw(true);
+      // proxies only stream to those who answer their IAM
+      lock(&registry_mutex);
+      if (proxy_chosen && is_same_address(proxy_address, &chosen_address)) confirm_due = true;
+      unlock(&registry_mutex);
+      break;
+    case LOAD:
+      if (register_load(proxy_address, record))
+        request_redraw(true);
+      break;
+    case STAMP:
+      if (length < sizeof(struct stamp_info) || batch_stamp_count == RECV_BATCH) break;
+      lock(&registry_mutex);
+      bool stamp_chosen = proxy_chosen && is_same_address(proxy_address, &chosen_address);
+      unlock(&registry_mutex);
+      // the delay is known once the audio is written
+      if (stamp_chosen) {
+        memcpy(&batch_stamps[batch_stamp_count], record->data, sizeof(struct stamp_info));
+        batch_playout[batch_stamp_count] = playout_ms > 0 ?
+                                           wait_for_playout(&batch_stamps[batch_stamp_count]) : 0;
+        batch_stamp_count++;
+      }
+      break;
+    case LEASE:
+      if (length < sizeof(uint32_t)) break;
+      uint32_t lease;
+      memcpy(&lease, record->data, sizeof(lease));
+      lock(&registry_mutex);
+      if (proxy_chosen && is_same_address(proxy_address, &chosen_address))
+        lease_ms = ntohl(lease) > 0 ? ntohl(lease) : KEEPALIVE_INTERVAL_MS;
+      unlock(&registry_mutex);
+      break;
+    case COOKIE:
+      if (length < sizeof(cookie)) break;
+      lock(&registry_mutex);
+      if (proxy_chosen && is_same_address(proxy_address, &chosen_address)) {
+        memcpy(&cookie, record->data, sizeof(cookie));
+        has_cookie = true;
+      }
+      unlock(&registry_mutex);
+      break;
+    case CLOCK:
+      if (length < sizeof(struct clock_info)) break;
+      struct clock_info answer;
+      memcpy(&answer, record->data, sizeof(answer));
+      // the receiver may have been waiting for a playout time, the kernel knows when it came
+      uint64_t received_us = arrival_ns > 0 ? arrival_ns / 1000 : realtime_us();
+      lock(&registry_mutex);
+      if (proxy_chosen && is_same_address(proxy_address, &chosen_address))
+        clock_sync_add(&clock_sync, &answer, received_us);
+      unlock(&registry_mutex);
+      break;
+    default:; // strange message - ignore
   }
-  close(telnet_sock);
-  return(retval);
 }
 
-static char udp_buffer[UDP_BUFFER_LEN] __attribute__((aligned(_Alignof(struct client_protocol_dgram))));
+/* a datagram is a sequence of records (exactly one from v1 proxies) */
+static void handle_datagram(size_t slot, const char *buffer, size_t len,
+                            const struct sockaddr_in *proxy_address, uint64_t arrival_ns) {
+  struct record_iter iter;
+  record_iter_init(&iter, buffer, len);
+  const struct client_protocol_dgram *record;
+  // the whole datagram is accounted for once, with its first stream record
+  size_t dgram_len = len;
+  while ((record = record_next(&iter)) != NULL) {
+    handle_record(slot, record, proxy_address, arrival_ns, dgram_len);
+    uint16_t type = ntohs(record->type);
+    if (type == AUDIO || type == METADATA) dgram_len = 0;
+  }
+}
+
+/* arrival time and receive queue overflow counter of one datagram */
+static uint64_t parse_control(struct msghdr *hdr, uint64_t batch_ns) {
+  uint64_t arrival_ns = batch_ns;
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET) continue;
+    if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      struct timespec ts;
+      memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+      arrival_ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+    if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+      uint32_t drops;
+      memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+      if (drops != kernel_drops) {
+        lock(&registry_mutex);
+        // sequence numbers of stamps count these too, and only the chosen proxy's
+        struct proxy *proxy = proxy_chosen && !delivery.seq_known
+                            ? registry_find(&registry, &chosen_address) : NULL;
+        if (proxy) stats_add_lost(&proxy->stats, drops - kernel_drops);
+        unlock(&registry_mutex);
+        kernel_drops = drops;
+      }
+    }
+  }
+  return arrival_ns;
+}
 
 void *proxy_routine(void *arg) {
-  int *sockets = (int *)arg;
-  int sock = sockets[0];
-  int telnet_sock = sockets[1];
-  struct sockaddr_in proxy_address;
-  socklen_t proxy_addrlen;
+  int sock = *(int *)arg;
+  struct mmsghdr msgs[RECV_BATCH];
+  struct iovec iovs[RECV_BATCH][2];
+  struct sockaddr_in addresses[RECV_BATCH];
+  char control[RECV_BATCH][CONTROL_LEN] __attribute__((aligned(_Alignof(struct cmsghdr))));
+  thread_enter("receiver", THREAD_DATA);
+
+  // pages of the spill are only touched by datagrams longer than a slot
+  char *spill = malloc(RECV_BATCH * SPILL_LEN);
+  char *joined = malloc(UDP_BUFFER_LEN);
+  if (!spill || !joined) {
+    perror("malloc");
+    free(spill);
+    thread_leave();
+    return NULL;
+  }
+
+  // CLOCK answers need arrival times, the receiver may be waiting for a playout time
+  bool timestamps = show_status || playout_ms > 0;
+  if (timestamps) {
+    int optval = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &optval, sizeof(optval)) < 0 ||
+        setsockopt(sock, SOL_SOCKET, SO_RXQ_OVFL, &optval, sizeof(optval)) < 0)
+      perror("setsockopt");
+  }
+
+  if (auto_select) discover_all(sock);
 
   while (cont) {
-    proxy_addrlen = (socklen_t) sizeof(proxy_address);
-    ssize_t len = recvfrom(sock, udp_buffer, UDP_BUFFER_LEN, MSG_DONTWAIT,
-                           (struct sockaddr *)&proxy_address, &proxy_addrlen);
-    struct client_protocol_dgram *dgram = (struct client_protocol_dgram *) udp_buffer;
-    uint16_t type;
-    if (len >= 0) type = ntohs(dgram->type);
-    else type = NONE;
-
-    if ((size_t) len < CLIENT_PROTO_DGRAM_HEADER_LEN) continue; // strange message - ignore
-
-    uint16_t length = ntohs(dgram->length);
-    if (len - CLIENT_PROTO_DGRAM_HEADER_LEN != length) continue;
-    switch (type) {
-      case AUDIO:
-      case METADATA:
-        if (chosen_proxy > 0 && is_same_address(&proxy_address, &proxy[chosen_proxy].address)) {
-          last_data = time(NULL);
-          if (type == AUDIO)
-            fwrite(udp_buffer + CLIENT_PROTO_DGRAM_HEADER_LEN, 1, length, stdout);
-          else
-            pass_metadata(telnet_sock, dgram);
-        }
-        break;
-      case IAM:;
-        bool found = false;
-        for (unsigned i = 1; i <= active_proxy; ++i) {
-          if (is_same_address(&proxy_address, &proxy[i].address)) {
-            found = true;
-            if (proxy[i].name_len != length || strncmp(proxy[i].name, dgram->data, length) != 0) {
-              char *new_name = realloc(proxy[i].name, length);
-              if (!new_name) {
-                perror("malloc");
-                break;
-              }
-              proxy[i].name = new_name;
-              memcpy(proxy[i].name, dgram->data, length);
-              proxy[i].name_len = length;
-              update(telnet_sock);
-            }
-          }
-        }
-        if (!found && active_proxy < MAX_PROXY) {
-          char *name_buf = malloc(sizeof(length));
-          if (name_buf) {
-            active_proxy++;
-            proxy[active_proxy].address = proxy_address;
-            proxy[active_proxy].name = name_buf;
-            proxy[active_proxy].name_len = length;
-            memcpy(proxy[active_proxy].name, dgram->data, length);
-            update(telnet_sock);
-          }
-        } // no break here (intended)
-      default:
-        if (chosen_proxy > 0) {
-          // check if chosen radio-proxy timeouted
-          time_t current_time = time(NULL);
-          if (current_time - last_data > timeout) {
-            if (chosen_proxy < active_proxy) {
-              free(proxy[chosen_proxy].name);
-              proxy[chosen_proxy] = proxy[active_proxy];
-              proxy[active_proxy].name = NULL;
-            } else {
-              free(proxy[active_proxy].name);
-              proxy[active_proxy].name = NULL;
-            }
-            chosen_proxy = 0;
-            active_proxy--;
-            update(telnet_sock);
-          }
-        }
+    if (maintain_chosen_proxy(sock))
+      request_redraw(true);
+
+    if (audio_output_prepare_batch(&output) < 0) {
+      perror("audio output");
+      break;
+    }
+    memset(msgs, 0, sizeof(msgs));
+    for (size_t i = 0; i < RECV_BATCH; ++i) {
+      iovs[i][0].iov_base = audio_output_slot(&output, i);
+      iovs[i][0].iov_len = RECV_SLOT_LEN;
+      iovs[i][1].iov_base = spill + i * SPILL_LEN;
+      iovs[i][1].iov_len = SPILL_LEN;
+      msgs[i].msg_hdr.msg_name = &addresses[i];
+      msgs[i].msg_hdr.msg_namelen = (socklen_t) sizeof(addresses[i]);
+      msgs[i].msg_hdr.msg_iov = iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 2;
+      if (timestamps) {
+        msgs[i].msg_hdr.msg_control = control[i];
+        msgs[i].msg_hdr.msg_controllen = CONTROL_LEN;
+      }
+    }
+
+    // waits for the first datagram (at most RECV_TIMEOUT_US), takes the rest if queued
+    int received = recvmmsg(sock, msgs, RECV_BATCH, MSG_WAITFORONE, NULL);
+    if (received < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        perror("recvmmsg");
+      continue;
+    }
+
+    TRACE_BEGIN("handle_batch");
+    uint64_t batch_ns = timestamps ? realtime_ns() : 0;
+    for (int i = 0; i < received; ++i) {
+      uint64_t arrival_ns = timestamps ? parse_control(&msgs[i].msg_hdr, batch_ns) : 0;
+      if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) continue; // not from a proxy
+      size_t len = msgs[i].msg_len;
+      if (len <= RECV_SLOT_LEN) {
+        handle_datagram(i, iovs[i][0].iov_base, len, &addresses[i], arrival_ns);
+      } else {
+        // put together outside the ring, its audio is written out at once
+        memcpy(joined, iovs[i][0].iov_base, RECV_SLOT_LEN);
+        memcpy(joined + RECV_SLOT_LEN, iovs[i][1].iov_base, len - RECV_SLOT_LEN);
+        handle_datagram(OUTPUT_NO_SLOT, joined, len, &addresses[i], arrival_ns);
+      }
+      // a datagram played out in sync is written as soon as its time has come
+      if (playout_ms > 0 && batch_written < batch_stamp_count) {
+        if (audio_output_flush(&output) < 0) perror("write");
+        note_written(realtime_us());
+      }
+    }
+    TRACE_END("handle_batch");
+    if (confirm_due) {
+      confirm_due = false;
+      keepalive_chosen(sock);
+    }
+    TRACE_BEGIN("output_write");
+    if (audio_output_finish_batch(&output, received) < 0 ||
+        (playout_ms > 0 && audio_output_flush(&output) < 0))
+      perror("write");
+    TRACE_END("output_write");
+    if (batch_stamp_count > 0) {
+      note_written(realtime_us());
+      lock(&registry_mutex);
+      // in the proxy's clock, as stamps are
+      int64_t offset = 0;
+      uint32_t delay;
+      clock_sync_offset(&clock_sync, &offset, &delay);
+      // the status shows the loss the proxy is told about
+      struct proxy *proxy = proxy_chosen ? registry_find(&registry, &chosen_address) : NULL;
+      for (size_t i = 0; i < batch_stamp_count; ++i) {
+        uint64_t written_us = batch_written_us[i];
+        uint32_t lost = tracker_add(&delivery, &batch_stamps[i], written_us + offset);
+        if (proxy && lost > 0) stats_add_lost(&proxy->stats, lost);
+        if (batch_playout[i] > 0)
+          playout_add(&playout, written_us > batch_playout[i] ? written_us - batch_playout[i] : 0);
+      }
+      unlock(&registry_mutex);
+      batch_stamp_count = batch_written = 0;
+    }
+  }
+  if (output.mode == OUTPUT_STDIO) fflush(stdout);
+  free(spill);
+  free(joined);
+  thread_leave();
+  return NULL;
+}
+
+/* local input mode: follows the shared memory ring of a proxy on this
+ * host, reopening it when it goes quiet (the proxy may have restarted) */
+void *local_routine(void *arg __attribute__((unused))) {
+  struct shm_ring ring = {0};
+  uint64_t lost = 0;
+  bool reported = false;
+  thread_enter("receiver", THREAD_DATA);
+
+  while (cont) {
+    if (!ring.header) {
+      if (shm_ring_open(&ring, local_name) < 0) {
+        if (!reported) perror("shm_ring_open");
+        reported = true;
+        usleep(RECV_TIMEOUT_US);
+        continue;
+      }
+      reported = false;
+      last_data = time(NULL);
+    }
+    if (!shm_ring_wait(&ring, RECV_TIMEOUT_US / 1000)) {
+      if (time(NULL) - last_data > timeout) shm_ring_close(&ring);
+      continue;
+    }
+
+    if (audio_output_prepare_batch(&output) < 0) {
+      perror("audio output");
+      break;
+    }
+    uint64_t batch_ns = show_status ? realtime_ns() : 0;
+    size_t used = 0;
+    while (used < RECV_BATCH) {
+      char *slot = audio_output_slot(&output, used);
+      uint64_t lost_before = lost;
+      uint16_t type;
+      ssize_t len = shm_ring_read(&ring, &type, slot, LOCAL_SLOT_LEN, &lost);
+      if (show_status && (lost != lost_before || len > 0)) {
+        lock(&registry_mutex);
+        if (lost != lost_before) stats_add_lost(&local_stats, lost - lost_before);
+        if (len > 0) stats_record(&local_stats, batch_ns, len);
+        unlock(&registry_mutex);
+      }
+      if (len < 0) continue; // too long for a slot, skipped
+      if (len == 0) break;
+      last_data = time(NULL);
+      if (type == AUDIO) {
+        if (audio_output_write(&output, used, slot, len) < 0)
+          perror("write");
+        used++;
+      } else if (type == METADATA) {
+        pass_metadata(slot, len);
+      }
     }
+    if (audio_output_finish_batch(&output, used) < 0)
+      perror("write");
   }
+  shm_ring_close(&ring);
+  if (output.mode == OUTPUT_STDIO) fflush(stdout);
+  thread_leave();
   return NULL;
 }
 
 int main(int argc, char *argv[]) {
   parse_parameters(argc, argv);
-  if (!hostaddr || !proxy_port || !telnet_port) {
+  if (!telnet_port || (!local_name && (!hostaddr || !proxy_port))) {
     print_usage(argv[0]);
     exit(1);
   }
+  if (playout_ms >= timeout * 1000) {
+    fprintf(stderr, "playout latency has to be shorter than the timeout\n");
+    exit(1);
+  }
+  if (TRACE_INIT() < 0) {
+    perror("sigaction");
+    exit(1);
+  }
+  thread_enter("ui", THREAD_CONTROL); // telnet sessions and the screen
 
   addr_hints.ai_family = AF_INET;
   addr_hints.ai_socktype = SOCK_DGRAM;
 
   int err;
-  if ((err = getaddrinfo(hostaddr, proxy_port, &addr_hints, &addr_result)) != 0) {
+  if (!local_name && (err = getaddrinfo(hostaddr, proxy_port, &addr_hints, &addr_result)) != 0) {
     fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
     exit(1);
   }
@@ -390,41 +1199,58 @@ int main(int argc, char *argv[]) {
 
   if (listen(listen_sock, 5) < 0) goto handle_errors;
 
+  registry_init(&registry);
+
+  struct stat stdout_stat;
+  stdout_is_pipe = fstat(STDOUT_FILENO, &stdout_stat) == 0 && S_ISFIFO(stdout_stat.st_mode);
+
+  if (audio_output_init(&output, output_mode, STDOUT_FILENO,
+                        local_name ? LOCAL_SLOT_LEN : RECV_SLOT_LEN) < 0) {
+    perror("audio output");
+    goto handle_errors;
+  }
+
+  int rcvbuf = PLAYOUT_RCVBUF;
+  if (playout_ms > 0 && setsockopt(proxy_sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0)
+    perror("setsockopt");
+
+  struct timeval recv_timeout = {0, RECV_TIMEOUT_US};
+  if (setsockopt(proxy_sock, SOL_SOCKET, SO_RCVTIMEO, &recv_timeout, sizeof(recv_timeout)) < 0) {
+    perror("setsockopt");
+    goto handle_errors;
+  }
+
+  if (pipe(wake_pipe) < 0) goto handle_errors;
+  for (int i = 0; i < 2; ++i) {
+    int flags = fcntl(wake_pipe[i], F_GETFL);
+    if (flags < 0 || fcntl(wake_pipe[i], F_SETFL, flags | O_NONBLOCK) < 0)
+      goto handle_errors;
+  }
+
   pthread_t keepalive_thread, proxy_thread;
   err = pthread_create(&keepalive_thread, NULL, &send_keepalive, &proxy_sock);
   if (err != 0) goto handle_errors;
 
-  while (1) {
-    struct sockaddr telnet_addr;
-    socklen_t telnet_addrlen;
-    int telnet_sock = accept(listen_sock, &telnet_addr, &telnet_addrlen);
-    if (telnet_sock < 0) {
-      if (is_good(errno)) {
-        errno = 0;
-        continue;
-      } else {
-        goto handle_errors;
-      }
-    }
-    int sockets[2] = {proxy_sock, telnet_sock};
-    err = pthread_create(&proxy_thread, NULL, &proxy_routine, sockets);
-    if (err != 0) {
-      cont = false;
-      perror("pthread_create");
-      if ((err = pthread_join(keepalive_thread, NULL)) != 0) {
-        errno = err;
-        perror("pthread_join");
-      }
-      if (close(telnet_sock < 0)) perror("close");
-      goto handle_errors;
-    }
-    if (telnet_communication_routine(telnet_sock, proxy_sock) == 0) {
-      cont = false;
-      break;
+  stats_reset(&local_stats);
+  tracker_reset(&delivery);
+  clock_sync_reset(&clock_sync);
+  playout_reset(&playout);
+  err = pthread_create(&proxy_thread, NULL, local_name ? &local_routine : &proxy_routine,
+                       &proxy_sock);
+  if (err != 0) {
+    cont = false;
+    errno = err;
+    perror("pthread_create");
+    if ((err = pthread_join(keepalive_thread, NULL)) != 0) {
+      errno = err;
+      perror("pthread_join");
     }
+    goto handle_errors;
   }
 
-  int r = 0;
+  int r = event_loop(listen_sock, proxy_sock);
+  cont = false;
+
 
   if ((err = pthread_join(proxy_thread, NULL)) != 0) {
     errno = err;
@@ -444,9 +1270,21 @@ int main(int argc, char *argv[]) {
     r = 1;
     perror("close");
   }
+  while (session_count > 0) close_session(session_count - 1);
+  free(sessions);
+  close(wake_pipe[0]);
+  close(wake_pipe[1]);
+  registry_clear(&registry);
+  free(menu);
+  audio_output_destroy(&output);
+  thread_leave();
   exit(r);
 
   handle_errors:
+  if (wake_pipe[0] >= 0) {
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+  }
   close(proxy_sock);
   close(listen_sock);
   if ((err = pthread_mutex_destroy(&telnet_mutex)) != 0) {
@@ -17,37 +17,73 @@
 #include <stdbool.h>
 #include <unistd.h>
 
+#include "archive.h"
 #include "client_protocol.h"
+#include "discover_guard.h"
+#include "frame_aligner.h"
+#include "hot_restart.h"
 #include "http_connection.h"
+#include "latency.h"
+#include "relay.h"
+#include "replay.h"
+#include "shm_ring.h"
+#include "thread_layout.h"
+#include "trace.h"
+#include "uring.h"
 #include "utils.h"
 
 #define BUFFER_LEN      0x1000
+#define CONTROL_WAIT_MS 100     // how often an idle control thread checks for expired clients
+#define LEASE_RENEWALS_PER_S 1000  // KEEPALIVEs a second leases are scaled to
 
 char *hostname = NULL;
 char *resource = NULL;
 char *multi = NULL;
 char *port = NULL;
 char *listen_port = NULL;
+char *local_name = NULL;
+char *restart_path = NULL;
+char *upstream_proxy = NULL;
+char *archive_path = NULL;
+char *source_path = NULL;
+char *xdp_interface = NULL;  // ifname[:queue]
 bool metadata = false;
+bool use_uring = false;
+bool frame_aligned = false;
+bool verified_only = false; // v1 clients can't prove their address, they are not served
 unsigned timeout = 5;
 unsigned client_timeout = 5;
+unsigned max_lease = 60;   // seconds, the longest KEEPALIVE interval granted
+unsigned max_clients = 0;  // 0 - no limit
+unsigned archive_mb = ARCHIVE_DEFAULT_MB;
+long file_metaint = -1;   // of a file without a header
+long file_kbps = -1;      // -1 - icy-br of a captured stream, if any
 
 volatile sig_atomic_t cont = 1;
 pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// connection of a process taking over, set before stop_ingest
+int handoff_conn = -1;
+
 static void sigint_handler(int signum __attribute__((unused))) {
   cont = 0;
 }
 
 static void print_usage(char *prog_name) {
-  fprintf(stderr, "Usage: %s -h host -r resource -p port [-m yes/no] [-t timeout]", prog_name);
-  fprintf(stderr, " [-P listen_port [-B multi] [-T listen_timeout]]\n");
+  fprintf(stderr, "Usage: %s (-h host -r resource -p port [-m yes/no] | -U proxy_host:port |", prog_name);
+  fprintf(stderr, " -f file [-i icy_metaint] [-k kbps])");
+  fprintf(stderr, " [-t timeout] [-u] [-F]");
+  fprintf(stderr, " [-P listen_port [-B multi] [-T listen_timeout] [-K max_lease] [-C max_clients] [-V]");
+  fprintf(stderr, " [-R restart_socket] [-x ifname[:queue]]]");
+  fprintf(stderr, " [-L shm_name] [-A archive_file [-S archive_MiB]]");
+  fprintf(stderr, " [-X thread=cpus[:fifo[=prio]]]...\n");
+  fprintf(stderr, "threads: ingest, replay (data plane), clients, handoff (control plane)\n");
 }
 
 static void parse_parameters(int argc, char *argv[]) {
   int opt;
 
-  while ((opt = getopt(argc, argv, "h:r:p:m:t:P:B:T:")) != -1) {
+  while ((opt = getopt(argc, argv, "h:r:p:m:t:uFVP:B:T:K:C:L:R:U:A:S:f:i:k:X:x:")) != -1) {
     switch (opt) {
       case 'h':
         hostname = optarg;
@@ -73,6 +109,15 @@ static void parse_parameters(int argc, char *argv[]) {
       case 't':
         timeout = atoi(optarg);
         break;
+      case 'u':
+        use_uring = true;
+        break;
+      case 'F':
+        frame_aligned = true;
+        break;
+      case 'V':
+        verified_only = true;
+        break;
       case 'P':
         listen_port = optarg;
         break;
@@ -82,6 +127,42 @@ static void parse_parameters(int argc, char *argv[]) {
       case 'T':
         client_timeout = atoi(optarg);
         break;
+      case 'K':
+        max_lease = atoi(optarg);
+        break;
+      case 'C':
+        max_clients = atoi(optarg);
+        break;
+      case 'L':
+        local_name = optarg;
+        break;
+      case 'R':
+        restart_path = optarg;
+        break;
+      case 'U':
+        upstream_proxy = optarg;
+        break;
+      case 'A':
+        archive_path = optarg;
+        break;
+      case 'S':
+        archive_mb = atoi(optarg);
+        break;
+      case 'f':
+        source_path = optarg;
+        break;
+      case 'i':
+        file_metaint = atol(optarg);
+        break;
+      case 'k':
+        file_kbps = atol(optarg);
+        break;
+      case 'X':
+        if (thread_layout_add(optarg) < 0) exit(1);
+        break;
+      case 'x':
+        xdp_interface = optarg;
+        break;
       default: /* '?' */
         print_usage(argv[0]);
         exit(1);
@@ -89,8 +170,29 @@ static void parse_parameters(int argc, char *argv[]) {
   }
 }
 
+/* the KEEPALIVE interval for v2 clients: the default one until there are
+ * so many of them that renewals would exceed LEASE_RENEWALS_PER_S       */
+static uint32_t current_lease_ms(void) {
+  uint64_t lease = (uint64_t) client_count * 1000 / LEASE_RENEWALS_PER_S;
+  return MAX(MIN(lease, (uint64_t) max_lease * 1000), KEEPALIVE_INTERVAL_MS);
+}
+
+/* a client renewing at its lease is given client_timeout for losses on
+ * top of it, as with the default interval                             */
+static bool client_expired(const struct client *c, time_t now) {
+  time_t slack = c->lease_ms > KEEPALIVE_INTERVAL_MS ?
+                 (c->lease_ms - KEEPALIVE_INTERVAL_MS + 999) / 1000 : 0;
+  return c->last_keepalive != -1 && now - c->last_keepalive > client_timeout + slack;
+}
+
+static void lease_set(struct client_protocol_dgram *record, uint32_t lease_ms) {
+  lease_ms = htonl(lease_ms);
+  memcpy(record->data, &lease_ms, sizeof(lease_ms));
+}
+
 void *client_communication_routine(void *arg) {
   struct client_routine_data *data = arg;
+  thread_enter("clients", THREAD_CONTROL);
 
   int client_sock = data->sock;
   struct client_protocol_dgram *iam_packet = data->iam_packet;
@@ -99,19 +201,90 @@ void *client_communication_routine(void *arg) {
   struct sockaddr_in client_address;
   socklen_t client_address_len;
 
-  struct client_protocol_dgram *packet = malloc(UDP_BUFFER_LEN);
-  if (!packet) goto handle_errors;
+  struct uring_receiver receiver;
+  bool receiver_ok = false;
 
-  while (cont) {
+  struct discover_guard *guard = malloc(sizeof(struct discover_guard));
+  if (guard) guard_init(guard);
+  uint64_t reported_drops = 0;
+  time_t last_report = time(NULL), last_latency_report = last_report, last_sweep = 0;
+  struct fleet_latency fleet = {0};
+  struct client_protocol_dgram *packet = malloc(UDP_BUFFER_LEN);
+  // IAM for v2 clients: the static part, padding and extra records, then a tail
+  size_t extra_offset = iam_packet_len + (iam_packet_len & 1);
+  size_t reply_len = extra_offset + data->iam_extra_len;
+  char *reply = malloc(reply_len);
+  // of each reply: LOAD, LEASE and the sender's COOKIE
+  size_t lease_offset = CLIENT_PROTO_DGRAM_HEADER_LEN + sizeof(struct load_info);
+  size_t cookie_offset = lease_offset + CLIENT_PROTO_DGRAM_HEADER_LEN + sizeof(uint32_t);
+  char tail[GUARD_TAIL_LEN] __attribute__((aligned(_Alignof(struct client_protocol_dgram))));
+  // KEEPALIVEs are answered with a LEASE (before the CLOCK answer)
+  char lease_answer[CLIENT_PROTO_DGRAM_HEADER_LEN + sizeof(uint32_t)] __attribute__((aligned(_Alignof(struct client_protocol_dgram))));
+  if (!guard || !packet || !reply) goto handle_errors;
+  memcpy(reply, iam_packet, iam_packet_len);
+  reply[iam_packet_len] = 0;
+  memcpy(reply + extra_offset, data->iam_extra, data->iam_extra_len);
+  struct client_protocol_dgram *load_record = (struct client_protocol_dgram *) tail;
+  load_record->type = htons(LOAD);
+  load_record->length = htons(sizeof(struct load_info));
+  struct client_protocol_dgram *lease_record = (struct client_protocol_dgram *) (tail + lease_offset);
+  lease_record->type = htons(LEASE);
+  lease_record->length = htons(sizeof(uint32_t));
+  struct client_protocol_dgram *cookie_record = (struct client_protocol_dgram *) (tail + cookie_offset);
+  cookie_record->type = htons(COOKIE);
+  cookie_record->length = htons(sizeof(uint64_t));
+  size_t tail_len = cookie_offset + CLIENT_PROTO_DGRAM_HEADER_LEN + sizeof(uint64_t);
+  struct client_protocol_dgram *lease_renewal = (struct client_protocol_dgram *) lease_answer;
+  lease_renewal->type = htons(LEASE);
+  lease_renewal->length = htons(sizeof(uint32_t));
+
+  // with io_uring the thread sleeps until a packet comes instead of polling
+  receiver_ok = use_uring && uring_receiver_init(&receiver, client_sock) == 0;
+
+  while (cont && !stop_ingest) {
     client_address_len = (socklen_t) sizeof(client_address);
-    ssize_t len = recvfrom(client_sock, packet, UDP_BUFFER_LEN, MSG_DONTWAIT,
-                           (struct sockaddr *)&client_address, &client_address_len);
+    ssize_t len;
+    // queued IAM replies go out as soon as nothing more is waiting
+    if (receiver_ok)
+      len = uring_recvfrom(&receiver, packet, UDP_BUFFER_LEN, &client_address,
+                           guard->batch_len > 0 ? 0 : CONTROL_WAIT_MS);
+    else
+      len = recvfrom(client_sock, packet, UDP_BUFFER_LEN, MSG_DONTWAIT,
+                     (struct sockaddr *)&client_address, &client_address_len);
     uint16_t type;
+    uint8_t version = PROTOCOL_V1;
+    struct delivery_report report;
+    bool has_report = false;
+    struct clock_info probe;
+    bool has_probe = false;
+    struct playout_report playout;
+    bool has_playout = false;
+    uint64_t cookie;
+    bool has_cookie = false;
+    uint64_t received_us = 0;
     if (len < 0) {
       if (errno != EAGAIN || errno != EWOULDBLOCK) goto handle_errors;
       type = NONE;
     } else {
+      received_us = realtime_us();
       type = ntohs(packet->type);
+      TRACE_INSTANT("control_packet");
+      if (type == DISCOVER && len > (ssize_t) CLIENT_PROTO_DGRAM_HEADER_LEN &&
+          ntohs(packet->length) >= 1)
+        version = MIN((uint8_t) packet->data[0], PROTOCOL_V2);
+      if (type == KEEPALIVE && len >= (ssize_t) (CLIENT_PROTO_DGRAM_HEADER_LEN + sizeof(report)) &&
+          ntohs(packet->length) >= sizeof(report)) {
+        memcpy(&report, packet->data, sizeof(report));
+        has_report = true;
+      }
+      // v2 clients add a CLOCK probe (and PLAYOUT to KEEPALIVE) after the first record
+      if (type == DISCOVER || type == KEEPALIVE) {
+        has_probe = record_find(packet, len, CLOCK, &probe, sizeof(probe));
+        has_playout = type == KEEPALIVE && record_find(packet, len, PLAYOUT, &playout,
+                                                       sizeof(playout));
+        has_cookie = type == KEEPALIVE && record_find(packet, len, COOKIE, &cookie,
+                                                      sizeof(cookie));
+      }
     }
 
     switch (type) {
@@ -119,113 +292,384 @@ void *client_communication_routine(void *arg) {
       case DISCOVER:
       case KEEPALIVE:;
         time_t current_time = time(NULL);
-        bool found = false;
+        // expiry is in seconds, so the whole list is only looked through once a second
+        bool sweep = current_time != last_sweep, expired = false;
+        if (sweep) last_sweep = current_time;
+        uint32_t lease_ms = current_lease_ms();
+        bool found = false, failed = false;
+        // clients are read by the data plane and the handoff, so they change under mutex
+        bool locked = type != NONE || sweep;
+        if (locked) {
+          if (type != NONE) TRACE_BEGIN("control_lock_wait");
+          if (pthread_mutex_lock(&mutex) != 0) goto handle_errors;
+          if (type != NONE) TRACE_END("control_lock_wait");
+        }
         FOR_LIST(c, client_list) {
           if (type != NONE && is_same_address(&c->client_address, &client_address)) {
             c->valid = true;
             c->last_keepalive = current_time;
             found = true;
-          } else {
-            if (c->last_keepalive != -1 &&
-                current_time - c->last_keepalive > client_timeout) {
-              c->valid = false;
+            if (has_report && latency_record(&fleet, c, &report) < 0) failed = true;
+            if (has_playout) latency_record_playout(&fleet, &playout);
+            if (type == DISCOVER && c->version != version) {
+              if (version >= PROTOCOL_V2) v2_clients++;
+              else v2_clients--;
+              c->version = version;
             }
+            // only clients probing the clock read the LEASE of the answer
+            if (has_probe) c->lease_ms = lease_ms;
+            if (!sweep) break;
+          } else if (sweep && client_expired(c, current_time)) {
+            c->valid = false;
+            expired = true;
           }
         }
-
-        if (!found && type == DISCOVER) {
-          ssize_t len = sendto(client_sock, iam_packet, iam_packet_len, 0,
-                               (struct sockaddr *)&client_address, client_address_len);
-
-          if (len != iam_packet_len) goto handle_errors;
+        if (locked && pthread_mutex_unlock(&mutex) != 0) exit(1);
+        if (failed) goto handle_errors;
+        if (sweep) xdp_delivery_refresh(current_time);
+
+        // a full proxy only tells v2 clients about itself (and that it is full)
+        bool full = max_clients > 0 && client_count >= max_clients;
+        bool confirmed = false;
+        if (!found && type == DISCOVER && (version >= PROTOCOL_V2 || (!full && !verified_only)) &&
+            guard_admit(guard, &client_address, monotonic_us())) {
+          uint64_t sender_cookie = guard_pend(guard, &client_address, version, current_time);
+          if (version >= PROTOCOL_V2) {
+            struct load_info info = {htonl(client_count), htonl(max_clients)};
+            memcpy(load_record->data, &info, sizeof(info));
+            lease_set(lease_record, lease_ms);
+            memcpy(cookie_record->data, &sender_cookie, sizeof(sender_cookie));
+            guard_queue_reply(guard, client_sock, &client_address, reply, reply_len, tail,
+                              tail_len, has_probe ? &probe : NULL, received_us);
+          } else {
+            guard_queue_reply(guard, client_sock, &client_address, iam_packet, iam_packet_len,
+                              NULL, 0, NULL, 0);
+          }
+        } else if (!found && type == KEEPALIVE) {
+          // a v2 sender echoing its cookie got our IAM, so it is not a spoofed address
+          confirmed = guard_confirm(guard, &client_address, has_cookie ? &cookie : NULL,
+                                    &version) && !full;
+        } else if (type == NONE) {
+          guard_flush(guard, client_sock);
+          guard_expire(guard, current_time, client_timeout);
+          if (guard_drops(guard) != reported_drops &&
+              current_time - last_report >= GUARD_REPORT_S) {
+            guard_report(guard);
+            reported_drops = guard_drops(guard);
+            last_report = current_time;
+          }
+          if (current_time - last_latency_report >= LATENCY_REPORT_S) {
+            latency_print(&fleet, client_list);
+            last_latency_report = current_time;
+          }
+        }
+        // clients (and those confirming) get their probes answered on their own
+        if (has_probe && (found || confirmed)) {
+          lease_set(lease_renewal, lease_ms);
+          guard_queue_reply(guard, client_sock, &client_address, NULL, 0, lease_answer,
+                            sizeof(lease_answer), &probe, received_us);
         }
 
+        // the list itself only changes with new and expired clients
+        if (!confirmed && !expired) break;
+        // resolved here, the fan-out only reads it
+        struct xdp_peer *peer = confirmed ? xdp_delivery_peer(&client_address, current_time) : NULL;
+        if (type != NONE) TRACE_BEGIN("control_lock_wait");
         int err = pthread_mutex_lock(&mutex);
         if (err != 0) goto handle_errors;
+        if (type != NONE) TRACE_END("control_lock_wait");
 
         erase_nonvalid_elements(&client_list);
 
-        if (!found && type == DISCOVER) {
+        if (confirmed) {
           struct client *new_client = malloc(sizeof(struct client));
           if (!new_client) {
             if (pthread_mutex_unlock(&mutex) != 0) exit(1);
+            free(peer);
             goto handle_errors;
           }
-          new_client->last_keepalive = -1;
+          new_client->last_keepalive = current_time;
           new_client->client_address = client_address;
           new_client->valid = true;
+          new_client->version = version;
+          new_client->lease_ms = version >= PROTOCOL_V2 && has_probe ? lease_ms : 0;
+          new_client->replaying = false;
+          new_client->latency = NULL;
+          new_client->xdp_peer = peer;
 
           add_client(&client_list, new_client);
         }
 
         if (pthread_mutex_unlock(&mutex) != 0) exit(1);
+        break;
+      case REPLAY:;
+        if (!archive_path || len < (ssize_t) (CLIENT_PROTO_DGRAM_HEADER_LEN + sizeof(uint32_t)) ||
+            ntohs(packet->length) < sizeof(uint32_t))
+          break;
+        uint32_t seconds;
+        memcpy(&seconds, packet->data, sizeof(seconds));
+        seconds = ntohl(seconds);
+        // only listed clients, the replay thread ends sessions of those gone
+        struct client *client = NULL;
+        if (pthread_mutex_lock(&mutex) != 0) goto handle_errors;
+        FOR_LIST(c, client_list) {
+          if (is_same_address(&c->client_address, &client_address)) {
+            c->replaying = seconds > 0;
+            client = c;
+            break;
+          }
+        }
+        uint8_t client_version = client ? client->version : PROTOCOL_V1;
+        if (pthread_mutex_unlock(&mutex) != 0) exit(1);
+        if (client) replay_request(&client_address, client_version, seconds);
+        break;
       default:; // dziwna wiadomość - skip
     }
   }
   handle_errors:;
+  if (receiver_ok) uring_receiver_destroy(&receiver);
+  latency_print(&fleet, client_list);
+  if (guard) {
+    guard_flush(guard, client_sock);
+    if (guard_drops(guard) > 0) guard_report(guard);
+  }
+  free(guard);
+  free(packet);
+  free(reply);
+  thread_leave();
   return NULL;
 }
 
+/* waits for a new process asking to take over, then makes the ingest loop
+ * and client_communication_routine return                              */
+void *handoff_routine(void *arg) {
+  int listen_sock = *(int *)arg;
+  thread_enter("handoff", THREAD_CONTROL);
+  for (;;) {
+    int conn = accept(listen_sock, NULL, NULL);
+    if (conn >= 0) {
+      handoff_conn = conn;
+      stop_ingest = true;
+      return NULL;
+    }
+    if (errno != EINTR && errno != ECONNABORTED) {
+      perror("accept");
+      return NULL;
+    }
+  }
+}
+
+/* a stream captured with its header, not just audio */
+static bool captured_stream(struct file_source *file) {
+  const char *data;
+  ssize_t len = file_source_peek(file, &data, 5);
+  return (len >= 4 && strncmp(data, "ICY ", 4) == 0) ||
+         (len >= 5 && strncmp(data, "HTTP/", 5) == 0);
+}
+
+static void content_type_from_name(const char *path, char *content_type, size_t len) {
+  const char *ext = strrchr(path, '.');
+  const char *type = "";
+  if (ext && strcasecmp(ext, ".mp3") == 0)
+    type = "audio/mpeg";
+  else if (ext && strcasecmp(ext, ".aac") == 0)
+    type = "audio/aac";
+  snprintf(content_type, len, "%s", type);
+}
+
+static int start_handoff_listener(int *listen_sock) {
+  *listen_sock = handoff_listen(restart_path);
+  if (*listen_sock < 0) {
+    perror("handoff_listen");
+    return -1;
+  }
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, &handoff_routine, listen_sock) != 0) return -1;
+  return pthread_detach(thread) != 0 ? -1 : 0;
+}
+
 int main(int argc, char *argv[]) {
   parse_parameters(argc, argv);
 
-  if (!hostname || !resource || !port) {
+  if ((!upstream_proxy && !source_path && (!hostname || !resource || !port)) ||
+      (restart_path && !listen_port)) {
     print_usage(argv[0]);
     return 1;
   }
-
-  struct addrinfo addr_hints, *addr_result;
-  memset(&addr_hints, 0, sizeof(struct addrinfo));
-  addr_hints.ai_family = AF_INET;
-  addr_hints.ai_socktype = SOCK_STREAM;
-  addr_hints.ai_protocol = IPPROTO_TCP;
+  if (source_path && restart_path) {
+    // a file position cannot be handed over like a connection
+    fprintf(stderr, "-R cannot be used with -f\n");
+    return 1;
+  }
 
   if (signal(SIGINT, &sigint_handler) == SIG_ERR) exit(1);
+  if (TRACE_INIT() < 0) exit(1);
+  // reads, demuxes and fans out; other threads do not inherit its placement
+  thread_enter("ingest", THREAD_DATA);
 
-  int err = getaddrinfo(hostname, port, &addr_hints, &addr_result);
-  if (err != 0) exit(1);
-
-  int sock = socket(addr_result->ai_family, addr_result->ai_socktype, addr_result->ai_protocol);
-  if (sock < 0) exit(1);
-
-  // setting timeout for TCP connection
-  struct timeval tcp_timeout;
-  tcp_timeout.tv_sec = timeout;
-  tcp_timeout.tv_usec = 0;
-
-  if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tcp_timeout, sizeof(tcp_timeout)) < 0) exit(1);
-  if (connect(sock, addr_result->ai_addr, addr_result->ai_addrlen) < 0) exit(1);
-
-  freeaddrinfo(addr_result);
-
-  send_http_request(sock, resource, metadata);
-
-  long icy_metaint = -1;
+  int sock = -1;
+  struct icy_demux demux;
   char *icy_name = NULL;
   size_t icy_name_len = 0;
   char buffer[BUFFER_LEN];
-  size_t received_data;
+  size_t received_data = 0;
 
   int client_sock = -1;
   struct sockaddr_in server_address;
   uint16_t lport;
   pthread_t client_communication;
+  struct client_routine_data cr_data;
+  struct shm_ring local_ring = {0};
+  struct archive archive = {0};
+  int handoff_sock = -1;
+  uint64_t node_id = relay_node_id(listen_port);
+  struct relay_upstream relay;
+  struct stream_source socket_source;
+  struct file_source file;
+  struct stream_source *source = &socket_source;
+  char *iam_extra = NULL;
+  size_t iam_extra_len = 0;
+
+  struct handoff_state handoff;
+  int ret = restart_path ? handoff_receive(restart_path, &handoff) : 1;
+  if (ret < 0) { // the running process keeps serving
+    perror("handoff");
+    exit(1);
+  }
+  bool taken_over = ret == 0;
+  if (taken_over) {
+    // the previous process has left everything mid-stream, upstream is not contacted
+    sock = handoff.upstream_sock;
+    client_sock = handoff.client_sock;
+    demux = handoff.demux;
+    icy_name = handoff.icy_name;
+    icy_name_len = handoff.icy_name_len;
+    iam_extra = handoff.iam_extra;
+    iam_extra_len = handoff.iam_extra_len;
+    // like the demux position, framing continues where the old process stopped
+    frame_delivery_init(handoff.frame_codec, handoff.frame_carry, handoff.frame_carry_len);
+    free(handoff.frame_carry);
+    // a relay keeps the lease, cookie and clock offset it had with its upstream
+    if (upstream_proxy) relay_registration_set(&handoff.relay);
+  } else if (upstream_proxy) {
+    if (relay_connect(&relay, upstream_proxy, node_id, timeout) < 0) {
+      if (errno == ELOOP)
+        fprintf(stderr, "relay: %s is fed by this proxy or too deep\n", upstream_proxy);
+      else
+        perror("relay");
+      exit(1);
+    }
+    sock = relay.sock;
+    icy_demux_init(&demux, -1); // unused, records come already split
+    if (frame_aligned)
+      fprintf(stderr, "relay: content-type is not known, audio is not frame aligned\n");
+    icy_name = relay.name;
+    icy_name_len = relay.name_len;
+    iam_extra = relay_path_record(relay.path, relay.path_len, &iam_extra_len);
+    if (!iam_extra) goto handle_errors;
+  } else if (source_path) {
+    if (file_source_open(&file, source_path, file_kbps > 0 ? file_kbps * 125 : 0) < 0) {
+      perror(source_path);
+      exit(1);
+    }
+    sock = file.base.fd;
+    source = &file.base;
+  } else {
+    struct addrinfo addr_hints, *addr_result;
+    memset(&addr_hints, 0, sizeof(struct addrinfo));
+    addr_hints.ai_family = AF_INET;
+    addr_hints.ai_socktype = SOCK_STREAM;
+    addr_hints.ai_protocol = IPPROTO_TCP;
+
+    int err = getaddrinfo(hostname, port, &addr_hints, &addr_result);
+    if (err != 0) exit(1);
 
-  if (receive_http_header(sock, &icy_metaint, &icy_name, &icy_name_len,
-                          buffer, BUFFER_LEN, &received_data) < 0)
-    goto handle_errors;
+    sock = socket(addr_result->ai_family, addr_result->ai_socktype, addr_result->ai_protocol);
+    if (sock < 0) exit(1);
 
-  if (icy_name) {
-    size_t tmp = strlen("icy-name:");
-    if (icy_name_len > tmp && strncasecmp(icy_name, "icy-name:", tmp) == 0) {
-      for (size_t i = 0; i + tmp < icy_name_len; ++i)
-        icy_name[i] = icy_name[i + tmp];
-      icy_name_len -= tmp;
+    // setting timeout for TCP connection
+    struct timeval tcp_timeout;
+    tcp_timeout.tv_sec = timeout;
+    tcp_timeout.tv_usec = 0;
+
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tcp_timeout, sizeof(tcp_timeout)) < 0) exit(1);
+    if (connect(sock, addr_result->ai_addr, addr_result->ai_addrlen) < 0) exit(1);
+
+    freeaddrinfo(addr_result);
+
+    send_http_request(sock, resource, metadata);
+  }
+
+  if (source == &socket_source) fd_source_init(&socket_source, sock);
+
+  if (!taken_over && !upstream_proxy) {
+    uint64_t origin = node_id;
+    iam_extra = relay_path_record(&origin, 1, &iam_extra_len);
+    if (!iam_extra) goto handle_errors;
+
+    long icy_metaint = -1;
+    long icy_br = -1;
+    char content_type[32];
+    if (source_path && !captured_stream(&file)) {
+      // raw audio, what a header would say comes from the options and the name
+      icy_metaint = file_metaint;
+      content_type_from_name(source_path, content_type, sizeof(content_type));
+      const char *name = strrchr(source_path, '/');
+      name = name ? name + 1 : source_path;
+      icy_name_len = strlen(name);
+      icy_name = strdup(name);
+      if (!icy_name) goto handle_errors;
+    } else if (receive_http_header(source, &icy_metaint, &icy_name, &icy_name_len, content_type,
+                                   sizeof(content_type), &icy_br, buffer, BUFFER_LEN,
+                                   &received_data) < 0) {
+      goto handle_errors;
+    }
+    icy_demux_init(&demux, icy_metaint);
+    if (source_path && file_kbps < 0 && icy_br > 0) file.bytes_per_sec = icy_br * 125;
+
+    if (frame_aligned) {
+      int codec = frame_codec(content_type);
+      if (codec == FRAME_NONE)
+        fprintf(stderr, "content-type '%s' has no known framing, audio is not frame aligned\n",
+                content_type);
+      frame_delivery_init(codec, NULL, 0);
+    }
+
+    if (icy_name) {
+      size_t tmp = strlen("icy-name:");
+      if (icy_name_len > tmp && strncasecmp(icy_name, "icy-name:", tmp) == 0) {
+        for (size_t i = 0; i + tmp < icy_name_len; ++i)
+          icy_name[i] = icy_name[i + tmp];
+        icy_name_len -= tmp;
+      }
     }
   }
 
   struct ip_mreq ip_mreq; // for multicast
 
+  if (local_name) {
+    // local readers keep following the same ring across a restart
+    if ((!taken_over || shm_ring_attach(&local_ring, local_name) < 0) &&
+        shm_ring_create(&local_ring, local_name, SHM_RING_DATA_LEN) < 0) {
+      perror("shm_ring_create");
+      goto handle_errors;
+    }
+    local_delivery_init(&local_ring);
+  }
+
+  if (archive_path) {
+    size_t archive_len = (size_t) archive_mb << 20;
+    if (archive_mb == 0 || (archive_len & (archive_len - 1)) != 0) {
+      fprintf(stderr, "archive size has to be a power of two (MiB)\n");
+      goto handle_errors;
+    }
+    if (archive_open(&archive, archive_path, archive_len) < 0) {
+      perror("archive_open");
+      goto handle_errors;
+    }
+    archive_delivery_init(&archive);
+  }
+
   if (listen_port != NULL) {
     if (icy_name_len > UINT16_MAX) goto handle_errors;
 
@@ -239,36 +683,57 @@ int main(int argc, char *argv[]) {
     iam_packet->length = htons((uint16_t)(icy_name_len));
     if (icy_name_len > 0) memcpy(iam_packet->data, icy_name, icy_name_len);
 
-    client_sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (client_sock < 0) {
-      free(iam_packet);
-      goto handle_errors;
-    }
-
     if (multi) {
       ip_mreq.imr_interface.s_addr = htonl(INADDR_ANY);
       if (inet_aton(multi, &ip_mreq.imr_multiaddr) == 0)
         goto handle_errors_client;
+    }
+
+    if (!taken_over) { // a handed over socket is already bound (and a member)
+      client_sock = socket(AF_INET, SOCK_DGRAM, 0);
+      if (client_sock < 0) {
+        free(iam_packet);
+        goto handle_errors;
+      }
 
-      if (setsockopt(client_sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &ip_mreq, sizeof ip_mreq) < 0)
+      if (multi &&
+          setsockopt(client_sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &ip_mreq, sizeof ip_mreq) < 0)
         goto handle_errors_client;
-    }
 
-    int optval = 1;
-    if (setsockopt(client_sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0)
-      goto handle_errors_client;
+      int optval = 1;
+      if (setsockopt(client_sock, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0)
+        goto handle_errors_client;
 
-    server_address.sin_family = AF_INET;
-    server_address.sin_addr.s_addr = htonl(INADDR_ANY);
-    server_address.sin_port = htons(lport);
+      server_address.sin_family = AF_INET;
+      server_address.sin_addr.s_addr = htonl(INADDR_ANY);
+      server_address.sin_port = htons(lport);
 
-    if (bind(client_sock, (struct sockaddr *) &server_address,
-            (socklen_t) sizeof(server_address)) < 0)
+      if (bind(client_sock, (struct sockaddr *) &server_address,
+              (socklen_t) sizeof(server_address)) < 0)
+        goto handle_errors_client;
+    }
+
+    if (udp_data_init(client_sock) < 0)
+      goto handle_errors_client;
+    if (archive_path && replay_start(&archive, client_sock) < 0)
       goto handle_errors_client;
+    if (use_uring && source_path) // mapped data is not read at all
+      fprintf(stderr, "io_uring is only used for the fan-out of a file\n");
+    if (use_uring && uring_delivery_init(source_path ? NULL : source, buffer, BUFFER_LEN) < 0)
+      fprintf(stderr, "io_uring not available (%s), using plain syscalls\n", strerror(errno));
+    if (xdp_interface) {
+      char *colon = strchr(xdp_interface, ':');
+      uint32_t queue = colon ? strtoul(colon + 1, NULL, 10) : 0;
+      if (colon) *colon = '\0';
+      if (xdp_delivery_init(xdp_interface, queue) < 0)
+        fprintf(stderr, "AF_XDP not available on %s (%s), using the socket\n", xdp_interface,
+                strerror(errno));
+    }
 
-    struct client_routine_data cr_data;
     cr_data.iam_packet = iam_packet;
     cr_data.iam_packet_len = icy_name_len + CLIENT_PROTO_DGRAM_HEADER_LEN;
+    cr_data.iam_extra = iam_extra;
+    cr_data.iam_extra_len = iam_extra_len;
     cr_data.sock = client_sock;
     if (pthread_create(&client_communication, NULL, &client_communication_routine, &cr_data) != 0)
       goto handle_errors_client;
@@ -276,31 +741,85 @@ int main(int argc, char *argv[]) {
     if (0) { // we can only get here while handling errors
       handle_errors_client:
       free(iam_packet);
-      if (close(client_sock) < 0) return 1;
+      if (client_sock >= 0 && close(client_sock) < 0) return 1;
       goto handle_errors;
     }
   }
 
-  receive_http_data(sock, icy_metaint, buffer, BUFFER_LEN, received_data, client_sock);
+  if (restart_path && start_handoff_listener(&handoff_sock) < 0) goto handle_errors;
+
+  for (;;) {
+    if (upstream_proxy)
+      relay_receive(sock, client_sock, timeout);
+    else
+      receive_http_data(source, &demux, buffer, BUFFER_LEN, received_data, client_sock);
+    received_data = 0;
+    if (!stop_ingest || !cont) {
+      cont = 0; // end of stream, the control thread goes too
+      break;
+    }
+
+    // a new process wants to take over
+    if (pthread_join(client_communication, NULL) != 0) exit(1);
+    handoff.upstream_sock = sock;
+    handoff.client_sock = client_sock;
+    handoff.demux = demux;
+    handoff.icy_name = icy_name;
+    handoff.icy_name_len = icy_name_len;
+    handoff.iam_extra = iam_extra;
+    handoff.iam_extra_len = iam_extra_len;
+    handoff.frame_codec = frame_delivery_codec();
+    handoff.frame_carry = (char *) frame_delivery_carry(&handoff.frame_carry_len);
+    relay_registration_get(&handoff.relay);
+    if (handoff_send(handoff_conn, &handoff, timeout) == 0)
+      exit(0); // sockets and the local ring live on in the new process
+    perror("handoff");
+    close(handoff_conn);
+    close(handoff_sock);
+
+    stop_ingest = false;
+    if (pthread_create(&client_communication, NULL, &client_communication_routine, &cr_data) != 0)
+      exit(1);
+    if (start_handoff_listener(&handoff_sock) < 0) goto handle_errors;
+  }
 
   if (listen_port) {
     if (pthread_join(client_communication, NULL) != 0) exit(1);
+    replay_stop();
     if (multi) {
       if (setsockopt(client_sock, IPPROTO_IP, IP_DROP_MEMBERSHIP, &ip_mreq, sizeof ip_mreq) < 0)
         exit(1);
     }
     if (close(client_sock) < 0) exit(1);
+    free(cr_data.iam_packet);
+  }
+  if (handoff_sock >= 0) {
+    close(handoff_sock);
+    unlink(restart_path);
   }
 
   free(icy_name);
-  if (close(sock) < 0) exit(1);
+  free(iam_extra);
+  if (source_path)
+    file_source_close(&file);
+  else if (close(sock) < 0)
+    exit(1);
   clear_list(&client_list);
+  uring_delivery_destroy();
+  xdp_delivery_destroy();
+  udp_data_destroy();
+  if (local_name) shm_ring_destroy(&local_ring);
+  archive_close(&archive);
   pthread_mutex_destroy(&mutex);
+  thread_leave();
   exit(0);
 
   handle_errors:
 
+  if (local_ring.header) shm_ring_destroy(&local_ring);
+  archive_close(&archive);
   free(icy_name);
+  free(iam_extra);
   close(sock);
   exit(1);
 }
@@ -0,0 +1,320 @@
+#include "relay.h"
+
+#include "client_protocol.h"
+#include "clock_sync.h"
+#include "http_connection.h"
+#include "utils.h"
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define RELAY_POLL_US       500000    // receive timeout, keepalives are sent in between
+#define RELAY_DISCOVER_US   1000000
+
+extern volatile sig_atomic_t cont;
+
+// of the upstream proxy, stamps are passed on in our clock
+static struct clock_sync upstream_clock;
+// its KEEPALIVE interval, from LEASE records
+static uint32_t upstream_lease_ms = KEEPALIVE_INTERVAL_MS;
+// given with its IAM, echoed in KEEPALIVEs
+static uint64_t upstream_cookie;
+static bool has_upstream_cookie;
+
+uint64_t relay_node_id(const char *listen_port) {
+  char host[256] = "";
+  gethostname(host, sizeof(host) - 1);
+  uint64_t hash = 0xcbf29ce484222325ULL; // FNV-1a
+  for (const char *c = host; *c; ++c) hash = (hash ^ (unsigned char) *c) * 0x100000001b3ULL;
+  hash = (hash ^ ':') * 0x100000001b3ULL;
+  for (const char *c = listen_port ? listen_port : ""; *c; ++c)
+    hash = (hash ^ (unsigned char) *c) * 0x100000001b3ULL;
+  // hosts with the same name (containers, clones) differ in the random part
+  uint64_t random;
+  while (getrandom(&random, sizeof(random), 0) != sizeof(random))
+    if (errno != EINTR) exit(1);
+  hash ^= random;
+  return hash ? hash : 1; // 0 stands for an unknown node
+}
+
+void relay_registration_get(struct relay_registration *registration) {
+  memset(registration, 0, sizeof(*registration));
+  registration->lease_ms = upstream_lease_ms;
+  registration->has_cookie = has_upstream_cookie;
+  registration->cookie = upstream_cookie;
+  registration->synced = clock_sync_offset(&upstream_clock, &registration->clock.offset_us,
+                                           &registration->clock.delay_us);
+}
+
+void relay_registration_set(const struct relay_registration *registration) {
+  upstream_lease_ms = registration->lease_ms > 0 ? registration->lease_ms : KEEPALIVE_INTERVAL_MS;
+  has_upstream_cookie = registration->has_cookie;
+  upstream_cookie = registration->cookie;
+  if (registration->synced) clock_sync_seed(&upstream_clock, &registration->clock);
+  else clock_sync_reset(&upstream_clock);
+}
+
+char *relay_path_record(const uint64_t *path, size_t path_len, size_t *len) {
+  *len = CLIENT_PROTO_DGRAM_HEADER_LEN + path_len * sizeof(uint64_t);
+  struct client_protocol_dgram *record = malloc(*len);
+  if (!record) return NULL;
+  record->type = htons(PATH);
+  record->length = htons(path_len * sizeof(uint64_t));
+  for (size_t i = 0; i < path_len; ++i) {
+    uint64_t id = htobe64(path[i]);
+    memcpy(record->data + i * sizeof(id), &id, sizeof(id));
+  }
+  return (char *) record;
+}
+
+/* the record with a CLOCK probe after it (and the cookie after KEEPALIVE) */
+static int send_record(int sock, uint16_t type, const void *data, uint16_t len) {
+  char buffer[CLIENT_PROTO_DGRAM_HEADER_LEN + 2 + CLIENT_PROTO_DGRAM_HEADER_LEN +
+              sizeof(upstream_cookie) + CLOCK_RECORD_LEN] __attribute__((aligned(_Alignof(struct client_protocol_dgram))));
+  struct client_protocol_dgram *dgram = (struct client_protocol_dgram *) buffer;
+  dgram->type = htons(type);
+  dgram->length = htons(len);
+  if (len > 0) memcpy(dgram->data, data, len);
+  size_t probe_offset = CLIENT_PROTO_DGRAM_HEADER_LEN + len + (len & 1);
+  if (type == KEEPALIVE && has_upstream_cookie) {
+    struct client_protocol_dgram *record = (struct client_protocol_dgram *) (buffer + probe_offset);
+    record->type = htons(COOKIE);
+    record->length = htons(sizeof(upstream_cookie));
+    memcpy(record->data, &upstream_cookie, sizeof(upstream_cookie));
+    probe_offset += CLIENT_PROTO_DGRAM_HEADER_LEN + sizeof(upstream_cookie);
+  }
+  size_t total = probe_offset + CLOCK_RECORD_LEN;
+  clock_probe_record(buffer + probe_offset, realtime_us());
+  ssize_t ret = send(sock, buffer, total, 0);
+  return ret == (ssize_t) total ? 0 : -1;
+}
+
+static void clock_answer(const struct client_protocol_dgram *record) {
+  struct clock_info answer;
+  if (ntohs(record->length) < sizeof(answer)) return;
+  memcpy(&answer, record->data, sizeof(answer));
+  clock_sync_add(&upstream_clock, &answer, realtime_us());
+}
+
+static void lease_answer(const struct client_protocol_dgram *record) {
+  uint32_t lease;
+  if (ntohs(record->length) < sizeof(lease)) return;
+  memcpy(&lease, record->data, sizeof(lease));
+  upstream_lease_ms = ntohl(lease) > 0 ? ntohl(lease) : KEEPALIVE_INTERVAL_MS;
+}
+
+static int open_upstream(const char *address) {
+  const char *colon = strrchr(address, ':');
+  if (!colon || colon == address) {
+    errno = EINVAL;
+    return -1;
+  }
+  char host[colon - address + 1];
+  memcpy(host, address, colon - address);
+  host[colon - address] = '\0';
+
+  struct addrinfo hints, *result;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  int err = getaddrinfo(host, colon + 1, &hints, &result);
+  if (err != 0) {
+    fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(err));
+    errno = EINVAL;
+    return -1;
+  }
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  struct timeval tv = {0, RELAY_POLL_US};
+  if (sock < 0 || setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+      connect(sock, result->ai_addr, result->ai_addrlen) < 0) {
+    int saved_errno = errno;
+    if (sock >= 0) close(sock);
+    freeaddrinfo(result);
+    errno = saved_errno;
+    return -1;
+  }
+  freeaddrinfo(result);
+  return sock;
+}
+
+/* IAM, PATH, LOAD, LEASE and COOKIE of one upstream answer; 1 once IAM has come */
+static int parse_answer(struct relay_upstream *relay, const char *buffer, size_t len) {
+  struct record_iter iter;
+  record_iter_init(&iter, buffer, len);
+  const struct client_protocol_dgram *record;
+  int got_iam = 0;
+  while ((record = record_next(&iter)) != NULL) {
+    uint16_t length = ntohs(record->length);
+    switch (ntohs(record->type)) {
+      case IAM:
+        free(relay->name);
+        relay->name = malloc(length + 1);
+        if (!relay->name) return -1;
+        memcpy(relay->name, record->data, length);
+        relay->name_len = length;
+        got_iam = 1;
+        break;
+      case PATH:
+        relay->path_len = MIN(length / sizeof(uint64_t), RELAY_MAX_DEPTH + 1);
+        for (size_t i = 0; i < relay->path_len; ++i) {
+          uint64_t id;
+          memcpy(&id, record->data + i * sizeof(id), sizeof(id));
+          relay->path[i] = be64toh(id);
+        }
+        break;
+      case LOAD:;
+        struct load_info info;
+        if (length < sizeof(info)) break;
+        memcpy(&info, record->data, sizeof(info));
+        if (ntohl(info.max_clients) > 0 && ntohl(info.clients) >= ntohl(info.max_clients)) {
+          errno = EBUSY; // it did not take us
+          return -1;
+        }
+        break;
+      case CLOCK:
+        clock_answer(record);
+        break;
+      case LEASE:
+        lease_answer(record);
+        break;
+      case COOKIE:
+        if (length < sizeof(upstream_cookie)) break;
+        memcpy(&upstream_cookie, record->data, sizeof(upstream_cookie));
+        has_upstream_cookie = true;
+        break;
+      default:; // audio can already be on its way
+    }
+  }
+  return got_iam;
+}
+
+int relay_connect(struct relay_upstream *relay, const char *address, uint64_t node_id,
+                  unsigned timeout) {
+  memset(relay, 0, sizeof(*relay));
+  clock_sync_reset(&upstream_clock);
+  upstream_lease_ms = KEEPALIVE_INTERVAL_MS;
+  has_upstream_cookie = false;
+  relay->sock = open_upstream(address);
+  if (relay->sock < 0) return -1;
+  char *buffer = malloc(UDP_BUFFER_LEN);
+  if (!buffer) goto handle_errors;
+
+  uint64_t start = monotonic_us(), last_discover = 0;
+  int got_iam = 0;
+  while (cont && !got_iam) {
+    uint64_t now = monotonic_us();
+    if (now - start > (uint64_t) timeout * 1000000) {
+      errno = ETIMEDOUT;
+      goto handle_errors;
+    }
+    if (last_discover == 0 || now - last_discover >= RELAY_DISCOVER_US) {
+      uint8_t version = PROTOCOL_V2;
+      if (send_record(relay->sock, DISCOVER, &version, 1) < 0) goto handle_errors;
+      last_discover = now;
+    }
+    ssize_t len = recv(relay->sock, buffer, UDP_BUFFER_LEN, 0);
+    if (len < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNREFUSED)
+        continue; // not up yet
+      goto handle_errors;
+    }
+    if ((got_iam = parse_answer(relay, buffer, len)) < 0) goto handle_errors;
+  }
+  if (!got_iam) {
+    errno = EINTR;
+    goto handle_errors;
+  }
+
+  if (relay->path_len == 0) // a proxy without PATH records is an origin we can't name
+    relay->path[relay->path_len++] = 0;
+  for (size_t i = 0; i < relay->path_len; ++i) {
+    if (relay->path[i] == node_id) {
+      errno = ELOOP;
+      goto handle_errors;
+    }
+  }
+  if (relay->path_len > RELAY_MAX_DEPTH) {
+    errno = ELOOP;
+    goto handle_errors;
+  }
+  relay->path[relay->path_len++] = node_id;
+  free(buffer);
+  return 0;
+
+  handle_errors:;
+  int saved_errno = errno;
+  free(buffer);
+  free(relay->name);
+  relay->name = NULL;
+  close(relay->sock);
+  errno = saved_errno;
+  return -1;
+}
+
+int relay_receive(int sock, int client_sock, unsigned timeout) {
+  char *buffer = malloc(UDP_BUFFER_LEN);
+  if (!buffer) return -1;
+  int ret = 0;
+  // the first KEEPALIVE confirms the registration started by DISCOVER
+  uint64_t last_data = monotonic_us(), last_keepalive = 0;
+
+  while (cont && !stop_ingest) {
+    uint64_t now = monotonic_us();
+    if (now - last_keepalive >= (uint64_t) upstream_lease_ms * 1000) {
+      if (send_record(sock, KEEPALIVE, NULL, 0) < 0) perror("send");
+      last_keepalive = now;
+    }
+    ssize_t len = recv(sock, buffer, UDP_BUFFER_LEN, 0);
+    if (len < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNREFUSED) {
+        ret = -1;
+        break;
+      }
+      if (monotonic_us() - last_data > (uint64_t) timeout * 1000000) {
+        ret = -1; // the upstream proxy is gone
+        break;
+      }
+      continue;
+    }
+
+    struct record_iter iter;
+    record_iter_init(&iter, buffer, len);
+    const struct client_protocol_dgram *record;
+    while ((record = record_next(&iter)) != NULL) {
+      uint16_t type = ntohs(record->type);
+      if (type == STAMP && ntohs(record->length) >= sizeof(struct stamp_info)) {
+        // latency is measured from the origin, sequence numbers are ours
+        struct stamp_info stamp;
+        memcpy(&stamp, record->data, sizeof(stamp));
+        uint64_t ingest = (uint64_t) ntohl(stamp.ingest_us_hi) << 32 | ntohl(stamp.ingest_us_lo);
+        // to our clock, which our clients sync to (kept as it is until it is known)
+        int64_t offset;
+        uint32_t delay;
+        if (clock_sync_offset(&upstream_clock, &offset, &delay)) ingest -= offset;
+        ingest_stamp(ingest);
+      }
+      if (type == CLOCK) clock_answer(record);
+      if (type == LEASE) lease_answer(record);
+      if (type != AUDIO && type != METADATA) continue;
+      last_data = monotonic_us();
+      if (deliver_data(client_sock, type, (char *) record->data, ntohs(record->length)) < 0) {
+        ret = -1;
+        goto end;
+      }
+    }
+    publish_data(client_sock);
+  }
+  end:
+  publish_data(client_sock);
+  free(buffer);
+  return ret;
+}
@@ -0,0 +1,55 @@
+#ifndef _RADIO_RELAY_H_
+#define _RADIO_RELAY_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "clock_sync.h"
+
+#define RELAY_MAX_DEPTH  32
+
+/* Relay mode: radio-proxy takes the stream from another radio-proxy as a
+ * v2 client (DISCOVER, KEEPALIVE) and fans it out again. Every proxy sends
+ * v2 clients a PATH record with the node ids from the origin down to
+ * itself, so a relay can refuse an upstream it already feeds (a loop) and
+ * listeners can see the delivery depth. Stamps are passed on in the
+ * relay's own clock, its offset from the upstream's comes from CLOCK
+ * probes, so that its clients only need to sync to it.               */
+struct relay_upstream {
+  int sock;                // connected to the upstream proxy
+  char *name;              // from its IAM
+  size_t name_len;
+  uint64_t path[RELAY_MAX_DEPTH + 1];   // origin first, this proxy last
+  size_t path_len;
+};
+
+/* our registration with the upstream, which a hot restart hands over */
+struct relay_registration {
+  uint32_t lease_ms;       // between KEEPALIVEs
+  bool has_cookie;         // echoed in KEEPALIVEs
+  uint64_t cookie;
+  bool synced;             // clock holds the best CLOCK answer so far
+  struct clock_sample clock;
+};
+
+void relay_registration_get(struct relay_registration *registration);
+
+void relay_registration_set(const struct relay_registration *registration);
+
+/* of this process: the host name and listen port mixed with random bits;
+ * a hot restart keeps it, as the PATH handed over to the new process   */
+uint64_t relay_node_id(const char *listen_port);
+
+/* PATH record (header included, padded to an even length), malloc'ed */
+char *relay_path_record(const uint64_t *path, size_t path_len, size_t *len);
+
+/* address is host:port; waits at most timeout seconds for IAM */
+int relay_connect(struct relay_upstream *relay, const char *address, uint64_t node_id,
+                  unsigned timeout);
+
+/* passes received audio and metadata on until the stream stops (-1 when
+ * nothing came for timeout seconds), keeping the upstream registration */
+int relay_receive(int sock, int client_sock, unsigned timeout);
+
+#endif  // _RADIO_RELAY_H_
@@ -0,0 +1,236 @@
+#include "replay.h"
+
+#include "client_protocol.h"
+#include "http_connection.h"
+#include "packetizer.h"
+#include "thread_layout.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define REPLAY_BUFFER_LEN  0x10000
+
+extern volatile sig_atomic_t cont;
+
+struct replay_session {
+  struct sockaddr_in address;
+  uint8_t version;
+  struct shm_ring reader;
+  uint64_t offset_us;      // how far behind live (by archive time) the session plays
+  struct packetizer packetizer;
+  struct replay_session *next;
+};
+
+struct replay_request {
+  struct sockaddr_in address;
+  uint8_t version;
+  uint32_t seconds;
+  struct replay_request *next;
+};
+
+static struct archive *archive;
+static int udp_sock = -1;
+static pthread_t thread;
+static bool running = false;
+
+// requests are guarded by replay_mutex, sessions belong to the thread
+static pthread_mutex_t replay_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct replay_request *requests = NULL;
+static struct replay_session *sessions = NULL;
+
+static void send_to_session(void *arg, struct packet *packet, size_t len,
+                            uint8_t version __attribute__((unused))) {
+  struct replay_session *session = arg;
+  sendto(udp_sock, packet->data, len, 0, (struct sockaddr *) &session->address,
+         (socklen_t) sizeof(session->address));
+}
+
+static void end_session(struct replay_session **link) {
+  struct replay_session *session = *link;
+  *link = session->next;
+  packetizer_destroy(&session->packetizer);
+  free(session);
+}
+
+static struct replay_session **find_session(const struct sockaddr_in *address) {
+  struct replay_session **link = &sessions;
+  while (*link && !is_same_address(&(*link)->address, address)) link = &(*link)->next;
+  return link;
+}
+
+static void forward(struct replay_session *session, uint16_t type, char *data, size_t len) {
+  bool v2 = session->version >= PROTOCOL_V2;
+  packetizer_add(&session->packetizer, type, data, len, !v2, v2);
+}
+
+/* passes one record on, false if there was nothing (yet) */
+static bool forward_record(struct replay_session *session, char *buffer) {
+  uint64_t lost = 0;
+  uint16_t type;
+  ssize_t len = shm_ring_read(&session->reader, &type, buffer, REPLAY_BUFFER_LEN, &lost);
+  if (len < 0) return true; // skipped
+  if (lost > 0) session->offset_us = 0; // overwritten under us, the reader is at live now
+  if (len == 0) return false;
+  forward(session, type, buffer, len);
+  return true;
+}
+
+/* a client whose session can't start goes on getting the live stream */
+static void back_to_live(const struct sockaddr_in *address) {
+  if (pthread_mutex_lock(&mutex) != 0) exit(1);
+  FOR_LIST(c, client_list) {
+    if (is_same_address(&c->client_address, address)) {
+      c->replaying = false;
+      break;
+    }
+  }
+  if (pthread_mutex_unlock(&mutex) != 0) exit(1);
+}
+
+static void start_session(const struct replay_request *request, char *buffer) {
+  struct replay_session **link = find_session(&request->address);
+  if (*link) end_session(link);
+  if (request->seconds == 0) return; // back to live
+
+  struct archive_entry entry;
+  uint64_t now = realtime_us();
+  // e.g. further back than the archive goes
+  if (archive_seek(archive, now - (uint64_t) request->seconds * 1000000, &entry) < 0) {
+    back_to_live(&request->address);
+    return;
+  }
+  struct replay_session *session = malloc(sizeof(struct replay_session));
+  if (!session) {
+    back_to_live(&request->address);
+    return;
+  }
+  session->address = request->address;
+  session->version = request->version;
+  if (packetizer_init(&session->packetizer, NULL, MAX_UDP_MSG_SIZE, V2_MAX_DGRAM_LEN,
+                      &send_to_session, session) < 0) {
+    free(session);
+    back_to_live(&request->address);
+    return;
+  }
+  session->offset_us = now - entry.time_us;
+  session->next = sessions;
+  sessions = session;
+
+  // the metadata current at that time goes first
+  if (entry.metadata_pos != NO_METADATA) {
+    uint64_t lost = 0;
+    uint16_t type;
+    shm_ring_view(&session->reader, &archive->ring, entry.metadata_pos);
+    ssize_t len = shm_ring_read(&session->reader, &type, buffer, REPLAY_BUFFER_LEN, &lost);
+    if (len > 0 && lost == 0 && type == METADATA) forward(session, type, buffer, len);
+  }
+  shm_ring_view(&session->reader, &archive->ring, entry.pos);
+}
+
+/* sessions of clients that are gone (or no longer replaying) end */
+static void check_sessions(void) {
+  if (pthread_mutex_lock(&mutex) != 0) exit(1);
+  for (struct replay_session **link = &sessions; *link;) {
+    bool listed = false;
+    FOR_LIST(c, client_list) {
+      if (is_same_address(&c->client_address, &(*link)->address)) {
+        listed = c->replaying;
+        break;
+      }
+    }
+    if (listed) link = &(*link)->next;
+    else end_session(link);
+  }
+  if (pthread_mutex_unlock(&mutex) != 0) exit(1);
+}
+
+static void *replay_routine(void *arg __attribute__((unused))) {
+  thread_enter("replay", THREAD_DATA);
+  char *buffer = malloc(REPLAY_BUFFER_LEN);
+  if (!buffer) return NULL;
+  uint64_t last_check = monotonic_us();
+
+  while (cont && running) {
+    if (pthread_mutex_lock(&replay_mutex) != 0) exit(1);
+    struct replay_request *pending = requests;
+    requests = NULL;
+    if (pthread_mutex_unlock(&replay_mutex) != 0) exit(1);
+    while (pending) {
+      struct replay_request *request = pending;
+      pending = pending->next;
+      start_session(request, buffer);
+      free(request);
+    }
+
+    if (monotonic_us() - last_check >= REPLAY_CHECK_US) {
+      check_sessions();
+      last_check = monotonic_us();
+    }
+
+    // each session gets the records written up to its point in archive time
+    uint64_t now = realtime_us();
+    for (struct replay_session *session = sessions; session; session = session->next) {
+      struct archive_entry entry;
+      uint64_t limit = shm_ring_head(&archive->ring);
+      if (session->offset_us > 0) {
+        if (archive_seek(archive, now - session->offset_us, &entry) < 0) continue;
+        limit = entry.pos;
+      }
+      while (session->reader.pos < limit && forward_record(session, buffer)) {}
+      packetizer_flush(&session->packetizer);
+    }
+    usleep(REPLAY_TICK_US);
+  }
+
+  while (sessions) end_session(&sessions);
+  free(buffer);
+  thread_leave();
+  return NULL;
+}
+
+int replay_start(struct archive *replay_archive, int sock) {
+  archive = replay_archive;
+  udp_sock = sock;
+  running = true;
+  int err = pthread_create(&thread, NULL, &replay_routine, NULL);
+  if (err != 0) {
+    running = false;
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+void replay_stop(void) {
+  if (!running) return;
+  running = false;
+  pthread_join(thread, NULL);
+  while (requests) {
+    struct replay_request *request = requests;
+    requests = request->next;
+    free(request);
+  }
+}
+
+void replay_request(const struct sockaddr_in *address, uint8_t version, uint32_t seconds) {
+  struct replay_request *request = malloc(sizeof(struct replay_request));
+  if (!request) return;
+  request->address = *address;
+  request->version = version;
+  request->seconds = seconds;
+  if (pthread_mutex_lock(&replay_mutex) != 0) exit(1);
+  // appended, so that requests of one client are applied in order
+  struct replay_request **link = &requests;
+  while (*link) link = &(*link)->next;
+  request->next = NULL;
+  *link = request;
+  if (pthread_mutex_unlock(&replay_mutex) != 0) exit(1);
+}
@@ -0,0 +1,24 @@
+#ifndef _RADIO_REPLAY_H_
+#define _RADIO_REPLAY_H_
+
+#include <netinet/in.h>
+#include <stdint.h>
+
+#include "archive.h"
+
+#define REPLAY_TICK_US      50000
+#define REPLAY_CHECK_US     1000000   // how often sessions are matched against client_list
+
+/* Time-shifted playback from the archive. A client sends REPLAY with the
+ * number of seconds to go back (0 - back to live); from then on it is left
+ * out of the live fan-out and a separate thread sends it the archived
+ * records, paced by the archive's time index, from its own reader - the
+ * ingest and live fan-out never wait for it.                           */
+int replay_start(struct archive *archive, int sock);
+
+void replay_stop(void);
+
+/* called by the control thread for a listed client */
+void replay_request(const struct sockaddr_in *address, uint8_t version, uint32_t seconds);
+
+#endif  // _RADIO_REPLAY_H_
@@ -0,0 +1,133 @@
+#include "screen.h"
+
+#include "telnet.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MOVE_TO_MAX_LEN  16   // "\x1b[<row>;1H"
+
+static int reserve(void *buffer, size_t *capacity, size_t needed, size_t elem_size) {
+  if (needed <= *capacity) return 0;
+  size_t new_capacity = MAX(needed, 2 * *capacity);
+  void *new_buffer = realloc(*(void **)buffer, new_capacity * elem_size);
+  if (!new_buffer) return -1;
+  *(void **)buffer = new_buffer;
+  *capacity = new_capacity;
+  return 0;
+}
+
+void frame_init(struct frame *frame) {
+  memset(frame, 0, sizeof(*frame));
+}
+
+void frame_destroy(struct frame *frame) {
+  free(frame->text);
+  free(frame->line_end);
+  frame_init(frame);
+}
+
+void frame_reset(struct frame *frame) {
+  frame->len = 0;
+  frame->lines = 0;
+}
+
+int frame_append(struct frame *frame, const char *text, size_t len) {
+  if (reserve(&frame->text, &frame->capacity, frame->len + len, 1) < 0) return -1;
+  memcpy(frame->text + frame->len, text, len);
+  frame->len += len;
+  return 0;
+}
+
+int frame_end_line(struct frame *frame) {
+  if (reserve(&frame->line_end, &frame->lines_capacity, frame->lines + 1, sizeof(size_t)) < 0)
+    return -1;
+  frame->line_end[frame->lines++] = frame->len;
+  return 0;
+}
+
+static const char *line(const struct frame *frame, size_t i, size_t *len) {
+  size_t begin = i > 0 ? frame->line_end[i - 1] : 0;
+  *len = frame->line_end[i] - begin;
+  return frame->text + begin;
+}
+
+void screen_init(struct screen *screen) {
+  frame_init(&screen->shown);
+  screen->valid = false;
+  screen->out = NULL;
+  screen->out_capacity = 0;
+}
+
+void screen_destroy(struct screen *screen) {
+  frame_destroy(&screen->shown);
+  free(screen->out);
+  screen_init(screen);
+}
+
+void screen_invalidate(struct screen *screen) {
+  screen->valid = false;
+}
+
+static int write_all(int fd, const char *buffer, size_t len) {
+  while (len > 0) {
+    ssize_t ret = write(fd, buffer, len);
+    if (ret < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    buffer += ret;
+    len -= ret;
+  }
+  return 0;
+}
+
+int screen_render(struct screen *screen, const struct frame *frame, int fd) {
+  size_t rows = MAX(frame->lines, screen->shown.lines);
+  size_t bound = CLRSCR_LEN + frame->len + rows * (MOVE_TO_MAX_LEN + NO_ATTR_LEN + ERASE_LINE_LEN);
+  if (reserve(&screen->out, &screen->out_capacity, bound, 1) < 0) return -1;
+
+  size_t len = 0;
+  if (!screen->valid) {
+    memcpy(screen->out, CLRSCR, CLRSCR_LEN);
+    len += CLRSCR_LEN;
+  }
+  for (size_t i = 0; i < rows; ++i) {
+    size_t new_len = 0, old_len = 0;
+    const char *new_line = i < frame->lines ? line(frame, i, &new_len) : "";
+    const char *old_line = i < screen->shown.lines ? line(&screen->shown, i, &old_len) : "";
+    if (screen->valid && new_len == old_len && memcmp(new_line, old_line, new_len) == 0)
+      continue;
+    if (!screen->valid && i >= frame->lines)
+      continue; // nothing there after CLRSCR
+
+    len += snprintf(screen->out + len, MOVE_TO_MAX_LEN, "\x1b[%zu;1H", i + 1);
+    memcpy(screen->out + len, new_line, new_len);
+    len += new_len;
+    memcpy(screen->out + len, NO_ATTR ERASE_LINE, NO_ATTR_LEN + ERASE_LINE_LEN);
+    len += NO_ATTR_LEN + ERASE_LINE_LEN;
+  }
+
+  if (len == 0) return 0;
+  if (write_all(fd, screen->out, len) < 0) {
+    screen->valid = false;
+    return -1;
+  }
+
+  frame_reset(&screen->shown);
+  for (size_t i = 0; i < frame->lines; ++i) {
+    size_t line_len;
+    const char *text = line(frame, i, &line_len);
+    if (frame_append(&screen->shown, text, line_len) < 0 ||
+        frame_end_line(&screen->shown) < 0) {
+      screen->valid = false;
+      return 0;
+    }
+  }
+  screen->valid = true;
+  return 0;
+}
@@ -0,0 +1,46 @@
+#ifndef _RADIO_SCREEN_H_
+#define _RADIO_SCREEN_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* one frame of the telnet ui: text of all lines in one buffer */
+struct frame {
+  char *text;
+  size_t len;
+  size_t capacity;
+  size_t *line_end;        // line i is text[line_end[i - 1] .. line_end[i])
+  size_t lines;
+  size_t lines_capacity;
+};
+
+/* what is currently shown on a terminal, used to send only changed lines */
+struct screen {
+  struct frame shown;
+  bool valid;              // false - terminal content is unknown
+  char *out;               // reusable output buffer
+  size_t out_capacity;
+};
+
+void frame_init(struct frame *frame);
+
+void frame_destroy(struct frame *frame);
+
+void frame_reset(struct frame *frame);
+
+int frame_append(struct frame *frame, const char *text, size_t len);
+
+int frame_end_line(struct frame *frame);
+
+void screen_init(struct screen *screen);
+
+void screen_destroy(struct screen *screen);
+
+/* next render clears the terminal and draws every line */
+void screen_invalidate(struct screen *screen);
+
+/* draws frame on fd with a single write, emitting only lines that differ
+ * from the previously rendered frame; on failure the screen is invalidated */
+int screen_render(struct screen *screen, const struct frame *frame, int fd);
+
+#endif  // _RADIO_SCREEN_H_
@@ -0,0 +1,288 @@
+#include "shm_ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ALIGN_UP(x) (((x) + SHM_RECORD_ALIGN - 1) & ~(uint64_t) (SHM_RECORD_ALIGN - 1))
+
+static char *shm_name(const char *name) {
+  size_t len = strlen(name);
+  char *full = malloc(len + 2);
+  if (!full) return NULL;
+  full[0] = '/';
+  memcpy(full + 1, name[0] == '/' ? name + 1 : name, len + (name[0] == '/' ? 0 : 1));
+  return full;
+}
+
+static bool valid_len(size_t data_len) {
+  if (data_len == 0 || (data_len & (data_len - 1)) != 0 || data_len > UINT32_MAX) {
+    errno = EINVAL;
+    return false;
+  }
+  return true;
+}
+
+static void init_header(struct shm_ring *ring, void *map, size_t data_len) {
+  ring->header = map;
+  ring->data = (char *) map + SHM_RING_HEADER_LEN;
+  ring->data_len = data_len;
+  ring->header->magic = 0;
+  ring->header->data_len = data_len;
+  atomic_store(&ring->header->head, 0);
+  atomic_store(&ring->header->reserved, 0);
+  atomic_store(&ring->header->seq, 0);
+  // consumers check the magic last
+  atomic_thread_fence(memory_order_release);
+  ring->header->magic = SHM_RING_MAGIC;
+}
+
+int shm_ring_init(struct shm_ring *ring, void *map, size_t data_len) {
+  if (!valid_len(data_len)) return -1;
+  memset(ring, 0, sizeof(*ring));
+  struct shm_ring_header *header = map;
+  if (header->magic == SHM_RING_MAGIC && header->data_len == data_len &&
+      atomic_load(&header->reserved) == atomic_load(&header->head)) {
+    ring->header = header;
+    ring->data = (char *) map + SHM_RING_HEADER_LEN;
+    ring->data_len = data_len;
+    ring->pos = atomic_load(&header->head);
+  } else {
+    init_header(ring, map, data_len);
+  }
+  return 0;
+}
+
+void shm_ring_view(struct shm_ring *reader, const struct shm_ring *ring, uint64_t pos) {
+  memset(reader, 0, sizeof(*reader));
+  reader->header = ring->header;
+  reader->data = ring->data;
+  reader->data_len = ring->data_len;
+  reader->pos = pos;
+}
+
+uint64_t shm_ring_head(const struct shm_ring *ring) {
+  return atomic_load_explicit(&ring->header->head, memory_order_acquire);
+}
+
+int shm_ring_create(struct shm_ring *ring, const char *name, size_t data_len) {
+  if (!valid_len(data_len)) return -1;
+  memset(ring, 0, sizeof(*ring));
+  ring->name = shm_name(name);
+  if (!ring->name) return -1;
+
+  // a stale ring is left to its consumers, they notice it goes quiet
+  shm_unlink(ring->name);
+  int fd = shm_open(ring->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) goto free_name;
+  ring->map_len = SHM_RING_HEADER_LEN + data_len;
+  if (ftruncate(fd, ring->map_len) < 0) goto unlink;
+  void *map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) goto unlink;
+  close(fd);
+
+  init_header(ring, map, data_len);
+  ring->notify = true;
+  return 0;
+
+  unlink:;
+  int saved_errno = errno;
+  close(fd);
+  shm_unlink(ring->name);
+  errno = saved_errno;
+  free_name:
+  free(ring->name);
+  ring->name = NULL;
+  return -1;
+}
+
+int shm_ring_attach(struct shm_ring *ring, const char *name) {
+  memset(ring, 0, sizeof(*ring));
+  ring->name = shm_name(name);
+  if (!ring->name) return -1;
+
+  int fd = shm_open(ring->name, O_RDWR, 0);
+  if (fd < 0) goto free_name;
+  struct stat st;
+  if (fstat(fd, &st) < 0) goto close_fd;
+  if ((size_t) st.st_size <= SHM_RING_HEADER_LEN) {
+    errno = EINVAL;
+    goto close_fd;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) goto close_fd;
+  close(fd);
+
+  ring->header = map;
+  ring->map_len = st.st_size;
+  ring->data = (char *) map + SHM_RING_HEADER_LEN;
+  ring->data_len = ring->header->data_len;
+  if (ring->header->magic != SHM_RING_MAGIC ||
+      ring->data_len + SHM_RING_HEADER_LEN != ring->map_len) {
+    shm_ring_close(ring);
+    errno = EINVAL;
+    goto free_name;
+  }
+  ring->pos = atomic_load(&ring->header->head);
+  ring->notify = true;
+  return 0;
+
+  close_fd:;
+  int saved_errno = errno;
+  close(fd);
+  errno = saved_errno;
+  free_name:
+  free(ring->name);
+  ring->name = NULL;
+  return -1;
+}
+
+void shm_ring_destroy(struct shm_ring *ring) {
+  if (ring->name) {
+    shm_unlink(ring->name);
+    free(ring->name);
+    ring->name = NULL;
+  }
+  shm_ring_close(ring);
+}
+
+static void copy_in(struct shm_ring *ring, uint64_t pos, const void *src, size_t len) {
+  size_t offset = pos & (ring->data_len - 1);
+  size_t first = len < ring->data_len - offset ? len : ring->data_len - offset;
+  memcpy(ring->data + offset, src, first);
+  memcpy(ring->data, (const char *) src + first, len - first);
+}
+
+static void copy_out(const struct shm_ring *ring, uint64_t pos, void *dst, size_t len) {
+  size_t offset = pos & (ring->data_len - 1);
+  size_t first = len < ring->data_len - offset ? len : ring->data_len - offset;
+  memcpy(dst, ring->data + offset, first);
+  memcpy((char *) dst + first, ring->data, len - first);
+}
+
+int shm_ring_write(struct shm_ring *ring, uint16_t type, const void *data, size_t len) {
+  if (len == 0) return 0; // nothing a consumer could use
+  uint64_t size = ALIGN_UP(sizeof(struct shm_record) + len);
+  if (size > ring->data_len / 2) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  atomic_store_explicit(&ring->header->reserved, ring->pos + size, memory_order_relaxed);
+  // the reservation is visible before any overwritten byte changes
+  atomic_thread_fence(memory_order_release);
+
+  struct shm_record record = {type, 0, len};
+  copy_in(ring, ring->pos, &record, sizeof(record));
+  copy_in(ring, ring->pos + sizeof(record), data, len);
+  ring->pos += size;
+  return 0;
+}
+
+void shm_ring_publish(struct shm_ring *ring) {
+  struct shm_ring_header *header = ring->header;
+  if (atomic_load_explicit(&header->head, memory_order_relaxed) == ring->pos) return;
+  atomic_store_explicit(&header->head, ring->pos, memory_order_release);
+  atomic_fetch_add_explicit(&header->seq, 1, memory_order_release);
+  if (!ring->notify) return;
+  // one wake per publish (per upstream read), consumers can't announce themselves
+  syscall(SYS_futex, &header->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+int shm_ring_open(struct shm_ring *ring, const char *name) {
+  memset(ring, 0, sizeof(*ring));
+  char *full = shm_name(name);
+  if (!full) return -1;
+  int fd = shm_open(full, O_RDONLY, 0);
+  free(full);
+  if (fd < 0) return -1;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) goto close_fd;
+  if ((size_t) st.st_size <= SHM_RING_HEADER_LEN) {
+    errno = EINVAL;
+    goto close_fd;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) goto close_fd;
+  close(fd);
+
+  ring->header = map;
+  ring->map_len = st.st_size;
+  ring->data = (char *) map + SHM_RING_HEADER_LEN;
+  ring->data_len = ring->header->data_len;
+  atomic_thread_fence(memory_order_acquire);
+  if (ring->header->magic != SHM_RING_MAGIC ||
+      ring->data_len + SHM_RING_HEADER_LEN != ring->map_len) {
+    shm_ring_close(ring);
+    errno = EINVAL;
+    return -1;
+  }
+  ring->pos = atomic_load_explicit(&ring->header->head, memory_order_acquire);
+  return 0;
+
+  close_fd:;
+  int saved_errno = errno;
+  close(fd);
+  errno = saved_errno;
+  return -1;
+}
+
+void shm_ring_close(struct shm_ring *ring) {
+  if (ring->header && ring->map_len > 0) munmap(ring->header, ring->map_len);
+  ring->header = NULL;
+}
+
+ssize_t shm_ring_read(struct shm_ring *ring, uint16_t *type, void *buffer, size_t len,
+                      uint64_t *lost) {
+  struct shm_ring_header *header = ring->header;
+  for (;;) {
+    uint64_t head = atomic_load_explicit(&header->head, memory_order_acquire);
+    if (head == ring->pos) return 0;
+    if (head - ring->pos > ring->data_len) {
+      ring->pos = head; // fell behind too far
+      (*lost)++;
+      continue;
+    }
+
+    struct shm_record record;
+    copy_out(ring, ring->pos, &record, sizeof(record));
+    uint64_t size = ALIGN_UP(sizeof(record) + (uint64_t) record.len);
+    bool fits = record.len <= len;
+    if (size <= head - ring->pos && fits)
+      copy_out(ring, ring->pos + sizeof(record), buffer, record.len);
+
+    // whatever was copied is valid only if it has not been reserved again
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t reserved = atomic_load_explicit(&header->reserved, memory_order_relaxed);
+    if (reserved - ring->pos > ring->data_len || size > head - ring->pos) {
+      ring->pos = atomic_load_explicit(&header->head, memory_order_acquire);
+      (*lost)++;
+      continue;
+    }
+
+    ring->pos += size;
+    if (!fits) {
+      errno = EMSGSIZE;
+      return -1;
+    }
+    *type = record.type;
+    return record.len;
+  }
+}
+
+int shm_ring_wait(struct shm_ring *ring, int timeout_ms) {
+  struct shm_ring_header *header = ring->header;
+  uint32_t seq = atomic_load_explicit(&header->seq, memory_order_acquire);
+  if (atomic_load_explicit(&header->head, memory_order_acquire) != ring->pos) return 1;
+  struct timespec timeout = {timeout_ms / 1000, (long) (timeout_ms % 1000) * 1000000};
+  syscall(SYS_futex, &header->seq, FUTEX_WAIT, seq, &timeout, NULL, 0);
+  return atomic_load_explicit(&header->head, memory_order_acquire) != ring->pos;
+}
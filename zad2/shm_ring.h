@@ -0,0 +1,89 @@
+#ifndef _RADIO_SHM_RING_H_
+#define _RADIO_SHM_RING_H_
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SHM_RING_MAGIC     0x52415231   // "RAR1"
+#define SHM_RING_DATA_LEN  0x100000     // default, power of two
+
+/* Local delivery channel: one producer (radio-proxy) appends records to a
+ * POSIX shared memory ring, any number of local consumers map it read-only
+ * and follow it at their own pace. Consumers never block the producer - a
+ * consumer that falls more than the ring size behind loses data.
+
+ * Layout: header, then the data ring. A record is struct shm_record
+ * followed by its data, padded to SHM_RECORD_ALIGN; records wrap around
+ * the end of the ring. The producer moves reserved past a record before
+ * writing it and head after (publishing), so a consumer can check that
+ * what it has copied was not overwritten in the meantime.               */
+struct shm_ring_header {
+  uint32_t magic;
+  uint32_t data_len;
+  _Atomic uint64_t head;       // end of the last published record
+  _Atomic uint64_t reserved;   // end of the record being written
+  _Atomic uint32_t seq;        // futex word, bumped on every publish
+};
+
+struct shm_record {
+  uint16_t type;
+  uint16_t pad;
+  uint32_t len;
+};
+
+#define SHM_RECORD_ALIGN   8
+#define SHM_RING_HEADER_LEN 64
+
+struct shm_ring {
+  struct shm_ring_header *header;
+  char *data;
+  size_t data_len;
+  size_t map_len;
+  uint64_t pos;            // producer: end of the written data, consumer: next record
+  char *name;              // set for the producer, unlinked on destroy
+  bool notify;             // wake futex waiters on publish
+};
+
+/* producer side - name is a shm_open name, '/' is prepended if missing */
+int shm_ring_create(struct shm_ring *ring, const char *name, size_t data_len);
+
+/* producer over memory owned by the caller (map_len is then 0, nothing is
+ * unmapped and waiters are not woken); a valid ring found there is
+ * continued                                                            */
+int shm_ring_init(struct shm_ring *ring, void *map, size_t data_len);
+
+/* an in-process reader of ring starting at pos (a record boundary) */
+void shm_ring_view(struct shm_ring *reader, const struct shm_ring *ring, uint64_t pos);
+
+uint64_t shm_ring_head(const struct shm_ring *ring);
+
+/* producer side, continues a ring left by a previous producer */
+int shm_ring_attach(struct shm_ring *ring, const char *name);
+
+void shm_ring_destroy(struct shm_ring *ring);
+
+/* appends a record, visible to consumers after shm_ring_publish */
+int shm_ring_write(struct shm_ring *ring, uint16_t type, const void *data, size_t len);
+
+/* publishes everything written and wakes waiting consumers */
+void shm_ring_publish(struct shm_ring *ring);
+
+/* consumer side, starts at the newest data */
+int shm_ring_open(struct shm_ring *ring, const char *name);
+
+void shm_ring_close(struct shm_ring *ring);
+
+/* copies the next record into buffer: returns its length, 0 when nothing
+ * is published yet and -1 with EMSGSIZE for a record longer than len
+ * (which is skipped). Data overwritten before it could be read is skipped
+ * too, *lost is increased then.                                          */
+ssize_t shm_ring_read(struct shm_ring *ring, uint16_t *type, void *buffer, size_t len,
+                      uint64_t *lost);
+
+/* waits at most timeout_ms for data to read, returns 1 if there is some */
+int shm_ring_wait(struct shm_ring *ring, int timeout_ms);
+
+#endif  // _RADIO_SHM_RING_H_
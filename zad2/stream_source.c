@@ -0,0 +1,147 @@
+#define _GNU_SOURCE
+
+#include "stream_source.h"
+
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define PACE_PIECES_PER_SEC  20
+#define PIPE_LEN             0x100000
+
+ssize_t fd_read(struct stream_source *source, void *buffer, size_t len) {
+  ssize_t ret;
+  do {
+    ret = read(source->fd, buffer, len);
+  } while (ret < 0 && errno == EINTR); // e.g. SIGUSR1 trace dump
+  return ret;
+}
+
+void fd_source_init(struct stream_source *source, int fd) {
+  source->read = &fd_read;
+  source->map = NULL;
+  source->fd = fd;
+}
+
+/* how much may go now; waits until the piece is due */
+static size_t pace(struct file_source *file, size_t len) {
+  if (file->bytes_per_sec == 0) return len;
+  len = MIN(len, MAX(file->bytes_per_sec / PACE_PIECES_PER_SEC, 1));
+  uint64_t now = monotonic_us();
+  if (file->start_us == 0) file->start_us = now;
+  uint64_t due = file->start_us + file->delivered * 1000000 / file->bytes_per_sec;
+  if (due > now) usleep(due - now);
+  file->delivered += len;
+  return len;
+}
+
+static ssize_t pipe_read(struct file_source *file, void *buffer, size_t len) {
+  size_t paced = pace(file, len);
+  ssize_t ret = fd_read(&file->base, buffer, paced);
+  if (file->bytes_per_sec > 0) file->delivered -= paced - (ret > 0 ? ret : 0); // a short read
+  return ret;
+}
+
+static ssize_t file_map(struct stream_source *source, char **data, size_t len) {
+  struct file_source *file = (struct file_source *) source;
+  if (file->map) {
+    size_t bytes = pace(file, MIN(len, file->map_len - file->pos));
+    *data = file->map + file->pos;
+    file->pos += bytes;
+    return bytes;
+  }
+  // the caller's limit is for copying, pieces of a pipe can be larger
+  if (file->chunk_pos == file->chunk_len) {
+    ssize_t ret = pipe_read(file, file->chunk, FILE_SOURCE_CHUNK);
+    if (ret <= 0) return ret;
+    file->chunk_pos = 0;
+    file->chunk_len = ret;
+  }
+  *data = file->chunk + file->chunk_pos;
+  size_t bytes = file->chunk_len - file->chunk_pos;
+  file->chunk_pos = file->chunk_len;
+  return bytes;
+}
+
+static ssize_t file_read(struct stream_source *source, void *buffer, size_t len) {
+  struct file_source *file = (struct file_source *) source;
+  if (!file->map && file->chunk_pos == file->chunk_len) return pipe_read(file, buffer, len);
+  char *data;
+  ssize_t bytes = file_map(source, &data, len);
+  if (bytes <= 0) return bytes;
+  if ((size_t) bytes > len) { // what was peeked from a pipe
+    file->chunk_pos -= bytes - len;
+    bytes = len;
+  }
+  memcpy(buffer, data, bytes);
+  return bytes;
+}
+
+ssize_t file_source_peek(struct file_source *source, const char **data, size_t len) {
+  if (source->map) {
+    *data = source->map + source->pos;
+    return MIN(len, source->map_len - source->pos);
+  }
+  len = MIN(len, FILE_SOURCE_CHUNK);
+  if (source->chunk_pos > 0) {
+    source->chunk_len -= source->chunk_pos;
+    memmove(source->chunk, source->chunk + source->chunk_pos, source->chunk_len);
+    source->chunk_pos = 0;
+  }
+  while (source->chunk_len < len) {
+    ssize_t ret = fd_read(&source->base, source->chunk + source->chunk_len,
+                          len - source->chunk_len);
+    if (ret < 0) return -1;
+    if (ret == 0) break;
+    source->chunk_len += ret;
+  }
+  *data = source->chunk;
+  return MIN(len, source->chunk_len);
+}
+
+int file_source_open(struct file_source *source, const char *path, uint64_t bytes_per_sec) {
+  memset(source, 0, sizeof(*source));
+  source->base.read = &file_read;
+  source->base.map = &file_map;
+  source->bytes_per_sec = bytes_per_sec;
+  source->base.fd = strcmp(path, "-") == 0 ? dup(STDIN_FILENO) : open(path, O_RDONLY | O_CLOEXEC);
+  if (source->base.fd < 0) return -1;
+
+  struct stat st;
+  if (fstat(source->base.fd, &st) < 0) goto handle_errors;
+  if (S_ISREG(st.st_mode) && st.st_size > 0) {
+    source->map_len = st.st_size;
+    // private and writable: the data is handed out as char *, but never changed
+    source->map = mmap(NULL, source->map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                       source->base.fd, 0);
+    if (source->map == MAP_FAILED) {
+      source->map = NULL;
+      goto handle_errors;
+    }
+    madvise(source->map, source->map_len, MADV_SEQUENTIAL);
+    return 0;
+  }
+
+  if (S_ISFIFO(st.st_mode)) fcntl(source->base.fd, F_SETPIPE_SZ, PIPE_LEN); // best effort
+  source->chunk = malloc(FILE_SOURCE_CHUNK);
+  if (!source->chunk) goto handle_errors;
+  return 0;
+
+  handle_errors:;
+  int saved_errno = errno;
+  close(source->base.fd);
+  errno = saved_errno;
+  return -1;
+}
+
+void file_source_close(struct file_source *source) {
+  if (source->map) munmap(source->map, source->map_len);
+  free(source->chunk);
+  close(source->base.fd);
+}
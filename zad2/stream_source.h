@@ -0,0 +1,48 @@
+#ifndef _RADIO_STREAM_SOURCE_H_
+#define _RADIO_STREAM_SOURCE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* where the upstream bytes come from, read behaves like read(2); map
+ * (optional) points *data at the next at most len bytes instead of
+ * copying them                                                         */
+struct stream_source {
+  ssize_t (*read)(struct stream_source *source, void *buffer, size_t len);
+  ssize_t (*map)(struct stream_source *source, char **data, size_t len);
+  int fd;
+};
+
+void fd_source_init(struct stream_source *source, int fd);
+
+/* read of fd_source_init sources: plain read(2), so their fd can just as
+ * well be spliced from */
+ssize_t fd_read(struct stream_source *source, void *buffer, size_t len);
+
+#define FILE_SOURCE_CHUNK  0x10000   // reads from pipes
+
+/* A captured stream or raw audio file instead of a server: a regular file
+ * is mapped, anything else (a pipe, "-" for stdin) is read in large
+ * chunks. With bytes_per_sec set the bytes are handed out at that rate,
+ * in pieces of at most 50 ms, otherwise as fast as they are taken.     */
+struct file_source {
+  struct stream_source base;
+  char *map;               // regular files
+  size_t map_len;
+  size_t pos;
+  char *chunk;             // pipes
+  size_t chunk_pos;
+  size_t chunk_len;
+  uint64_t bytes_per_sec;  // 0 - no pacing
+  uint64_t start_us;
+  uint64_t delivered;
+};
+
+int file_source_open(struct file_source *source, const char *path, uint64_t bytes_per_sec);
+
+/* points *data at up to len first bytes without consuming them */
+ssize_t file_source_peek(struct file_source *source, const char **data, size_t len);
+
+void file_source_close(struct file_source *source);
+
+#endif  // _RADIO_STREAM_SOURCE_H_
@@ -0,0 +1,57 @@
+#include "stream_stats.h"
+
+#include "utils.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+void stats_reset(struct stream_stats *stats) {
+  memset(stats, 0, sizeof(*stats));
+}
+
+void stats_record(struct stream_stats *stats, uint64_t arrival_ns, size_t bytes) {
+  if (stats->received > 0 && arrival_ns >= stats->last_arrival_ns) {
+    int64_t gap = arrival_ns - stats->last_arrival_ns;
+    int64_t deviation = gap - stats->mean_gap_ns;
+    if (deviation < 0) deviation = -deviation;
+    // gains as in the RFC 3550 jitter estimator
+    stats->mean_gap_ns += (gap - stats->mean_gap_ns) / 16;
+    stats->jitter_ns += (deviation - stats->jitter_ns) / 16;
+  }
+  stats->last_arrival_ns = arrival_ns;
+  stats->received++;
+
+  if (arrival_ns - stats->window_start_ns >= STATS_WINDOW_NS) {
+    uint64_t elapsed = arrival_ns - stats->window_start_ns;
+    if (stats->window_start_ns != 0)
+      stats->bitrate = stats->window_bytes * 8 * 1000000000ULL / elapsed;
+    stats->window_start_ns = arrival_ns;
+    stats->window_bytes = 0;
+  }
+  stats->window_bytes += bytes;
+}
+
+void stats_add_lost(struct stream_stats *stats, uint64_t lost) {
+  stats->lost += lost;
+}
+
+size_t stats_format(const struct stream_stats *stats, uint64_t now_ns,
+                    long output_backlog, char *buffer, size_t buffer_len) {
+  uint64_t total = stats->received + stats->lost;
+  uint64_t loss_permille = total ? stats->lost * 1000 / total : 0;
+  uint64_t age_ms = stats->received && now_ns > stats->last_arrival_ns
+                  ? (now_ns - stats->last_arrival_ns) / 1000000 : 0;
+  int ret = snprintf(buffer, buffer_len,
+                     "%" PRIu64 " kbit/s, loss %" PRIu64 " (%" PRIu64 ".%" PRIu64 "%%), "
+                     "jitter %" PRId64 ".%" PRId64 " ms, age %" PRIu64 " ms",
+                     stats->bitrate / 1000, stats->lost, loss_permille / 10, loss_permille % 10,
+                     stats->jitter_ns / 1000000, stats->jitter_ns / 100000 % 10, age_ms);
+  if (ret < 0) return 0;
+  size_t len = MIN((size_t) ret, buffer_len - 1);
+  if (output_backlog >= 0) {
+    ret = snprintf(buffer + len, buffer_len - len, ", backlog %ld B", output_backlog);
+    if (ret > 0) len = MIN(len + ret, buffer_len - 1);
+  }
+  return len;
+}
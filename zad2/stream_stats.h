@@ -0,0 +1,32 @@
+#ifndef _RADIO_STREAM_STATS_H_
+#define _RADIO_STREAM_STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define STATS_WINDOW_NS  1000000000ULL   // bitrate is measured over 1 s windows
+
+/* health of the stream received from one proxy, updated per datagram */
+struct stream_stats {
+  uint64_t received;       // datagrams
+  uint64_t lost;           // datagrams known to be lost
+  uint64_t window_start_ns;
+  uint64_t window_bytes;
+  uint64_t bitrate;        // bits per second in the last full window
+  uint64_t last_arrival_ns;
+  int64_t mean_gap_ns;     // smoothed inter-arrival time
+  int64_t jitter_ns;       // smoothed deviation from mean_gap_ns
+};
+
+void stats_reset(struct stream_stats *stats);
+
+/* arrival_ns - kernel receive timestamp (any clock, only differences count) */
+void stats_record(struct stream_stats *stats, uint64_t arrival_ns, size_t bytes);
+
+void stats_add_lost(struct stream_stats *stats, uint64_t lost);
+
+/* one line summary, output_backlog < 0 if unknown */
+size_t stats_format(const struct stream_stats *stats, uint64_t now_ns,
+                    long output_backlog, char *buffer, size_t buffer_len);
+
+#endif  // _RADIO_STREAM_STATS_H_
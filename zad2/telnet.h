@@ -1,6 +1,8 @@
 #ifndef _RADIO_TELNET_H_
 #define _RADIO_TELNET_H_
 
+#include <sys/types.h>
+
 /* telnet commands list
  * from https://www.ibm.com/support/knowledgecenter/SSLTBW_2.4.0/com.ibm.zos.v2r4.hald001/telcmds.htm#telcmds__rfc854
  */
@@ -46,17 +48,19 @@
 #define DOWN  1
 #define CRLF  2
 
-const char *message[] = {
+#define UNUSED __attribute__((unused))
+
+static UNUSED const char *message[] = {
   "\x1b\x5b\x41",
   "\x1b\x5b\x42",
   "\xd\x0"
 };
 
-const ssize_t msg_len[] = {3, 3, 2};
+static UNUSED const ssize_t msg_len[] = {3, 3, 2};
 
-const char *szukaj = "Szukaj pośrednika";
-const char *posrednik = "Pośrednik ";
-const char *koniec = "Koniec";
+static UNUSED const char *szukaj = "Szukaj pośrednika";
+static UNUSED const char *posrednik = "Pośrednik ";
+static UNUSED const char *koniec = "Koniec";
 
 #define SZUKAJ_LEN      18
 #define POSREDNIK_LEN   11
@@ -0,0 +1,175 @@
+#define _GNU_SOURCE
+
+#include "thread_layout.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#define MAX_SPECS          16
+#define DEFAULT_FIFO_PRIO  10
+#define CPULIST_LEN        0x400
+
+struct spec {
+  char who[16];
+  bool pin;
+  cpu_set_t cpus;
+  bool fifo;
+  int prio;
+};
+
+static struct spec specs[MAX_SPECS];
+static unsigned spec_count = 0;
+static bool report = false;
+// threads inherit placement from their creator, those without a spec go back to it
+static cpu_set_t initial_cpus;
+static int initial_policy;     // e.g. SCHED_RR or SCHED_BATCH from chrt
+static struct sched_param initial_param;
+static bool initial_saved = false;
+
+static _Thread_local const char *thread_name = NULL;
+
+/* "0-3,6" */
+static int parse_cpus(const char *list, cpu_set_t *cpus) {
+  CPU_ZERO(cpus);
+  while (*list != '\0' && *list != '\n') {
+    char *end;
+    long first = strtol(list, &end, 10), last = first;
+    if (end == list) return -1;
+    if (*end == '-') {
+      list = end + 1;
+      last = strtol(list, &end, 10);
+      if (end == list) return -1;
+    }
+    if (first < 0 || last < first || last >= CPU_SETSIZE) return -1;
+    for (long cpu = first; cpu <= last; ++cpu) CPU_SET(cpu, cpus);
+    list = end;
+    if (*list == ',') list++;
+    else if (*list != '\0' && *list != '\n') return -1;
+  }
+  return CPU_COUNT(cpus) > 0 ? 0 : -1;
+}
+
+/* CPUs of the NIC's NUMA node, as the kernel lists them */
+static int nic_cpus(const char *ifname, cpu_set_t *cpus) {
+  char path[CPULIST_LEN + 64], list[CPULIST_LEN];
+  snprintf(path, sizeof(path), "/sys/class/net/%s/device/local_cpulist", ifname);
+  FILE *file = fopen(path, "r");
+  if (!file) return -1;
+  bool ok = fgets(list, sizeof(list), file) != NULL;
+  fclose(file);
+  if (!ok) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (parse_cpus(list, cpus) < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+int thread_layout_add(const char *spec) {
+  if (!initial_saved) {
+    if (sched_getaffinity(0, sizeof(initial_cpus), &initial_cpus) < 0) return -1;
+    int err = pthread_getschedparam(pthread_self(), &initial_policy, &initial_param);
+    if (err != 0) {
+      errno = err;
+      return -1;
+    }
+    initial_saved = true;
+  }
+  report = true;
+  if (strcmp(spec, "report") == 0) return 0;
+
+  const char *eq = strchr(spec, '=');
+  if (!eq || eq == spec || (size_t) (eq - spec) >= sizeof(specs[0].who)) goto wrong;
+  if (spec_count == MAX_SPECS) goto wrong;
+  struct spec *s = &specs[spec_count];
+  memset(s, 0, sizeof(*s));
+  memcpy(s->who, spec, eq - spec);
+
+  char cpus[CPULIST_LEN];
+  const char *colon = strchr(eq + 1, ':');
+  size_t cpus_len = colon ? (size_t) (colon - eq - 1) : strlen(eq + 1);
+  if (cpus_len >= sizeof(cpus)) goto wrong;
+  memcpy(cpus, eq + 1, cpus_len);
+  cpus[cpus_len] = '\0';
+  if (cpus[0] == '@') {
+    if (nic_cpus(cpus + 1, &s->cpus) < 0) {
+      fprintf(stderr, "thread layout: no CPUs of %s: %s\n", cpus + 1, strerror(errno));
+      return -1;
+    }
+    s->pin = true;
+  } else if (cpus[0] != '\0') {
+    if (parse_cpus(cpus, &s->cpus) < 0) goto wrong;
+    s->pin = true;
+  }
+
+  if (colon) {
+    if (strncmp(colon + 1, "fifo", 4) != 0) goto wrong;
+    s->fifo = true;
+    s->prio = DEFAULT_FIFO_PRIO;
+    if (colon[5] == '=') {
+      char *end;
+      s->prio = strtol(colon + 6, &end, 10);
+      if (*end != '\0' || s->prio < sched_get_priority_min(SCHED_FIFO) ||
+          s->prio > sched_get_priority_max(SCHED_FIFO))
+        goto wrong;
+    } else if (colon[5] != '\0') {
+      goto wrong;
+    }
+  }
+  spec_count++;
+  return 0;
+
+  wrong:
+  fprintf(stderr, "thread layout: bad spec '%s' (who=cpus[:fifo[=prio]])\n", spec);
+  return -1;
+}
+
+static const struct spec *find_spec(const char *who) {
+  for (unsigned i = 0; i < spec_count; ++i)
+    if (strcmp(specs[i].who, who) == 0) return &specs[i];
+  return NULL;
+}
+
+void thread_enter(const char *name, int plane) {
+  thread_name = name;
+  pthread_setname_np(pthread_self(), name); // for top -H, best effort
+  if (!initial_saved) return; // no layout
+
+  const struct spec *spec = find_spec(name);
+  if (!spec) spec = find_spec(plane == THREAD_DATA ? "data" : "control");
+
+  const cpu_set_t *cpus = spec && spec->pin ? &spec->cpus : &initial_cpus;
+  int err = pthread_setaffinity_np(pthread_self(), sizeof(*cpus), cpus);
+  if (err != 0) fprintf(stderr, "thread %s: affinity: %s\n", name, strerror(err));
+
+  bool fifo = spec && spec->fifo;
+  struct sched_param param = fifo ? (struct sched_param) {spec->prio} : initial_param;
+  err = pthread_setschedparam(pthread_self(), fifo ? SCHED_FIFO : initial_policy, &param);
+  if (err != 0)
+    fprintf(stderr, "thread %s: %s: %s\n", name, fifo ? "SCHED_FIFO" : "scheduling", strerror(err));
+}
+
+void thread_leave(void) {
+  if (!report) return;
+  struct timespec cpu;
+  struct rusage usage;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu) < 0 || getrusage(RUSAGE_THREAD, &usage) < 0)
+    return;
+  // involuntary switches show how often it was pushed off its CPU
+  fprintf(stderr,
+          "thread %s: cpu %.3f s (user %.3f, sys %.3f), switches %ld/%ld invol, on cpu %d\n",
+          thread_name ? thread_name : "?", cpu.tv_sec + cpu.tv_nsec / 1e9,
+          usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6,
+          usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6,
+          usage.ru_nvcsw + usage.ru_nivcsw, usage.ru_nivcsw, sched_getcpu());
+}
@@ -0,0 +1,27 @@
+#ifndef _RADIO_THREAD_LAYOUT_H_
+#define _RADIO_THREAD_LAYOUT_H_
+
+/* Where threads run. A layout is a list of specs "who=cpus[:fifo[=prio]]"
+ * (one per -X option): who is a thread name or a plane ("data" - threads
+ * moving audio, "control" - the rest), cpus is a list like "0-3,6", or
+ * "@ifname" for the CPUs local to that NIC, or empty to leave affinity
+ * alone; ":fifo" runs the thread with SCHED_FIFO. A spec naming a thread
+ * wins over its plane. "report" alone only turns reporting on.
+ *
+ * Every thread calls thread_enter when it starts and thread_leave when it
+ * ends; with any layout given thread_leave reports on stderr the CPU time
+ * the thread has used.                                                  */
+
+#define THREAD_CONTROL  0
+#define THREAD_DATA     1
+
+/* -1 (with a message on stderr) if spec is wrong */
+int thread_layout_add(const char *spec);
+
+/* name has to be a string literal (only the pointer is stored); failing
+ * placement (e.g. no permission for SCHED_FIFO) is reported, not fatal */
+void thread_enter(const char *name, int plane);
+
+void thread_leave(void);
+
+#endif  // _RADIO_THREAD_LAYOUT_H_
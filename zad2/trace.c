@@ -0,0 +1,168 @@
+#define _GNU_SOURCE
+
+#include "trace.h"
+
+#ifdef RADIO_TRACE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_RING_LEN     0x4000   // events per thread, power of two
+#define TRACE_MAX_THREADS  64
+// events this close to being overwritten are skipped by the dump
+#define TRACE_DUMP_MARGIN  0x400
+#define DUMP_BUFFER_LEN    0x4000
+
+struct trace_event {
+  uint64_t ts_ns;
+  const char *name;
+  char phase;
+};
+
+struct trace_ring {
+  _Atomic uint64_t head;   // number of events ever written
+  uint32_t tid;
+  struct trace_event events[TRACE_RING_LEN];
+};
+
+static struct trace_ring *_Atomic rings[TRACE_MAX_THREADS];
+static _Atomic unsigned ring_count = 0;
+static _Thread_local struct trace_ring *thread_ring = NULL;
+static _Thread_local bool thread_ring_failed = false;
+
+static struct trace_ring *register_thread(void) {
+  if (thread_ring_failed) return NULL;
+  thread_ring_failed = true;
+  unsigned index = atomic_fetch_add(&ring_count, 1);
+  if (index >= TRACE_MAX_THREADS) return NULL;
+  struct trace_ring *ring = calloc(1, sizeof(struct trace_ring));
+  if (!ring) return NULL;
+  ring->tid = syscall(SYS_gettid);
+  atomic_store_explicit(&rings[index], ring, memory_order_release);
+  thread_ring_failed = false;
+  return thread_ring = ring;
+}
+
+void trace_event(const char *name, char phase) {
+  struct trace_ring *ring = thread_ring;
+  if (!ring && !(ring = register_thread())) return;
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  struct trace_event *event = &ring->events[head & (TRACE_RING_LEN - 1)];
+  event->ts_ns = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+  event->name = name;
+  event->phase = phase;
+  atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/* everything below runs in the signal handler - only write(2) is used */
+
+struct dump {
+  int fd;
+  size_t len;
+  char buffer[DUMP_BUFFER_LEN];
+};
+
+static void dump_flush(struct dump *dump) {
+  size_t pos = 0;
+  while (pos < dump->len) {
+    ssize_t ret = write(dump->fd, dump->buffer + pos, dump->len - pos);
+    if (ret <= 0) break;
+    pos += ret;
+  }
+  dump->len = 0;
+}
+
+static void dump_str(struct dump *dump, const char *str) {
+  for (; *str; ++str) {
+    if (dump->len == DUMP_BUFFER_LEN) dump_flush(dump);
+    dump->buffer[dump->len++] = *str;
+  }
+}
+
+static void dump_uint(struct dump *dump, uint64_t value, int min_digits) {
+  char digits[24];
+  int n = 0;
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value > 0 || n < min_digits);
+  char str[25];
+  for (int i = 0; i < n; ++i) str[i] = digits[n - 1 - i];
+  str[n] = '\0';
+  dump_str(dump, str);
+}
+
+static void dump_rings(int signum __attribute__((unused))) {
+  int saved_errno = errno;
+  static struct dump dump; // not on the (possibly small) signal stack
+
+  char path[64] = "radio-trace-";
+  size_t path_len = strlen(path);
+  char pid[24];
+  int n = 0;
+  for (pid_t p = getpid(); p > 0; p /= 10) pid[n++] = '0' + p % 10;
+  while (n > 0) path[path_len++] = pid[--n];
+  memcpy(path + path_len, ".json", 6);
+
+  dump.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (dump.fd < 0) goto end;
+  dump.len = 0;
+
+  dump_str(&dump, "{\"traceEvents\":[");
+  bool first = true;
+  unsigned count = atomic_load(&ring_count);
+  for (unsigned r = 0; r < count && r < TRACE_MAX_THREADS; ++r) {
+    struct trace_ring *ring = atomic_load_explicit(&rings[r], memory_order_acquire);
+    if (!ring) continue;
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t begin = head > TRACE_RING_LEN - TRACE_DUMP_MARGIN
+                   ? head - (TRACE_RING_LEN - TRACE_DUMP_MARGIN) : 0;
+    for (uint64_t i = begin; i < head; ++i) {
+      const struct trace_event *event = &ring->events[i & (TRACE_RING_LEN - 1)];
+      char phase[2] = {event->phase, '\0'};
+      dump_str(&dump, first ? "\n{\"name\":\"" : ",\n{\"name\":\"");
+      dump_str(&dump, event->name);
+      dump_str(&dump, "\",\"ph\":\"");
+      dump_str(&dump, phase);
+      dump_str(&dump, event->phase == 'i' ? "\",\"s\":\"t\",\"ts\":" : "\",\"ts\":");
+      dump_uint(&dump, event->ts_ns / 1000, 1);
+      dump_str(&dump, ".");
+      dump_uint(&dump, event->ts_ns % 1000, 3);
+      dump_str(&dump, ",\"pid\":");
+      dump_uint(&dump, getpid(), 1);
+      dump_str(&dump, ",\"tid\":");
+      dump_uint(&dump, ring->tid, 1);
+      dump_str(&dump, "}");
+      first = false;
+    }
+  }
+  dump_str(&dump, "\n]}\n");
+  dump_flush(&dump);
+  close(dump.fd);
+
+  end:
+  errno = saved_errno;
+}
+
+int trace_init(void) {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = &dump_rings;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  return sigaction(SIGUSR1, &action, NULL);
+}
+
+#endif  // RADIO_TRACE
@@ -0,0 +1,30 @@
+#ifndef _RADIO_TRACE_H_
+#define _RADIO_TRACE_H_
+
+/* Hot path trace points, compiled in only with -DRADIO_TRACE (make TRACE=1).
+ * Every thread records fixed-size timestamped events into its own ring
+ * (single writer, no locks); SIGUSR1 dumps all rings to
+ * radio-trace-<pid>.json in the Chrome trace event format.            */
+
+#ifdef RADIO_TRACE
+
+#define TRACE_INIT()         trace_init()
+#define TRACE_BEGIN(name)    trace_event(name, 'B')
+#define TRACE_END(name)      trace_event(name, 'E')
+#define TRACE_INSTANT(name)  trace_event(name, 'i')
+
+int trace_init(void);
+
+/* name has to be a string literal (only the pointer is stored) */
+void trace_event(const char *name, char phase);
+
+#else
+
+#define TRACE_INIT()         0
+#define TRACE_BEGIN(name)    ((void) 0)
+#define TRACE_END(name)      ((void) 0)
+#define TRACE_INSTANT(name)  ((void) 0)
+
+#endif  // RADIO_TRACE
+
+#endif  // _RADIO_TRACE_H_
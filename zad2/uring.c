@@ -0,0 +1,239 @@
+#include "uring.h"
+
+#include <errno.h>
+#include <linux/time_types.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define RECV_BUFFER_GROUP  0
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+                          const void *arg, size_t argsz) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+int uring_init(struct uring *ring, unsigned entries) {
+  struct io_uring_params params;
+  memset(ring, 0, sizeof(*ring));
+  memset(&params, 0, sizeof(params));
+  ring->fd = io_uring_setup(entries, &params);
+  if (ring->fd < 0) return -1;
+  // one mapping for both rings (5.4+), EXT_ARG for timed waits (5.11+)
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+    close(ring->fd);
+    errno = ENOSYS;
+    return -1;
+  }
+
+  size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->ring_map_len = sq_len > cq_len ? sq_len : cq_len;
+  ring->ring_map = mmap(NULL, ring->ring_map_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->ring_map == MAP_FAILED) goto handle_errors;
+  ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    munmap(ring->ring_map, ring->ring_map_len);
+    goto handle_errors;
+  }
+
+  char *map = ring->ring_map;
+  ring->entries = params.sq_entries;
+  ring->sq_head = (_Atomic unsigned *) (map + params.sq_off.head);
+  ring->sq_tail = (_Atomic unsigned *) (map + params.sq_off.tail);
+  ring->sq_mask = *(unsigned *) (map + params.sq_off.ring_mask);
+  ring->cq_head = (_Atomic unsigned *) (map + params.cq_off.head);
+  ring->cq_tail = (_Atomic unsigned *) (map + params.cq_off.tail);
+  ring->cq_mask = *(unsigned *) (map + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (map + params.cq_off.cqes);
+  // sqes are always submitted in order, so the indirection array is fixed
+  unsigned *array = (unsigned *) (map + params.sq_off.array);
+  for (unsigned i = 0; i < params.sq_entries; ++i) array[i] = i;
+  ring->sqe_tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+  return 0;
+
+  handle_errors:;
+  int saved_errno = errno;
+  close(ring->fd);
+  errno = saved_errno;
+  return -1;
+}
+
+void uring_destroy(struct uring *ring) {
+  if (!ring->sqes) return;
+  munmap(ring->sqes, ring->sqes_len);
+  munmap(ring->ring_map, ring->ring_map_len);
+  close(ring->fd);
+  ring->sqes = NULL;
+}
+
+unsigned uring_sq_space(const struct uring *ring) {
+  unsigned head = atomic_load_explicit(ring->sq_head, memory_order_acquire);
+  return ring->entries - (ring->sqe_tail - head);
+}
+
+struct io_uring_sqe *uring_sqe(struct uring *ring) {
+  if (uring_sq_space(ring) == 0) return NULL;
+  struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sqe_tail++;
+  return sqe;
+}
+
+int uring_enter(struct uring *ring, unsigned wait_nr, int timeout_ms) {
+  atomic_store_explicit(ring->sq_tail, ring->sqe_tail, memory_order_release);
+  unsigned to_submit = ring->sqe_tail - atomic_load_explicit(ring->sq_head, memory_order_acquire);
+  unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+  struct __kernel_timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000LL};
+  struct io_uring_getevents_arg arg = {0, 0, 0, (uint64_t) (uintptr_t) &ts};
+  if (wait_nr > 0 && timeout_ms >= 0) {
+    flags |= IORING_ENTER_EXT_ARG;
+    if (io_uring_enter(ring->fd, to_submit, wait_nr, flags, &arg, sizeof(arg)) < 0)
+      return errno == ETIME ? 0 : -1;
+    return 1;
+  }
+  return io_uring_enter(ring->fd, to_submit, wait_nr, flags, NULL, 0) < 0 ? -1 : 1;
+}
+
+struct io_uring_cqe *uring_cqe(struct uring *ring) {
+  unsigned head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+  if (head == atomic_load_explicit(ring->cq_tail, memory_order_acquire)) return NULL;
+  return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(struct uring *ring) {
+  unsigned head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+  atomic_store_explicit(ring->cq_head, head + 1, memory_order_release);
+}
+
+int uring_register(struct uring *ring, unsigned opcode, const void *arg, unsigned nr) {
+  return syscall(__NR_io_uring_register, ring->fd, opcode, arg, nr) < 0 ? -1 : 0;
+}
+
+/* ---- multishot receive ---- */
+
+static void provide_buffer(struct uring_receiver *receiver, unsigned short id) {
+  struct io_uring_buf_ring *buffer_ring = receiver->buffer_ring;
+  _Atomic uint16_t *tail = (_Atomic uint16_t *) &buffer_ring->tail;
+  uint16_t pos = atomic_load_explicit(tail, memory_order_relaxed);
+  struct io_uring_buf *buffer = &buffer_ring->bufs[pos & (URING_RECV_BUFFERS - 1)];
+  buffer->addr = (uint64_t) (uintptr_t) (receiver->buffers + (size_t) id * receiver->buffer_len);
+  buffer->len = receiver->buffer_len;
+  buffer->bid = id;
+  atomic_store_explicit(tail, pos + 1, memory_order_release);
+}
+
+static int arm(struct uring_receiver *receiver) {
+  struct io_uring_sqe *sqe = uring_sqe(&receiver->ring);
+  if (!sqe) {
+    errno = EBUSY;
+    return -1;
+  }
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = receiver->sock;
+  sqe->addr = (uint64_t) (uintptr_t) &receiver->msg;
+  sqe->len = 1;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = RECV_BUFFER_GROUP;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  receiver->armed = true;
+  return 0;
+}
+
+int uring_receiver_init(struct uring_receiver *receiver, int sock) {
+  memset(receiver, 0, sizeof(*receiver));
+  if (uring_init(&receiver->ring, 8) < 0) return -1;
+  receiver->sock = sock;
+  receiver->buffer_len = sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_in) +
+                         URING_RECV_BUFFER_LEN;
+  receiver->buffer_ring_len = URING_RECV_BUFFERS * sizeof(struct io_uring_buf);
+  receiver->buffer_ring = mmap(NULL, receiver->buffer_ring_len, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (receiver->buffer_ring == MAP_FAILED) goto handle_errors_ring;
+  receiver->buffers = mmap(NULL, URING_RECV_BUFFERS * receiver->buffer_len,
+                           PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (receiver->buffers == MAP_FAILED) goto handle_errors_buffer_ring;
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t) (uintptr_t) receiver->buffer_ring;
+  reg.ring_entries = URING_RECV_BUFFERS;
+  reg.bgid = RECV_BUFFER_GROUP;
+  if (uring_register(&receiver->ring, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    goto handle_errors_buffers;
+  for (unsigned short i = 0; i < URING_RECV_BUFFERS; ++i) provide_buffer(receiver, i);
+
+  // only the sender's address (no control data) lands in front of the payload
+  receiver->msg.msg_namelen = sizeof(struct sockaddr_in);
+  return 0;
+
+  handle_errors_buffers:;
+  int saved_errno = errno;
+  munmap(receiver->buffers, URING_RECV_BUFFERS * receiver->buffer_len);
+  errno = saved_errno;
+  handle_errors_buffer_ring:
+  saved_errno = errno;
+  munmap(receiver->buffer_ring, receiver->buffer_ring_len);
+  errno = saved_errno;
+  handle_errors_ring:
+  saved_errno = errno;
+  uring_destroy(&receiver->ring);
+  errno = saved_errno;
+  return -1;
+}
+
+void uring_receiver_destroy(struct uring_receiver *receiver) {
+  uring_destroy(&receiver->ring); // cancels the pending receive
+  munmap(receiver->buffers, URING_RECV_BUFFERS * receiver->buffer_len);
+  munmap(receiver->buffer_ring, receiver->buffer_ring_len);
+}
+
+ssize_t uring_recvfrom(struct uring_receiver *receiver, void *buffer, size_t len,
+                       struct sockaddr_in *address, int timeout_ms) {
+  for (;;) {
+    struct io_uring_cqe *cqe = uring_cqe(&receiver->ring);
+    if (!cqe) {
+      if (!receiver->armed && arm(receiver) < 0) return -1;
+      int ret = uring_enter(&receiver->ring, 1, timeout_ms);
+      if (ret < 0 && errno != EINTR) return -1;
+      if (ret <= 0) {
+        errno = EAGAIN;
+        return -1;
+      }
+      continue;
+    }
+
+    int res = cqe->res;
+    unsigned flags = cqe->flags;
+    uring_cqe_seen(&receiver->ring);
+    if (!(flags & IORING_CQE_F_MORE)) receiver->armed = false; // re-armed on the next wait
+    if (res < 0) {
+      if (res == -ENOBUFS) continue; // all buffers were taken, they are back by now
+      errno = -res;
+      return -1;
+    }
+    if (!(flags & IORING_CQE_F_BUFFER)) continue;
+
+    unsigned short id = flags >> IORING_CQE_BUFFER_SHIFT;
+    char *data = receiver->buffers + (size_t) id * receiver->buffer_len;
+    struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *) data;
+    size_t header_len = sizeof(*out) + receiver->msg.msg_namelen;
+    size_t payload_len = (size_t) res > header_len ? res - header_len : 0;
+    if (payload_len > out->payloadlen) payload_len = out->payloadlen;
+    if (payload_len > len) payload_len = len;
+    memcpy(address, data + sizeof(*out), sizeof(*address));
+    memcpy(buffer, data + header_len, payload_len);
+    provide_buffer(receiver, id);
+    return payload_len;
+  }
+}
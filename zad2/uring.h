@@ -0,0 +1,80 @@
+#ifndef _RADIO_URING_H_
+#define _RADIO_URING_H_
+
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+/* A minimal io_uring, set up with raw syscalls (no liburing). Used by one
+ * thread at a time: sqes are prepared with uring_sqe, submitted (and
+ * waited for) with uring_enter, completions are taken with uring_cqe and
+ * uring_cqe_seen. uring_init fails with ENOSYS (or EPERM when disabled)
+ * on kernels without io_uring - the callers fall back to plain syscalls. */
+struct uring {
+  int fd;
+  unsigned entries;
+  _Atomic unsigned *sq_head;
+  _Atomic unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned sqe_tail;       // prepared, published to sq_tail on uring_enter
+  struct io_uring_sqe *sqes;
+  _Atomic unsigned *cq_head;
+  _Atomic unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  void *ring_map;
+  size_t ring_map_len;
+  size_t sqes_len;
+};
+
+int uring_init(struct uring *ring, unsigned entries);
+
+void uring_destroy(struct uring *ring);
+
+/* a zeroed sqe, NULL if the submission queue is full */
+struct io_uring_sqe *uring_sqe(struct uring *ring);
+
+/* how many sqes can be prepared before submitting */
+unsigned uring_sq_space(const struct uring *ring);
+
+/* submits the prepared sqes and waits for at least wait_nr completions,
+ * at most timeout_ms (-1 - no limit); 0 on timeout                     */
+int uring_enter(struct uring *ring, unsigned wait_nr, int timeout_ms);
+
+/* the oldest completion not seen yet, NULL if there is none */
+struct io_uring_cqe *uring_cqe(struct uring *ring);
+
+void uring_cqe_seen(struct uring *ring);
+
+int uring_register(struct uring *ring, unsigned opcode, const void *arg, unsigned nr);
+
+/* Datagrams of sock received by a single multishot RECVMSG into a ring
+ * of provided buffers - one submission serves any number of packets.
+ * Needs a 6.0+ kernel, uring_receiver_init fails on older ones.         */
+struct uring_receiver {
+  struct uring ring;
+  int sock;
+  struct io_uring_buf_ring *buffer_ring;
+  size_t buffer_ring_len;
+  char *buffers;
+  size_t buffer_len;
+  struct msghdr msg;
+  bool armed;
+};
+
+#define URING_RECV_BUFFERS     64
+#define URING_RECV_BUFFER_LEN  0x800
+
+int uring_receiver_init(struct uring_receiver *receiver, int sock);
+
+void uring_receiver_destroy(struct uring_receiver *receiver);
+
+/* like recvfrom(2), -1 with EAGAIN when nothing came within timeout_ms;
+ * longer datagrams are truncated to URING_RECV_BUFFER_LEN               */
+ssize_t uring_recvfrom(struct uring_receiver *receiver, void *buffer, size_t len,
+                       struct sockaddr_in *address, int timeout_ms);
+
+#endif  // _RADIO_URING_H_
@@ -10,4 +10,10 @@
 
 uint16_t convert(const char *num);
 
+// CLOCK_MONOTONIC in microseconds
+uint64_t monotonic_us(void);
+
+// CLOCK_REALTIME in microseconds, comparable between hosts
+uint64_t realtime_us(void);
+
 #endif  // _RADIO_UTILS_H_
@@ -0,0 +1,301 @@
+#include "xdp_tx.h"
+
+#include "utils.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/if_xdp.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <net/route.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifndef SOL_XDP
+#define SOL_XDP  283
+#endif
+
+#define IP_OFFSET   ETH_HLEN
+#define UDP_OFFSET  (IP_OFFSET + sizeof(struct iphdr))
+#define XDP_KICKS   256      // copy mode sends a few dozen frames per kick
+
+/* the route to address (longest prefix, then metric) has to go out
+ * through our interface; the next hop is its gateway, if it has one */
+static bool next_hop(const struct xdp_tx *xdp, in_addr_t address, in_addr_t *hop) {
+  FILE *file = fopen("/proc/net/route", "r");
+  if (!file) return false;
+  char line[256], best_iface[IF_NAMESIZE] = "";
+  int best_prefix = -1, best_metric = 0;
+  while (fgets(line, sizeof(line), file)) {
+    char iface[IF_NAMESIZE];
+    unsigned destination, gateway, flags, mask;
+    int metric;
+    // addresses are printed as they are in memory, so they compare with s_addr
+    if (sscanf(line, "%15s %x %x %x %*d %*d %d %x", iface, &destination, &gateway, &flags,
+               &metric, &mask) != 6 || !(flags & RTF_UP) || (address & mask) != destination)
+      continue;
+    int prefix = __builtin_popcount(mask);
+    if (prefix > best_prefix || (prefix == best_prefix && metric < best_metric)) {
+      best_prefix = prefix;
+      best_metric = metric;
+      strcpy(best_iface, iface);
+      *hop = flags & RTF_GATEWAY ? gateway : address;
+    }
+  }
+  fclose(file);
+  return best_prefix >= 0 && strcmp(best_iface, xdp->ifname) == 0;
+}
+
+/* a resolved neighbour on our interface; clients have just talked to
+ * the proxy through the kernel, so it normally is                   */
+static bool neighbour(const struct xdp_tx *xdp, in_addr_t hop, unsigned char *mac) {
+  FILE *file = fopen("/proc/net/arp", "r");
+  if (!file) return false;
+  char line[256];
+  bool found = false;
+  while (!found && fgets(line, sizeof(line), file)) {
+    char ip[INET_ADDRSTRLEN], hw[18], device[IF_NAMESIZE];
+    unsigned flags;
+    struct in_addr address;
+    found = sscanf(line, "%15s %*x %x %17s %*s %15s", ip, &flags, hw, device) == 4 &&
+            (flags & ATF_COM) && strcmp(device, xdp->ifname) == 0 &&
+            inet_pton(AF_INET, ip, &address) == 1 && address.s_addr == hop &&
+            sscanf(hw, "%hhx:%hhx:%hhx:%hhx:%hhx:%hhx", &mac[0], &mac[1], &mac[2], &mac[3],
+                   &mac[4], &mac[5]) == 6;
+  }
+  fclose(file);
+  return found;
+}
+
+struct xdp_peer *xdp_peer_create(const struct xdp_tx *xdp, const struct sockaddr_in *address) {
+  struct xdp_peer *peer = calloc(1, sizeof(struct xdp_peer));
+  if (!peer) return NULL;
+  in_addr_t hop = 0;
+  unsigned char mac[ETH_ALEN];
+  peer->reachable = next_hop(xdp, address->sin_addr.s_addr, &hop) &&
+                    neighbour(xdp, hop, mac);
+  if (!peer->reachable) return peer;
+
+  struct ether_header eth;
+  memcpy(eth.ether_dhost, mac, ETH_ALEN);
+  memcpy(eth.ether_shost, xdp->mac, ETH_ALEN);
+  eth.ether_type = htons(ETHERTYPE_IP);
+  struct iphdr ip = {
+    .version = 4,
+    .ihl = sizeof(struct iphdr) / 4,
+    .frag_off = htons(IP_DF),  // so the id can stay 0
+    .ttl = IPDEFTTL,
+    .protocol = IPPROTO_UDP,
+    .saddr = xdp->source.sin_addr.s_addr,
+    .daddr = address->sin_addr.s_addr,
+  };
+  // the UDP checksum is optional over IPv4, computing it would mean reading the payload
+  struct udphdr udp = {.source = xdp->source.sin_port, .dest = address->sin_port};
+  memcpy(peer->headers, &eth, ETH_HLEN);
+  memcpy(peer->headers + IP_OFFSET, &ip, sizeof(ip));
+  memcpy(peer->headers + UDP_OFFSET, &udp, sizeof(udp));
+
+  const unsigned char *bytes = peer->headers + IP_OFFSET;
+  for (size_t i = 0; i < sizeof(ip); i += 2) peer->checksum += bytes[i] << 8 | bytes[i + 1];
+  return peer;
+}
+
+static int ring_map(int fd, const struct xdp_ring_offset *offsets, size_t desc_len,
+                    unsigned size, off_t pgoff, struct xdp_ring *ring, void **map,
+                    size_t *map_len) {
+  *map_len = offsets->desc + size * desc_len;
+  *map = mmap(NULL, *map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, pgoff);
+  if (*map == MAP_FAILED) {
+    *map = NULL;
+    return -1;
+  }
+  ring->producer = (_Atomic unsigned *) ((char *) *map + offsets->producer);
+  ring->consumer = (_Atomic unsigned *) ((char *) *map + offsets->consumer);
+  ring->flags = (_Atomic unsigned *) ((char *) *map + offsets->flags);
+  ring->descs = (char *) *map + offsets->desc;
+  ring->mask = size - 1;
+  return 0;
+}
+
+int xdp_tx_init(struct xdp_tx *xdp, const char *ifname, uint32_t queue, int sock) {
+  memset(xdp, 0, sizeof(*xdp));
+  xdp->fd = -1;
+  if (strlen(ifname) >= sizeof(xdp->ifname)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(xdp->ifname, ifname);
+  xdp->ifindex = if_nametoindex(ifname);
+  socklen_t source_len = sizeof(xdp->source);
+  if (xdp->ifindex == 0 ||
+      getsockname(sock, (struct sockaddr *) &xdp->source, &source_len) < 0)
+    return -1;
+
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  strcpy(ifr.ifr_name, ifname);
+  int ctl = socket(AF_INET, SOCK_DGRAM, 0);
+  if (ctl < 0) return -1;
+  if (ioctl(ctl, SIOCGIFHWADDR, &ifr) < 0) goto handle_ctl_errors;
+  memcpy(xdp->mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+  // a socket bound to any address sends from the interface's
+  if (xdp->source.sin_addr.s_addr == htonl(INADDR_ANY)) {
+    if (ioctl(ctl, SIOCGIFADDR, &ifr) < 0) goto handle_ctl_errors;
+    xdp->source.sin_addr = ((struct sockaddr_in *) &ifr.ifr_addr)->sin_addr;
+  }
+  close(ctl);
+
+  xdp->fd = socket(AF_XDP, SOCK_RAW, 0);
+  if (xdp->fd < 0) return -1;
+  xdp->umem_len = (size_t) XDP_FRAMES * XDP_FRAME_SIZE;
+  xdp->umem = mmap(NULL, xdp->umem_len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if (xdp->umem == MAP_FAILED) {
+    xdp->umem = NULL;
+    goto handle_errors;
+  }
+  struct xdp_umem_reg reg = {
+    .addr = (uintptr_t) xdp->umem,
+    .len = xdp->umem_len,
+    .chunk_size = XDP_FRAME_SIZE,
+  };
+  // the fill ring is never used (nothing is received), but binding needs one
+  int fill_size = 64, completion_size = XDP_COMPLETION_SIZE, tx_size = XDP_TX_SIZE;
+  if (setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0 ||
+      setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_FILL_RING, &fill_size, sizeof(int)) < 0 ||
+      setsockopt(xdp->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &completion_size,
+                 sizeof(int)) < 0 ||
+      setsockopt(xdp->fd, SOL_XDP, XDP_TX_RING, &tx_size, sizeof(int)) < 0)
+    goto handle_errors;
+
+  struct xdp_mmap_offsets offsets;
+  socklen_t offsets_len = sizeof(offsets);
+  if (getsockopt(xdp->fd, SOL_XDP, XDP_MMAP_OFFSETS, &offsets, &offsets_len) < 0 ||
+      ring_map(xdp->fd, &offsets.tx, sizeof(struct xdp_desc), XDP_TX_SIZE, XDP_PGOFF_TX_RING,
+               &xdp->tx, &xdp->tx_map, &xdp->tx_map_len) < 0 ||
+      ring_map(xdp->fd, &offsets.cr, sizeof(uint64_t), XDP_COMPLETION_SIZE,
+               XDP_UMEM_PGOFF_COMPLETION_RING, &xdp->completion, &xdp->completion_map,
+               &xdp->completion_map_len) < 0)
+    goto handle_errors;
+
+  struct sockaddr_xdp address = {
+    .sxdp_family = AF_XDP,
+    .sxdp_flags = XDP_ZEROCOPY | XDP_USE_NEED_WAKEUP,
+    .sxdp_ifindex = xdp->ifindex,
+    .sxdp_queue_id = queue,
+  };
+  xdp->zerocopy = bind(xdp->fd, (struct sockaddr *) &address, sizeof(address)) == 0;
+  if (!xdp->zerocopy) {
+    address.sxdp_flags = XDP_COPY | XDP_USE_NEED_WAKEUP;
+    if (bind(xdp->fd, (struct sockaddr *) &address, sizeof(address)) < 0) goto handle_errors;
+  }
+
+  xdp->tx.cached = atomic_load_explicit(xdp->tx.producer, memory_order_relaxed);
+  xdp->completion.cached = atomic_load_explicit(xdp->completion.consumer, memory_order_relaxed);
+  for (unsigned i = 0; i < XDP_FRAMES; ++i)
+    xdp->free_frames[xdp->free_count++] = (uint64_t) i * XDP_FRAME_SIZE;
+  return 0;
+
+  handle_ctl_errors:;
+  int saved_errno = errno;
+  close(ctl);
+  errno = saved_errno;
+  return -1;
+
+  handle_errors:
+  saved_errno = errno;
+  xdp_tx_destroy(xdp);
+  errno = saved_errno;
+  return -1;
+}
+
+void xdp_tx_destroy(struct xdp_tx *xdp) {
+  if (xdp->tx_map) munmap(xdp->tx_map, xdp->tx_map_len);
+  if (xdp->completion_map) munmap(xdp->completion_map, xdp->completion_map_len);
+  if (xdp->fd >= 0) close(xdp->fd);
+  if (xdp->umem) munmap(xdp->umem, xdp->umem_len);
+  xdp->tx_map = xdp->completion_map = NULL;
+  xdp->umem = NULL;
+  xdp->fd = -1;
+}
+
+/* frames the kernel is done with can be written again */
+static void reap(struct xdp_tx *xdp) {
+  struct xdp_ring *ring = &xdp->completion;
+  unsigned producer = atomic_load_explicit(ring->producer, memory_order_acquire);
+  const uint64_t *addresses = ring->descs;
+  for (; ring->cached != producer; ring->cached++)
+    xdp->free_frames[xdp->free_count++] = addresses[ring->cached & ring->mask];
+  atomic_store_explicit(ring->consumer, ring->cached, memory_order_release);
+}
+
+static unsigned tx_room(const struct xdp_tx *xdp) {
+  return XDP_TX_SIZE - (xdp->tx.cached -
+                        atomic_load_explicit(xdp->tx.consumer, memory_order_acquire));
+}
+
+void xdp_tx_kick(struct xdp_tx *xdp) {
+  struct xdp_ring *ring = &xdp->tx;
+  if (xdp->unsent > 0) {
+    atomic_store_explicit(ring->producer, ring->cached, memory_order_release);
+    xdp->unsent = 0;
+  }
+  for (unsigned i = 0; i < XDP_KICKS && tx_room(xdp) < XDP_TX_SIZE; ++i) {
+    // a zero-copy driver clears it while it is working through the ring itself
+    if (!(atomic_load_explicit(ring->flags, memory_order_relaxed) & XDP_RING_NEED_WAKEUP))
+      break;
+    if (sendto(xdp->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) < 0 && errno != EAGAIN &&
+        errno != EBUSY && errno != ENOBUFS && errno != EINTR)
+      break;
+  }
+  reap(xdp);
+}
+
+int xdp_tx_send(struct xdp_tx *xdp, const struct xdp_peer *peer, const void *dgram,
+                size_t len) {
+  size_t frame_len = XDP_HEADERS_LEN + len;
+  if (frame_len > XDP_FRAME_SIZE) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+  if (xdp->free_count == 0 || tx_room(xdp) == 0) {
+    xdp_tx_kick(xdp);
+    if (xdp->free_count == 0 || tx_room(xdp) == 0) {
+      errno = ENOBUFS;
+      return -1;
+    }
+  }
+  uint64_t offset = xdp->free_frames[--xdp->free_count];
+  unsigned char *frame = (unsigned char *) xdp->umem + offset;
+  memcpy(frame, peer->headers, XDP_HEADERS_LEN);
+  memcpy(frame + XDP_HEADERS_LEN, dgram, len);
+
+  // lengths and the IPv4 checksum are all that differ between frames to a peer
+  uint16_t ip_len = frame_len - IP_OFFSET;
+  uint32_t sum = peer->checksum + ip_len;
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  uint16_t checksum = htons(~sum), udp_len = htons(frame_len - UDP_OFFSET);
+  ip_len = htons(ip_len);
+  memcpy(frame + IP_OFFSET + offsetof(struct iphdr, tot_len), &ip_len, sizeof(ip_len));
+  memcpy(frame + IP_OFFSET + offsetof(struct iphdr, check), &checksum, sizeof(checksum));
+  memcpy(frame + UDP_OFFSET + offsetof(struct udphdr, len), &udp_len, sizeof(udp_len));
+
+  struct xdp_desc *desc = (struct xdp_desc *) xdp->tx.descs + (xdp->tx.cached & xdp->tx.mask);
+  desc->addr = offset;
+  desc->len = frame_len;
+  desc->options = 0;
+  xdp->tx.cached++;
+  xdp->unsent++;
+  return 0;
+}
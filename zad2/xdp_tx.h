@@ -0,0 +1,80 @@
+#ifndef _RADIO_XDP_TX_H_
+#define _RADIO_XDP_TX_H_
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* AF_XDP transmit for the fan-out: datagrams are written as whole
+ * Ethernet/IPv4/UDP frames into memory shared with the kernel (UMEM)
+ * and handed to one queue of an interface, past the UDP stack. Headers
+ * are built once per client, the next hop comes from /proc/net/route
+ * and its address from /proc/net/arp; clients not reachable through
+ * the interface are left to the socket. Zero-copy mode is tried first,
+ * copy mode (any driver, e.g. veth) otherwise.                        */
+
+#define XDP_FRAME_SIZE   2048
+#define XDP_FRAMES       4096
+#define XDP_HEADERS_LEN  42      // Ethernet, IPv4 and UDP
+
+#define XDP_TX_SIZE          2048
+#define XDP_COMPLETION_SIZE  XDP_FRAMES   // every frame can be in flight
+
+/* producer/consumer ring mapped from the socket */
+struct xdp_ring {
+  _Atomic unsigned *producer;
+  _Atomic unsigned *consumer;
+  _Atomic unsigned *flags;
+  void *descs;
+  unsigned mask;
+  unsigned cached;         // our own index (producer of tx, consumer of completion)
+};
+
+/* of one client */
+struct xdp_peer {
+  bool reachable;          // through the interface, otherwise the socket sends to it
+  time_t resolved;         // set by the owner, routes and neighbours change
+  uint32_t checksum;       // of the IPv4 header without its length, not folded
+  unsigned char headers[XDP_HEADERS_LEN];
+};
+
+struct xdp_tx {
+  int fd;
+  int ifindex;
+  char ifname[16];
+  unsigned char mac[6];
+  struct sockaddr_in source;  // frames come from the address and port of the UDP socket
+  bool zerocopy;
+  char *umem;
+  size_t umem_len;
+  void *tx_map;
+  size_t tx_map_len;
+  void *completion_map;
+  size_t completion_map_len;
+  struct xdp_ring tx;
+  struct xdp_ring completion;
+  uint64_t free_frames[XDP_FRAMES];  // UMEM offsets
+  unsigned free_count;
+  unsigned unsent;         // descriptors the kernel has not been told about
+};
+
+/* binds to queue of interface ifname; the UDP socket sock gives the
+ * source port (and address, unless it is bound to any)            */
+int xdp_tx_init(struct xdp_tx *xdp, const char *ifname, uint32_t queue, int sock);
+
+void xdp_tx_destroy(struct xdp_tx *xdp);
+
+/* headers for frames to address, NULL if out of memory; reads the
+ * routing and neighbour tables, so it is kept off the data path   */
+struct xdp_peer *xdp_peer_create(const struct xdp_tx *xdp, const struct sockaddr_in *address);
+
+/* queues a datagram to peer, -1 if there is no room even after a kick */
+int xdp_tx_send(struct xdp_tx *xdp, const struct xdp_peer *peer, const void *dgram,
+                size_t len);
+
+/* has the kernel send the queued frames, collects the sent ones */
+void xdp_tx_kick(struct xdp_tx *xdp);
+
+#endif  // _RADIO_XDP_TX_H_